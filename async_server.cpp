@@ -0,0 +1,745 @@
+#include "async_server.hpp"
+
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <cerrno>
+#include <charconv>
+#include <cstring>
+#include <format>
+#include <ranges>
+#include <span>
+#include <stdexcept>
+
+using namespace std;
+
+constexpr size_t read_size = 1 << 16;
+constexpr size_t max_events = 256;
+constexpr auto sweep_interval = 1s;
+constexpr string_view websocket_guid = "258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
+
+enum class opcode_t : uint8_t { CONTINUATION = 0x0, TEXT = 0x1, BINARY = 0x2, CLOSE = 0x8, PING = 0x9, PONG = 0xa };
+
+/**
+ * Convert ASCII letters to lower case.
+ * @param text The text.
+ * @return The text in lower case.
+ */
+string to_lower(const string_view text) {
+  string lower(text);
+  ranges::transform(lower, lower.begin(), [](const char c) { return c >= 'A' && c <= 'Z' ? c - 'A' + 'a' : c; });
+  return lower;
+}
+
+/**
+ * Remove the spaces and tabs around a header value.
+ * @param text The text.
+ * @return The text without surrounding whitespace.
+ */
+string_view trim(string_view text) {
+  while (!text.empty() && (text.front() == ' ' || text.front() == '\t')) text.remove_prefix(1);
+  while (!text.empty() && (text.back() == ' ' || text.back() == '\t')) text.remove_suffix(1);
+  return text;
+}
+
+/**
+ * Check whether a comma-separated header value lists a token, ignoring case.
+ * @param value The header value.
+ * @param token The token in lower case.
+ * @return Whether the value lists the token.
+ */
+bool has_token(const string_view value, const string_view token) {
+  for (const auto part: views::split(value, ',')) {
+    if (to_lower(trim(string_view(part.begin(), part.end()))) == token) return true;
+  }
+  return false;
+}
+
+/**
+ * Get the reason phrase of a status code.
+ * @param status The status code.
+ * @return The reason phrase, or an empty string for codes this server does not use.
+ */
+string_view status_text(const int status) {
+  switch (status) {
+    case 100: return "Continue";
+    case 101: return "Switching Protocols";
+    case 200: return "OK";
+    case 307: return "Temporary Redirect";
+    case 400: return "Bad Request";
+    case 401: return "Unauthorized";
+    case 403: return "Forbidden";
+    case 404: return "Not Found";
+    case 405: return "Method Not Allowed";
+    case 411: return "Length Required";
+    case 413: return "Payload Too Large";
+    case 415: return "Unsupported Media Type";
+    case 426: return "Upgrade Required";
+    case 429: return "Too Many Requests";
+    case 431: return "Request Header Fields Too Large";
+    case 500: return "Internal Server Error";
+    case 503: return "Service Unavailable";
+    default: return "";
+  }
+}
+
+/**
+ * Compute SHA-1 of data, which WebSocket requires for its handshake.
+ * @param data The data.
+ * @return The 20-byte digest.
+ */
+array<uint8_t, 20> sha1(const string_view data) {
+  uint32_t h[5] = { 0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476, 0xc3d2e1f0 };
+  string padded(data);
+  padded.push_back(static_cast<char>(0x80));
+  while (padded.size() % 64 != 56) padded.push_back('\0');
+  const uint64_t bits = static_cast<uint64_t>(data.size()) * 8;
+  for (int i = 7; i >= 0; i--) padded.push_back(static_cast<char>(bits >> (i * 8)));
+  for (size_t chunk = 0; chunk < padded.size(); chunk += 64) {
+    uint32_t w[80];
+    for (size_t i = 0; i < 16; i++) {
+      const auto *p = reinterpret_cast<const uint8_t *>(padded.data() + chunk + i * 4);
+      w[i] = static_cast<uint32_t>(p[0]) << 24 | static_cast<uint32_t>(p[1]) << 16 | p[2] << 8 | p[3];
+    }
+    for (size_t i = 16; i < 80; i++) w[i] = rotl(w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16], 1);
+    uint32_t a = h[0], b = h[1], c = h[2], d = h[3], e = h[4];
+    for (size_t i = 0; i < 80; i++) {
+      uint32_t f, k;
+      if (i < 20) f = (b & c) | (~b & d), k = 0x5a827999;
+      else if (i < 40) f = b ^ c ^ d, k = 0x6ed9eba1;
+      else if (i < 60) f = (b & c) | (b & d) | (c & d), k = 0x8f1bbcdc;
+      else f = b ^ c ^ d, k = 0xca62c1d6;
+      const uint32_t temp = rotl(a, 5) + f + e + k + w[i];
+      e = d, d = c, c = rotl(b, 30), b = a, a = temp;
+    }
+    h[0] += a, h[1] += b, h[2] += c, h[3] += d, h[4] += e;
+  }
+  array<uint8_t, 20> digest{};
+  for (size_t i = 0; i < 20; i++) digest[i] = static_cast<uint8_t>(h[i / 4] >> (24 - i % 4 * 8));
+  return digest;
+}
+
+/**
+ * Encode data in base64 with padding.
+ * @param data The data.
+ * @return The base64 text.
+ */
+string base64(const span<const uint8_t> data) {
+  constexpr char chars[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+  string text;
+  text.reserve((data.size() + 2) / 3 * 4);
+  for (size_t i = 0; i < data.size(); i += 3) {
+    uint32_t bits = data[i] << 16;
+    if (i + 1 < data.size()) bits |= data[i + 1] << 8;
+    if (i + 2 < data.size()) bits |= data[i + 2];
+    for (size_t j = 0; j < 4; j++) text.push_back(j <= data.size() - i ? chars[bits >> (18 - j * 6) & 0x3f] : '=');
+  }
+  return text;
+}
+
+/**
+ * Encode a frame from the server, which is never masked or fragmented.
+ * @param opcode The opcode.
+ * @param payload The payload.
+ * @return The frame.
+ */
+string encode_frame(const opcode_t opcode, const string_view payload) {
+  string frame;
+  frame.reserve(payload.size() + 10);
+  frame.push_back(static_cast<char>(0x80 | static_cast<uint8_t>(opcode)));
+  if (payload.size() < 126) {
+    frame.push_back(static_cast<char>(payload.size()));
+  } else if (payload.size() <= 0xffff) {
+    frame.push_back(126);
+    for (int i = 1; i >= 0; i--) frame.push_back(static_cast<char>(payload.size() >> (i * 8)));
+  } else {
+    frame.push_back(127);
+    for (int i = 7; i >= 0; i--) frame.push_back(static_cast<char>(static_cast<uint64_t>(payload.size()) >> (i * 8)));
+  }
+  frame.append(payload);
+  return frame;
+}
+
+/**
+ * Encode a close frame.
+ * @param code The status code of RFC 6455.
+ * @param reason The reason, which is cut to fit in a control frame.
+ * @return The frame.
+ */
+string encode_close_frame(const uint16_t code, const string_view reason) {
+  string payload{ static_cast<char>(code >> 8), static_cast<char>(code & 0xff) };
+  payload.append(reason.substr(0, 123));
+  return encode_frame(opcode_t::CLOSE, payload);
+}
+
+/**
+ * Parse the request line and headers of a request.
+ * @param head The request line and headers without the empty line after them.
+ * @param req The request to fill.
+ * @return Whether the head is valid HTTP/1.x.
+ */
+bool parse_head(const string_view head, async_server_t::request_t &req) {
+  size_t line_end = head.find("\r\n");
+  const string_view request_line = head.substr(0, line_end);
+  const size_t method_end = request_line.find(' ');
+  const size_t target_end = request_line.rfind(' ');
+  if (method_end == string_view::npos || target_end == method_end) return false;
+  if (!request_line.substr(target_end + 1).starts_with("HTTP/1.")) return false;
+  req.method = request_line.substr(0, method_end);
+  const string_view target = request_line.substr(method_end + 1, target_end - method_end - 1);
+  req.path = target.substr(0, target.find('?'));
+  if (req.path.empty() || req.path.front() != '/') return false;
+  req.headers.clear();
+  while (line_end != string_view::npos) {
+    const size_t start = line_end + 2;
+    line_end = head.find("\r\n", start);
+    const string_view line = head.substr(start, line_end == string_view::npos ? string_view::npos : line_end - start);
+    const size_t colon = line.find(':');
+    if (colon == string_view::npos || colon == 0) return false;
+    string name = to_lower(line.substr(0, colon));
+    const string_view value = trim(line.substr(colon + 1));
+    // repeated headers are combined into one list as RFC 9110 allows
+    if (const auto it = req.headers.find(name); it != req.headers.end()) it->second.append(", ").append(value);
+    else req.headers.emplace(move(name), value);
+  }
+  // HTTP/1.0 clients close the connection unless they ask otherwise
+  if (request_line.ends_with("HTTP/1.0") && !has_token(req.get_header("connection"), "keep-alive")) {
+    req.headers.insert_or_assign("connection", "close");
+  }
+  return true;
+}
+
+// request
+
+string_view async_server_t::request_t::get_header(const string_view name) const {
+  const auto it = headers.find(name);
+  return it == headers.end() ? string_view() : string_view(it->second);
+}
+
+// mailbox
+
+async_server_t::mailbox_t::mailbox_t() : event_fd(eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)), closed(false) {
+  if (event_fd < 0) throw runtime_error(format("Failed to create eventfd: {}", strerror(errno)));
+}
+
+async_server_t::mailbox_t::~mailbox_t() {
+  ::close(event_fd);
+}
+
+void async_server_t::mailbox_t::push(command_t command) {
+  {
+    lock_guard lock(mailbox_mutex);
+    if (closed) return;
+    commands.emplace_back(move(command));
+    // the loop is already woken up unless this is the first command since it took them
+    if (commands.size() > 1) return;
+  }
+  constexpr uint64_t one = 1;
+  (void) !write(event_fd, &one, sizeof(one));
+}
+
+vector<async_server_t::command_t> async_server_t::mailbox_t::take() {
+  uint64_t count;
+  (void) !read(event_fd, &count, sizeof(count));
+  lock_guard lock(mailbox_mutex);
+  return exchange(commands, {});
+}
+
+void async_server_t::mailbox_t::close() {
+  lock_guard lock(mailbox_mutex);
+  closed = true;
+  commands.clear();
+}
+
+// async server
+
+async_server_t::async_server_t(const size_t thread_count, const size_t body_limit, logger log_error)
+  : thread_count(clamp<size_t>(thread_count, 1, thread_limit)), body_limit(body_limit), log_error(move(log_error)),
+    running(false), connection_count(0) {}
+
+async_server_t::~async_server_t() {
+  stop();
+}
+
+void async_server_t::post(const string &path, handler handle) {
+  post_handlers.insert_or_assign(path, move(handle));
+}
+
+void async_server_t::websocket(const string &path, websocket_handler_t handler) {
+  websocket_handlers.insert_or_assign(path, move(handler));
+}
+
+void async_server_t::close_websocket(const uint64_t connection_id, const uint16_t code, const string_view reason) {
+  // loops do not change while the server runs, and stop keeps them until the server is destroyed
+  if (!running.load(memory_order_acquire)) return;
+  const size_t index = connection_id & (thread_limit - 1);
+  if (index >= loops.size()) return;
+  loops[index]->mailbox->push({ command_t::kind_t::CLOSE, connection_id, {}, encode_close_frame(code, reason) });
+}
+
+void async_server_t::dispatch(const uint64_t connection_id, function<void()> task) {
+  if (!running.load(memory_order_acquire)) return;
+  const size_t index = connection_id & (thread_limit - 1);
+  if (index >= loops.size()) return;
+  loops[index]->mailbox->push({ command_t::kind_t::RUN, connection_id, {}, {}, move(task) });
+}
+
+void async_server_t::listen(const string &host, const int port) {
+  addrinfo hints{};
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  hints.ai_flags = AI_PASSIVE;
+  addrinfo *addresses = nullptr;
+  const string service = to_string(port);
+  if (const int result = getaddrinfo(host.c_str(), service.c_str(), &hints, &addresses); result != 0) {
+    throw runtime_error(format("Failed to resolve {}: {}", host, gai_strerror(result)));
+  }
+  const unique_ptr<addrinfo, decltype(&freeaddrinfo)> address_list(addresses, freeaddrinfo);
+
+  try {
+    for (size_t i = 0; i < thread_count; i++) {
+      auto loop = make_unique<loop_t>();
+      loop->index = i;
+      loop->mailbox = make_shared<mailbox_t>();
+      loops.emplace_back(move(loop));
+      loop_t &current = *loops.back();
+      current.listen_fd = socket(addresses->ai_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+      if (current.listen_fd < 0) throw runtime_error(format("Failed to create a socket: {}", strerror(errno)));
+      constexpr int on = 1;
+      setsockopt(current.listen_fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+      // every loop binds the same port, and the kernel balances new connections between them
+      setsockopt(current.listen_fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on));
+      if (bind(current.listen_fd, addresses->ai_addr, addresses->ai_addrlen) != 0) {
+        throw runtime_error(format("Failed to bind {}:{}: {}", host, port, strerror(errno)));
+      }
+      if (::listen(current.listen_fd, SOMAXCONN) != 0) {
+        throw runtime_error(format("Failed to listen on {}:{}: {}", host, port, strerror(errno)));
+      }
+      current.epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+      if (current.epoll_fd < 0) throw runtime_error(format("Failed to create epoll: {}", strerror(errno)));
+      epoll_event event{ EPOLLIN, { .u64 = listen_id } };
+      epoll_ctl(current.epoll_fd, EPOLL_CTL_ADD, current.listen_fd, &event);
+      event.data.u64 = mailbox_id;
+      epoll_ctl(current.epoll_fd, EPOLL_CTL_ADD, current.mailbox->event_fd, &event);
+    }
+  } catch (...) {
+    for (const auto &loop: loops) close_loop(*loop);
+    loops.clear();
+    throw;
+  }
+  running.store(true, memory_order_release);
+  for (const auto &loop: loops) loop->worker = thread([this, &current = *loop] { run(current); });
+}
+
+void async_server_t::stop() {
+  if (!running.exchange(false)) return;
+  // an empty command only wakes the loop up to see that it has stopped
+  for (const auto &loop: loops) loop->mailbox->push({});
+  for (const auto &loop: loops) {
+    loop->worker.join();
+    close_loop(*loop);
+  }
+}
+
+size_t async_server_t::count_connections() const {
+  return connection_count.load(memory_order_relaxed);
+}
+
+void async_server_t::run(loop_t &loop) {
+  epoll_event events[max_events];
+  auto next_sweep = chrono::steady_clock::now() + sweep_interval;
+  while (running.load(memory_order_relaxed)) {
+    const auto timeout = chrono::duration_cast<chrono::milliseconds>(sweep_interval);
+    const int count = epoll_wait(loop.epoll_fd, events, max_events, static_cast<int>(timeout.count()));
+    if (count < 0 && errno != EINTR) {
+      log_error(format("Async server error: {}", strerror(errno)));
+      return;
+    }
+    for (int i = 0; i < count; i++) {
+      const uint64_t id = events[i].data.u64;
+      if (id == listen_id) {
+        accept_all(loop);
+        continue;
+      }
+      if (id == mailbox_id) {
+        for (command_t &command: loop.mailbox->take()) {
+          const auto it = loop.connections.find(command.connection_id);
+          // the client may have gone while the response was being prepared
+          if (it == loop.connections.end() || it->second.closing) continue;
+          connection_t &connection = it->second;
+          if (command.kind == command_t::kind_t::RUN) {
+            try {
+              command.task();
+            } catch (const exception &err) {
+              log_error(format("Internal server error: {}\n  when a dispatched task", err.what()));
+            }
+            continue;
+          }
+          if (command.kind == command_t::kind_t::RESPOND) {
+            if (!connection.waiting) continue;
+            connection.waiting = false;
+            respond(loop, command.connection_id, connection, command.response);
+            if (const auto again = loop.connections.find(command.connection_id); again != loop.connections.end()) {
+              process(loop, command.connection_id, again->second);
+            }
+            continue;
+          }
+          if (!connection.websocket) continue;
+          if (command.kind == command_t::kind_t::CLOSE) connection.closing = true;
+          send_frame(loop, command.connection_id, connection, command.frame);
+        }
+        continue;
+      }
+      const auto it = loop.connections.find(id);
+      if (it == loop.connections.end()) continue;
+      if (events[i].events & (EPOLLERR | EPOLLHUP)) {
+        close(loop, id);
+        continue;
+      }
+      if (events[i].events & EPOLLOUT) send_output(loop, id, it->second);
+      if (events[i].events & EPOLLIN) {
+        if (const auto again = loop.connections.find(id); again != loop.connections.end()) {
+          receive(loop, id, again->second);
+        }
+      }
+    }
+    if (const auto now = chrono::steady_clock::now(); now >= next_sweep) {
+      sweep(loop);
+      next_sweep = now + sweep_interval;
+    }
+  }
+}
+
+void async_server_t::accept_all(loop_t &loop) {
+  while (true) {
+    const int fd = accept4(loop.listen_fd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (fd < 0) {
+      if (errno == EINTR || errno == ECONNABORTED) continue;
+      if (errno != EAGAIN && errno != EWOULDBLOCK) log_error(format("Failed to accept: {}", strerror(errno)));
+      return;
+    }
+    // responses are written whole, so Nagle's algorithm would only delay the end of each
+    constexpr int on = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+    const uint64_t id = loop.next_id++ << 8 | loop.index;
+    epoll_event event{ EPOLLIN, { .u64 = id } };
+    if (epoll_ctl(loop.epoll_fd, EPOLL_CTL_ADD, fd, &event) != 0) {
+      ::close(fd);
+      continue;
+    }
+    const auto now = chrono::steady_clock::now();
+    loop.connections.emplace(
+      id, connection_t{ fd, {}, {}, 0, false, true, false, false, false, false, now, now, nullptr, {}, false }
+    );
+    connection_count.fetch_add(1, memory_order_relaxed);
+  }
+}
+
+void async_server_t::receive(loop_t &loop, const uint64_t id, connection_t &connection) {
+  char buffer[read_size];
+  const ssize_t size = read(connection.fd, buffer, sizeof(buffer));
+  if (size < 0) {
+    if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) close(loop, id);
+    return;
+  }
+  // a client which stops sending while its request waits has given up on the response
+  if (size == 0) {
+    close(loop, id);
+    return;
+  }
+  const auto now = chrono::steady_clock::now();
+  if (connection.input.empty()) connection.request_start = now;
+  connection.last_active = now;
+  connection.pinged = false;
+  connection.input.append(buffer, static_cast<size_t>(size));
+  if (connection.input.size() > header_limit + body_limit + read_size) {
+    // pipelined requests behind a waiting one are not read until it is answered
+    close(loop, id);
+    return;
+  }
+  if (connection.websocket) process_frames(loop, id, connection);
+  else if (!connection.waiting) process(loop, id, connection);
+}
+
+void async_server_t::process(loop_t &loop, const uint64_t id, connection_t &connection) {
+  const auto reject = [&](const int status) {
+    connection.keep_alive = false;
+    respond(loop, id, connection, { status, {}, {}, {} });
+  };
+  while (!connection.waiting && !connection.closing && !connection.input.empty()) {
+    const size_t head_end = connection.input.find("\r\n\r\n");
+    if (head_end == string::npos || head_end > header_limit) {
+      if (connection.input.size() > header_limit) reject(431);
+      return;
+    }
+    request_t req;
+    req.connection_id = id;
+    if (!parse_head(string_view(connection.input).substr(0, head_end), req)) return reject(400);
+    // chunked bodies are not supported, as clients of this server always know the size of their bodies
+    if (!req.get_header("transfer-encoding").empty()) return reject(411);
+    const string_view encoding = req.get_header("content-encoding");
+    if (!encoding.empty() && to_lower(encoding) != "identity") return reject(415);
+    size_t length = 0;
+    if (const string_view value = req.get_header("content-length"); !value.empty()) {
+      const auto result = from_chars(value.data(), value.data() + value.size(), length);
+      if (result.ec != errc() || result.ptr != value.data() + value.size()) return reject(400);
+    }
+    if (length > body_limit) return reject(413);
+    const size_t body_start = head_end + 4;
+    if (connection.input.size() < body_start + length) {
+      if (!connection.continued && has_token(req.get_header("expect"), "100-continue")) {
+        connection.continued = true;
+        connection.output.append("HTTP/1.1 100 Continue\r\n\r\n");
+        send_output(loop, id, connection);
+      }
+      return;
+    }
+    req.body = connection.input.substr(body_start, length);
+    connection.input.erase(0, body_start + length);
+    connection.request_start = connection.last_active;
+    connection.continued = false;
+    connection.keep_alive = !has_token(req.get_header("connection"), "close");
+
+    if (const auto ws = websocket_handlers.find(req.path); ws != websocket_handlers.end()) {
+      if (req.method != "GET") return reject(405);
+      return upgrade(loop, id, connection, req, ws->second);
+    }
+    const auto it = post_handlers.find(req.path);
+    if (it == post_handlers.end()) return reject(404);
+    if (req.method != "POST") return reject(405);
+    connection.waiting = true;
+    try {
+      it->second(
+        req,
+        [mailbox = loop.mailbox, id](response_t res) {
+          mailbox->push({ command_t::kind_t::RESPOND, id, move(res), {} });
+        }
+      );
+    } catch (const exception &err) {
+      log_error(format("Internal server error: {}\n  when {} {}", err.what(), req.method, req.path));
+      connection.waiting = false;
+      respond(loop, id, connection, { 500, {}, {}, {} });
+    }
+    // the connection may have been closed while responding
+    if (!loop.connections.contains(id)) return;
+  }
+}
+
+void async_server_t::upgrade(
+  loop_t &loop, const uint64_t id, connection_t &connection, const request_t &req, const websocket_handler_t &handler
+) {
+  // the client would otherwise send its frames behind a refused upgrade
+  const auto reject = [&](const response_t &res) {
+    connection.keep_alive = false;
+    respond(loop, id, connection, res);
+  };
+  const string_view key = req.get_header("sec-websocket-key");
+  if (!has_token(req.get_header("upgrade"), "websocket") || !has_token(req.get_header("connection"), "upgrade") ||
+    key.empty()) {
+    return reject({ 400, {}, {}, {} });
+  }
+  if (req.get_header("sec-websocket-version") != "13") {
+    return reject({ 426, {}, { { "Sec-WebSocket-Version", "13" } }, {} });
+  }
+  if (handler.accept && !handler.accept(req)) return reject({ 404, {}, {}, {} });
+  const auto digest = sha1(string(key) + string(websocket_guid));
+  connection.output.append(
+    format(
+      "HTTP/1.1 101 Switching Protocols\r\nUpgrade: websocket\r\nConnection: Upgrade\r\n"
+      "Sec-WebSocket-Accept: {}\r\n\r\n",
+      base64(digest)
+    )
+  );
+  connection.websocket = &handler;
+  send_output(loop, id, connection);
+  // frames sent right behind the handshake
+  if (const auto it = loop.connections.find(id); it != loop.connections.end()) process_frames(loop, id, it->second);
+}
+
+void async_server_t::process_frames(loop_t &loop, const uint64_t id, connection_t &connection) {
+  const auto fail = [&](const uint16_t code, const string_view reason) {
+    connection.closing = true;
+    connection.output.append(encode_close_frame(code, reason));
+    send_output(loop, id, connection);
+  };
+  while (!connection.closing) {
+    const string &input = connection.input;
+    if (input.size() < 2) return;
+    const auto byte = [&](const size_t i) { return static_cast<uint8_t>(input[i]); };
+    const bool fin = byte(0) & 0x80;
+    const auto opcode = static_cast<opcode_t>(byte(0) & 0x0f);
+    // no extension is negotiated, and clients must mask their frames
+    if ((byte(0) & 0x70) != 0 || !(byte(1) & 0x80)) return fail(1002, "Invalid frame.");
+    uint64_t length = byte(1) & 0x7f;
+    size_t offset = 2;
+    if (length >= 126) {
+      const size_t size = length == 126 ? 2 : 8;
+      if (input.size() < offset + size) return;
+      length = 0;
+      for (size_t i = 0; i < size; i++) length = length << 8 | byte(offset + i);
+      offset += size;
+    }
+    const bool control = static_cast<uint8_t>(opcode) >= 0x8;
+    if (control && (!fin || length > 125)) return fail(1002, "Invalid control frame.");
+    if (length > body_limit || connection.message.size() + length > body_limit) return fail(1009, "Message too big.");
+    if (input.size() < offset + 4 + length) return;
+    string payload = input.substr(offset + 4, length);
+    for (size_t i = 0; i < payload.size(); i++) payload[i] = static_cast<char>(payload[i] ^ input[offset + i % 4]);
+    connection.input.erase(0, offset + 4 + length);
+
+    switch (opcode) {
+      case opcode_t::CONTINUATION:
+        if (!connection.in_message) return fail(1002, "Unexpected continuation.");
+        connection.message.append(payload);
+        break;
+      case opcode_t::TEXT:
+        return fail(1003, "Only binary messages are supported.");
+      case opcode_t::BINARY:
+        if (connection.in_message) return fail(1002, "Unfinished message.");
+        connection.message = move(payload);
+        connection.in_message = true;
+        break;
+      case opcode_t::CLOSE:
+        // echo the status code, as the client expects, and close once it is sent
+        connection.closing = true;
+        connection.output.append(encode_frame(opcode_t::CLOSE, string_view(payload).substr(0, 2)));
+        send_output(loop, id, connection);
+        return;
+      case opcode_t::PING:
+        send_frame(loop, id, connection, encode_frame(opcode_t::PONG, payload));
+        if (!loop.connections.contains(id)) return;
+        continue;
+      case opcode_t::PONG:
+        continue;
+      default:
+        return fail(1002, "Unknown opcode.");
+    }
+    if (!fin) continue;
+    const string message = exchange(connection.message, {});
+    connection.in_message = false;
+    try {
+      connection.websocket->on_message(
+        id,
+        message,
+        [mailbox = loop.mailbox, id](const string &message) {
+          mailbox->push({ command_t::kind_t::SEND, id, {}, encode_frame(opcode_t::BINARY, message) });
+        }
+      );
+    } catch (const exception &err) {
+      log_error(format("Internal server error: {}\n  when a WebSocket message", err.what()));
+      return fail(1011, "Internal server error.");
+    }
+  }
+}
+
+void async_server_t::send_frame(loop_t &loop, const uint64_t id, connection_t &connection, const string_view frame) {
+  // a client which stops reading would otherwise pile up every frame pushed to it
+  if (connection.output.size() - connection.written > body_limit) {
+    close(loop, id);
+    return;
+  }
+  connection.output.append(frame);
+  send_output(loop, id, connection);
+}
+
+void async_server_t::respond(loop_t &loop, const uint64_t id, connection_t &connection, const response_t &res) {
+  string &output = connection.output;
+  output.append(format("HTTP/1.1 {} {}\r\n", res.status, status_text(res.status)));
+  if (!res.content_type.empty()) output.append(format("Content-Type: {}\r\n", res.content_type));
+  for (const auto &[name, value]: res.headers) output.append(format("{}: {}\r\n", name, value));
+  output.append(format("Content-Length: {}\r\n", res.body.size()));
+  if (!connection.keep_alive) {
+    output.append("Connection: close\r\n");
+    connection.closing = true;
+  }
+  output.append("\r\n").append(res.body);
+  connection.last_active = chrono::steady_clock::now();
+  send_output(loop, id, connection);
+}
+
+void async_server_t::send_output(loop_t &loop, const uint64_t id, connection_t &connection) {
+  while (connection.written < connection.output.size()) {
+    const ssize_t size = send(
+      connection.fd, connection.output.data() + connection.written, connection.output.size() - connection.written,
+      MSG_NOSIGNAL
+    );
+    if (size < 0) {
+      if (errno == EINTR) continue;
+      if (errno != EAGAIN && errno != EWOULDBLOCK) {
+        close(loop, id);
+        return;
+      }
+      if (!connection.polling_out) {
+        epoll_event event{ EPOLLIN | EPOLLOUT, { .u64 = id } };
+        epoll_ctl(loop.epoll_fd, EPOLL_CTL_MOD, connection.fd, &event);
+        connection.polling_out = true;
+      }
+      return;
+    }
+    connection.written += static_cast<size_t>(size);
+  }
+  connection.output.clear();
+  connection.written = 0;
+  if (connection.polling_out) {
+    epoll_event event{ EPOLLIN, { .u64 = id } };
+    epoll_ctl(loop.epoll_fd, EPOLL_CTL_MOD, connection.fd, &event);
+    connection.polling_out = false;
+  }
+  if (connection.closing) close(loop, id);
+}
+
+void async_server_t::close(loop_t &loop, const uint64_t id) {
+  const auto it = loop.connections.find(id);
+  if (it == loop.connections.end()) return;
+  // closing the socket also removes it from epoll
+  ::close(it->second.fd);
+  const websocket_handler_t *websocket = it->second.websocket;
+  loop.connections.erase(it);
+  connection_count.fetch_sub(1, memory_order_relaxed);
+  if (websocket && websocket->on_close) websocket->on_close(id);
+}
+
+void async_server_t::sweep(loop_t &loop) {
+  const auto now = chrono::steady_clock::now();
+  vector<uint64_t> expired, pinged;
+  for (auto &[id, connection]: loop.connections) {
+    if (connection.websocket) {
+      if (now - connection.last_active > websocket_timeout) {
+        expired.emplace_back(id);
+      } else if (now - connection.last_active > websocket_ping_interval && !connection.pinged && !connection.closing) {
+        connection.pinged = true;
+        connection.output.append(encode_frame(opcode_t::PING, {}));
+        pinged.emplace_back(id);
+      }
+      continue;
+    }
+    // waiting requests are always answered, as rounds close within their wait timeout
+    if (connection.waiting || !connection.output.empty()) continue;
+    const auto since = connection.input.empty() ? connection.last_active : connection.request_start;
+    if (now - since > keep_alive_timeout) expired.emplace_back(id);
+  }
+  for (const uint64_t id: expired) close(loop, id);
+  for (const uint64_t id: pinged) {
+    if (const auto it = loop.connections.find(id); it != loop.connections.end()) send_output(loop, id, it->second);
+  }
+}
+
+void async_server_t::close_loop(loop_t &loop) {
+  loop.mailbox->close();
+  for (const auto &[id, connection]: loop.connections) {
+    ::close(connection.fd);
+    if (connection.websocket && connection.websocket->on_close) connection.websocket->on_close(id);
+  }
+  connection_count.fetch_sub(loop.connections.size(), memory_order_relaxed);
+  loop.connections.clear();
+  if (loop.epoll_fd >= 0) ::close(loop.epoll_fd);
+  if (loop.listen_fd >= 0) ::close(loop.listen_fd);
+}
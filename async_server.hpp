@@ -0,0 +1,201 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+// HTTP/1.1 and WebSocket server driven by epoll for responses which are ready only later, such as rounds closing.
+// A handler gets the request on a loop thread with a responder, which any thread may call once the response is ready.
+// WebSocket messages are pushed the same way, so neither waiting requests nor open sockets hold a thread,
+// and the number of threads stays fixed however many clients wait.
+// Each loop thread has its own listening socket on the same port, and the kernel spreads connections over them.
+class async_server_t {
+public:
+  using logger = std::function<void(const std::string &)>;
+
+  struct request_t {
+    std::string method, path;
+    std::map<std::string, std::string, std::less<>> headers; // by lower-case name
+    std::string body;
+    uint64_t connection_id = 0;
+
+    // Returns an empty string if the request has no such header.
+    [[nodiscard]] std::string_view get_header(std::string_view name) const;
+  };
+
+  struct response_t {
+    int status = 200;
+    std::string content_type;
+    std::vector<std::pair<std::string, std::string>> headers;
+    std::string body;
+  };
+
+  // Sends the response of a request. Call it once from any thread, even after the server has stopped.
+  using responder = std::function<void(response_t res)>;
+  using handler = std::function<void(const request_t &req, responder respond)>;
+
+  // Sends a binary message on a WebSocket connection. Call it from any thread, even after the connection has closed.
+  using sender = std::function<void(std::string message)>;
+
+  struct websocket_handler_t {
+    // Called with the upgrade request. Returns false to answer 404 instead of upgrading.
+    std::function<bool(const request_t &req)> accept;
+    // Called for each binary message. Text messages close the connection.
+    std::function<void(uint64_t connection_id, std::string_view message, const sender &send)> on_message;
+    // Called once the connection has closed for any reason, including stop.
+    std::function<void(uint64_t connection_id)> on_close;
+  };
+
+  static constexpr size_t header_limit = 8192;
+  // also the time a client has to send a whole request
+  static constexpr std::chrono::seconds keep_alive_timeout{ 5 };
+  // a quiet WebSocket is pinged after the interval and closed if nothing arrives before the timeout
+  static constexpr std::chrono::seconds websocket_ping_interval{ 15 }, websocket_timeout{ 45 };
+  static constexpr size_t thread_limit = 256;
+
+  const size_t thread_count;
+  const size_t body_limit;
+  const logger log_error;
+
+  [[nodiscard]] explicit async_server_t(
+    size_t thread_count, size_t body_limit, logger log_error = [](const std::string &) {}
+  );
+
+  async_server_t(const async_server_t &) = delete;
+
+  async_server_t &operator=(const async_server_t &) = delete;
+
+  ~async_server_t();
+
+  // Routes the POST requests to a path. Routes must be added before listen.
+  void post(const std::string &path, handler handle);
+
+  // Accepts WebSocket upgrades on a path. Messages larger than body_limit close the connection.
+  void websocket(const std::string &path, websocket_handler_t handler);
+
+  // Sends a close frame and closes a WebSocket connection from any thread. Does nothing if it has closed.
+  void close_websocket(uint64_t connection_id, uint16_t code, std::string_view reason);
+
+  // Runs a task on the loop thread of a connection from any thread, so that the work of preparing its response is
+  // spread over the loops instead of falling on the caller. Does nothing if the connection has closed.
+  void dispatch(uint64_t connection_id, std::function<void()> task);
+
+  // Binds the port and starts the loop threads. Throws runtime_error if the port cannot be bound.
+  void listen(const std::string &host, int port);
+
+  // Closes every connection and joins the loop threads. Responders called later do nothing.
+  void stop();
+
+  [[nodiscard]] size_t count_connections() const;
+
+protected:
+  struct command_t {
+    enum class kind_t { RESPOND, SEND, CLOSE, RUN } kind;
+    uint64_t connection_id;
+    response_t response; // for RESPOND
+    std::string frame; // for SEND and CLOSE
+    std::function<void()> task; // for RUN
+  };
+
+  // The part of a loop which responders keep, so that it outlives the server.
+  class mailbox_t {
+  public:
+    const int event_fd;
+
+    [[nodiscard]] explicit mailbox_t();
+
+    mailbox_t(const mailbox_t &) = delete;
+
+    mailbox_t &operator=(const mailbox_t &) = delete;
+
+    ~mailbox_t();
+
+    // Wakes the loop up. Does nothing once the mailbox is closed.
+    void push(command_t command);
+
+    [[nodiscard]] std::vector<command_t> take();
+
+    void close();
+
+  protected:
+    std::mutex mailbox_mutex;
+    std::vector<command_t> commands;
+    bool closed;
+  };
+
+  struct connection_t {
+    int fd;
+    std::string input, output;
+    size_t written; // bytes of output already sent
+    bool waiting; // a request is with its handler, so later requests wait in input
+    bool keep_alive;
+    bool closing; // closed once the output is sent
+    bool continued; // 100 Continue has been sent for the request in input
+    bool polling_out;
+    bool pinged;
+    std::chrono::steady_clock::time_point last_active, request_start;
+    const websocket_handler_t *websocket; // set once upgraded
+    std::string message; // fragments of a message received so far
+    bool in_message;
+  };
+
+  // Only its own thread touches a loop after listen, except through the mailbox.
+  struct loop_t {
+    size_t index = 0;
+    int epoll_fd = -1, listen_fd = -1;
+    std::shared_ptr<mailbox_t> mailbox;
+    std::unordered_map<uint64_t, connection_t> connections;
+    uint64_t next_id = 1; // connection IDs are this shifted left by 8 bits with the index of the loop below
+    std::thread worker;
+  };
+
+  // epoll data of the listening socket and the mailbox, below every connection ID
+  static constexpr uint64_t listen_id = 0, mailbox_id = 1;
+
+  std::map<std::string, handler, std::less<>> post_handlers;
+  std::map<std::string, websocket_handler_t, std::less<>> websocket_handlers;
+  std::vector<std::unique_ptr<loop_t>> loops;
+  std::atomic<bool> running;
+  std::atomic<size_t> connection_count;
+
+  void run(loop_t &loop);
+
+  void accept_all(loop_t &loop);
+
+  void receive(loop_t &loop, uint64_t id, connection_t &connection);
+
+  // Handles the requests complete in the input until one has to wait for its handler.
+  void process(loop_t &loop, uint64_t id, connection_t &connection);
+
+  // Answers an upgrade request and switches the connection to WebSocket frames.
+  void upgrade(
+    loop_t &loop, uint64_t id, connection_t &connection, const request_t &req, const websocket_handler_t &handler
+  );
+
+  // Handles the frames complete in the input.
+  void process_frames(loop_t &loop, uint64_t id, connection_t &connection);
+
+  // Queues a frame and sends as much as the socket takes. Closes the connection if the client stops reading.
+  void send_frame(loop_t &loop, uint64_t id, connection_t &connection, std::string_view frame);
+
+  // Queues a response behind the output and sends as much as the socket takes.
+  void respond(loop_t &loop, uint64_t id, connection_t &connection, const response_t &res);
+
+  void send_output(loop_t &loop, uint64_t id, connection_t &connection);
+
+  void close(loop_t &loop, uint64_t id);
+
+  // Closes connections which have been idle or slow to send a request for longer than keep_alive_timeout.
+  void sweep(loop_t &loop);
+
+  void close_loop(loop_t &loop);
+};
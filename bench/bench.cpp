@@ -0,0 +1,430 @@
+// In-process microbenchmarks of the room and sync core. Each result is written to stdout as a JSON line.
+
+#include "../cluster.hpp"
+#include "../session.hpp"
+#include "../room_list.hpp"
+#include "../room.hpp"
+#include "../sync_record.hpp"
+#include "../event_budget.hpp"
+#include "../timer_queue.hpp"
+#include "../timer_wheel.hpp"
+#include "../sync_codec.hpp"
+#include "../gzip.hpp"
+#include "../snapshot.hpp"
+
+#include <nlohmann/json.hpp>
+#include <boost/uuid.hpp>
+#include <atomic>
+#include <barrier>
+#include <chrono>
+#include <filesystem>
+#include <thread>
+#include <iostream>
+#include <format>
+#include <string>
+#include <vector>
+#include <functional>
+#include <memory>
+#include <cstdlib>
+
+using namespace std;
+using namespace boost::uuids;
+
+using json = nlohmann::json;
+
+/**
+ * Get the value of an environment variable or a default value.
+ * @param key The name of the environment variable.
+ * @param default_value The default value.
+ * @return The value of the environment variable if it exists, or the default value.
+ */
+string getenv_or(const string &key, const string &default_value) {
+  const char *value = getenv(key.c_str());
+  return value ? value : default_value;
+}
+
+// constants
+
+const string filter = getenv_or("FILTER", "");
+const double scale = stod(getenv_or("SCALE", "1"));
+
+constexpr size_t event_count = 4;
+constexpr size_t payload_size = 32;
+constexpr size_t room_count = 1000;
+constexpr size_t session_count = 1000;
+constexpr size_t history_limit = 100;
+
+// runner
+
+/**
+ * Run a benchmark on some threads and print its result as a JSON line.
+ * @param name The name of the benchmark.
+ * @param threads The number of threads.
+ * @param iterations The number of iterations of each thread, before scaling.
+ * @param op The operation, called with the thread index and the iteration index.
+ */
+void run(const string &name, const size_t threads, const size_t iterations, const function<void(size_t, size_t)> &op) {
+  if (name.find(filter) == string::npos) return;
+  const size_t scaled = max<size_t>(1, static_cast<size_t>(static_cast<double>(iterations) * scale));
+  barrier start_barrier(static_cast<ptrdiff_t>(threads + 1));
+  vector<thread> workers;
+  for (size_t t = 0; t < threads; t++) {
+    workers.emplace_back(
+      [&, t] {
+        start_barrier.arrive_and_wait();
+        for (size_t i = 0; i < scaled; i++) op(t, i);
+      }
+    );
+  }
+  // read the clock before releasing the workers, which may run to completion before this thread resumes
+  const auto start_time = chrono::steady_clock::now();
+  start_barrier.arrive_and_wait();
+  for (thread &worker: workers) worker.join();
+  const chrono::duration<double, nano> elapsed = chrono::steady_clock::now() - start_time;
+  const double ops = static_cast<double>(threads * scaled);
+  cout << json{
+    { "name", name },
+    { "threads", threads },
+    { "iterations", threads * scaled },
+    { "ns_per_op", elapsed.count() / ops },
+    { "ops_per_sec", ops / elapsed.count() * 1e9 }
+  }.dump() << endl;
+}
+
+// fixtures
+
+/**
+ * Generate events as a client would send them.
+ * @param count The number of events.
+ * @return The events.
+ */
+json gen_request_events(const size_t count) {
+  thread_local time_generator_v7 gen_id;
+  json events = json::array();
+  for (size_t i = 0; i < count; i++) {
+    events.push_back({ { "id", to_string(gen_id()) }, { "type", "bench" }, { "event", string(payload_size, 'x') } });
+  }
+  return events;
+}
+
+/**
+ * Generate the events of a user as the server receives them.
+ * @param count The number of events.
+ * @return The events. Their views point into static storage.
+ */
+vector<sync_record_t::new_event_t> gen_record_events(const size_t count) {
+  thread_local time_generator_v7 gen_id;
+  static const string data = [] {
+    string data;
+    json::to_msgpack(string(payload_size, 'x'), data);
+    return data;
+  }();
+  vector<sync_record_t::new_event_t> events;
+  for (size_t i = 0; i < count; i++) events.emplace_back(gen_id(), "bench", data);
+  return events;
+}
+
+/**
+ * Create a started room filled with users.
+ * @param room_list The room list.
+ * @return The room and the IDs of its users.
+ */
+pair<shared_ptr<room_t>, vector<uuid>> create_room(room_list_t &room_list) {
+  const room_t::user_t owner("owner");
+  const auto room = room_list.create("bench", owner, room_t::size_max);
+  vector<uuid> user_ids{ owner.id };
+  for (size_t i = 1; i < room_t::size_max; i++) {
+    const room_t::user_t user(format("player{}", i));
+    room->join("bench", user);
+    user_ids.emplace_back(user.id);
+  }
+  room->start_game();
+  return { room, user_ids };
+}
+
+/**
+ * Sync a user and wait for the round to close.
+ * @param room The room.
+ * @param user_id The ID of the user.
+ * @param reports The reports of the user.
+ * @param actions The actions of the user.
+ * @return The records delivered to the user.
+ */
+room_t::sync_result_t sync_and_wait(
+  room_t &room, const uuid &user_id, const span<const sync_record_t::new_event_t> reports,
+  const span<const sync_record_t::new_event_t> actions
+) {
+  atomic<bool> done = false;
+  room_t::sync_result_t result;
+  room.sync(
+    user_id,
+    reports,
+    actions,
+    [&](const exception_ptr &error, room_t::sync_result_t records) {
+      if (error) rethrow_exception(error);
+      result = move(records);
+      done.store(true, memory_order_release);
+      done.notify_one();
+    }
+  );
+  done.wait(false, memory_order_acquire);
+  return result;
+}
+
+// benchmarks
+
+void bench_sync_record() {
+  vector<uuid> user_ids(room_t::size_max);
+  for (uuid &user_id: user_ids) user_id = room_t::user_t("user").id;
+  vector<vector<sync_record_t::new_event_t>> events;
+  for (size_t i = 0; i < user_ids.size(); i++) events.emplace_back(gen_record_events(event_count));
+
+  run(
+    "sync_record/add_events_seal_write", 1, 20000,
+    [&](size_t, size_t) {
+      sync_record_t record;
+      for (size_t i = 0; i < user_ids.size(); i++) record.add_events(user_ids[i], i, events[i], events[i]);
+      record.seal();
+      string buffer;
+      msgpack_writer_t writer(buffer);
+      for (const uuid &user_id: user_ids) {
+        record.write_reports(writer, user_id, nil_uuid());
+        record.write_actions(writer, nil_uuid());
+      }
+    }
+  );
+
+  sync_record_t record;
+  for (size_t i = 0; i < user_ids.size(); i++) record.add_events(user_ids[i], i, events[i], events[i]);
+  record.seal();
+  for (const size_t threads: { 1, 4 }) {
+    run("sync_record/get_reports", threads, 100000, [&](size_t, size_t) { (void) record.get_reports(); });
+  }
+}
+
+void bench_session_list() {
+  for (const auto mode: { session_list_t::mode_t::MAP, session_list_t::mode_t::TOKEN }) {
+    session_list_t session_list(mode);
+    vector<string> session_ids;
+    for (size_t i = 0; i < session_count; i++) {
+      session_ids.emplace_back(session_list.create(room_t::user_t("room").id, room_t::user_t("user").id).id);
+    }
+    const string name = mode == session_list_t::mode_t::TOKEN ? "session_list/get_token" : "session_list/get";
+    for (const size_t threads: { 1, 4 }) {
+      run(
+        name, threads, 500000,
+        [&](const size_t t, const size_t i) { (void) session_list.get(session_ids[(t * 7919 + i) % session_count]); }
+      );
+    }
+  }
+}
+
+void bench_room_list() {
+  for (const size_t count: { room_count, 100 * room_count }) {
+    const cluster_t cluster;
+    event_budget_t event_budget(SIZE_MAX, SIZE_MAX);
+    timer_queue_t timer_queue;
+    timer_wheel_t timer_wheel;
+    room_list_t room_list(cluster, count, 60min, 60min, 60min, history_limit, timer_queue, timer_wheel, event_budget);
+    vector<string> names;
+    for (size_t i = 0; i < count; i++) {
+      names.emplace_back(room_list.create("bench", room_t::user_t("owner"), room_t::size_max)->name);
+    }
+    for (const size_t threads: { 1, 4 }) {
+      run(
+        format("room_list/get_name/{}", count), threads, 500000,
+        [&](const size_t t, const size_t i) { (void) room_list.get(names[(t * 7919 + i) % count]); }
+      );
+    }
+
+    // the list is full, so each thread removes one of its own rooms before creating one
+    run(
+      format("room_list/remove_create/{}", count), 4, 20000,
+      [&](const size_t t, const size_t i) {
+        string &name = names[(i * 4 + t) % count];
+        (void) room_list.remove(room_list.get(name)->id);
+        name = room_list.create("bench", room_t::user_t("owner"), room_t::size_max)->name;
+      }
+    );
+  }
+}
+
+void bench_room_sync() {
+  const cluster_t cluster;
+  event_budget_t event_budget(SIZE_MAX, SIZE_MAX);
+  timer_queue_t timer_queue;
+  timer_wheel_t timer_wheel;
+  room_list_t room_list(
+    cluster, room_count, 60min, 60min, 60min, history_limit, timer_queue, timer_wheel, event_budget
+  );
+
+  // every user of one room syncs from its own thread, so each round closes when the last one arrives
+  const auto [room, user_ids] = create_room(room_list);
+  vector<vector<sync_record_t::new_event_t>> events;
+  for (size_t i = 0; i < user_ids.size(); i++) events.emplace_back(gen_record_events(event_count));
+  run(
+    "room/sync_one_room", user_ids.size(), 5000,
+    [&](const size_t t, const size_t i) {
+      (void) sync_and_wait(*room, user_ids[t], events[t], events[t]);
+      if (t == 0 && i % 64 == 0) room->clean_sync_records();
+    }
+  );
+
+  // each thread plays its share of rooms round by round, and the last user of each room closes the round inline
+  vector<pair<shared_ptr<room_t>, vector<uuid>>> rooms;
+  vector<vector<vector<sync_record_t::new_event_t>>> room_events;
+  for (size_t i = 0; i < room_count - 1; i++) {
+    rooms.emplace_back(create_room(room_list));
+    auto &user_events = room_events.emplace_back();
+    for (size_t u = 0; u < rooms.back().second.size(); u++) user_events.emplace_back(gen_record_events(event_count));
+  }
+  const size_t threads = max(1u, thread::hardware_concurrency());
+  const size_t rooms_per_thread = (rooms.size() + threads - 1) / threads;
+  run(
+    "room/sync_many_rooms", threads, rooms_per_thread * 20,
+    [&](const size_t t, const size_t i) {
+      const size_t r = t + i % rooms_per_thread * threads;
+      if (r >= rooms.size()) return;
+      auto &[target, target_user_ids] = rooms[r];
+      for (size_t u = 0; u < target_user_ids.size(); u++) {
+        const auto &user_events = room_events[r][u];
+        target->sync(target_user_ids[u], user_events, user_events, [](const exception_ptr &, const auto &) {});
+      }
+      if (i / rooms_per_thread % 8 == 0) target->clean_sync_records();
+    }
+  );
+}
+
+void bench_snapshot() {
+  constexpr size_t count = 10 * room_count;
+  const string path = (filesystem::temp_directory_path() / "shoutwars_bench.snapshot").string();
+  const cluster_t cluster;
+  event_budget_t event_budget(SIZE_MAX, SIZE_MAX);
+  timer_queue_t timer_queue;
+  timer_wheel_t timer_wheel;
+  room_list_t room_list(cluster, count, 60min, 60min, 60min, history_limit, timer_queue, timer_wheel, event_budget);
+  session_list_t session_list;
+  vector<pair<shared_ptr<room_t>, vector<uuid>>> rooms;
+  for (size_t i = 0; i < count; i++) {
+    const auto &[room, user_ids] = rooms.emplace_back(create_room(room_list));
+    for (const uuid &user_id: user_ids) (void) session_list.create(room->id, user_id);
+  }
+  // the last user of each room lags, so the rooms keep the rounds it has not received
+  const auto events = gen_record_events(event_count);
+  for (size_t round = 0; round < 2; round++) {
+    for (const auto &[room, user_ids]: rooms) {
+      for (size_t u = 0; u + 1 < user_ids.size(); u++) {
+        room->sync(user_ids[u], events, events, [](const exception_ptr &, const auto &) {});
+      }
+    }
+    // the rounds close on timer_queue
+    this_thread::sleep_for(200ms);
+  }
+
+  run(
+    format("snapshot/save/{}", count), 1, 5,
+    [&](size_t, size_t) { (void) save_snapshot(path, room_list, session_list); }
+  );
+  // as on a restart, including building and tearing down the room list
+  run(
+    format("snapshot/load/{}", count), 1, 5,
+    [&](size_t, size_t) {
+      event_budget_t loaded_budget(SIZE_MAX, SIZE_MAX);
+      timer_queue_t loaded_queue;
+      timer_wheel_t loaded_wheel;
+      room_list_t loaded_rooms(
+        cluster, count, 60min, 60min, 60min, history_limit, loaded_queue, loaded_wheel, loaded_budget
+      );
+      session_list_t loaded_sessions;
+      if (load_snapshot(path, loaded_rooms, loaded_sessions) != count) throw runtime_error("Rooms not restored.");
+    }
+  );
+  filesystem::remove(path);
+}
+
+void bench_sync_codec() {
+  const json request = {
+    { "session_id", to_string(room_t::user_t("session").id) },
+    { "room_info", { { "round", 1 } } },
+    { "reports", gen_request_events(event_count) },
+    { "actions", gen_request_events(event_count) }
+  };
+  const auto msgpack = json::to_msgpack(request);
+  const string body(msgpack.begin(), msgpack.end());
+  run("sync_codec/parse_sync_request", 1, 200000, [&](size_t, size_t) { (void) parse_sync_request(body); });
+  run(
+    "sync_codec/parse_sync_request_dom", 1, 200000,
+    [&](size_t, size_t) { const json dom = json::from_msgpack(body); }
+  );
+
+  const cluster_t cluster;
+  event_budget_t event_budget(SIZE_MAX, SIZE_MAX);
+  timer_queue_t timer_queue;
+  timer_wheel_t timer_wheel;
+  room_list_t room_list(cluster, 1, 60min, 60min, 60min, history_limit, timer_queue, timer_wheel, event_budget);
+  const auto [room, user_ids] = create_room(room_list);
+  vector<thread> players;
+  vector<room_t::sync_result_t> records(user_ids.size());
+  for (size_t i = 0; i < user_ids.size(); i++) {
+    players.emplace_back(
+      [&, i] {
+        const auto events = gen_record_events(event_count);
+        records[i] = sync_and_wait(*room, user_ids[i], events, events);
+      }
+    );
+  }
+  for (thread &player: players) player.join();
+  run(
+    "sync_codec/gen_sync_response", 1, 200000,
+    [&](size_t, size_t) { (void) gen_sync_response(*room, user_ids.front(), records.front()); }
+  );
+  run(
+    "sync_codec/gen_sync_response_unchanged", 1, 200000,
+    [&, users_version = room->get_users_version(), info_version = room->get_info()->version](size_t, size_t) {
+      (void) gen_sync_response(*room, user_ids.front(), records.front(), users_version, info_version);
+    }
+  );
+  const string response = gen_sync_response(*room, user_ids.front(), records.front());
+  run(
+    "sync_codec/gzip_sync_response", 1, 20000,
+    [&](size_t, size_t) { (void) gzip_sync_response(response, records.front()); }
+  );
+  run(
+    "sync_codec/gzip_sync_response_whole", 1, 20000,
+    [&](size_t, size_t) {
+      gzip_writer_t writer;
+      writer.write(response);
+      (void) writer.finish();
+    }
+  );
+  run(
+    "sync_codec/gen_sync_response_dom", 1, 200000,
+    [&](size_t, size_t) {
+      json reports = json::array(), actions = json::array();
+      for (const auto &report: records.front().records.back()->get_reports()) {
+        if (report.from != user_ids.front()) reports.push_back(report);
+      }
+      for (const auto &action: records.front().records.back()->get_actions()) actions.push_back(action);
+      (void) json::to_msgpack(
+        {
+          { "id", to_string(records.front().records.back()->id) },
+          { "reports", reports },
+          { "actions", actions },
+          { "room_users", room->get_users() }
+        }
+      );
+    }
+  );
+}
+
+// entry point
+
+int main() {
+  bench_sync_record();
+  bench_session_list();
+  bench_room_list();
+  bench_room_sync();
+  bench_snapshot();
+  bench_sync_codec();
+  return 0;
+}
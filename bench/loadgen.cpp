@@ -0,0 +1,314 @@
+// Load generator which plays many rooms against a local server and reports sync latency.
+
+#include <nlohmann/json.hpp>
+#include <httplib.h>
+#include <boost/uuid.hpp>
+#include <chrono>
+#include <thread>
+#include <random>
+#include <iostream>
+#include <format>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <ranges>
+#include <cstdlib>
+
+using namespace std;
+using namespace boost::uuids;
+
+using json = nlohmann::json;
+
+/**
+ * Get the value of an environment variable or a default value.
+ * @param key The name of the environment variable.
+ * @param default_value The default value.
+ * @return The value of the environment variable if it exists, or the default value.
+ */
+string getenv_or(const string &key, const string &default_value) {
+  const char *value = getenv(key.c_str());
+  return value ? value : default_value;
+}
+
+// constants
+
+const string api = getenv_or("API", "http://localhost:7468/v2");
+// /room/sync on API redirects to ASYNC_PORT, so it is sent there directly to keep the connection alive
+const string sync_api = getenv_or("SYNC_API", "http://localhost:7469/v2");
+const string password = getenv_or("PASSWORD", "");
+const string version = getenv_or("VERSION", "loadgen");
+const size_t room_count = stoul(getenv_or("ROOMS", "10"));
+const size_t room_size = stoul(getenv_or("ROOM_SIZE", "4"));
+const size_t round_count = stoul(getenv_or("ROUNDS", "100"));
+const size_t event_count = stoul(getenv_or("EVENTS", "2"));
+const size_t payload_size = stoul(getenv_or("PAYLOAD_SIZE", "32"));
+const chrono::milliseconds jitter(stoi(getenv_or("JITTER", "50")));
+
+/**
+ * Split the URL of an API into its scheme and host, and its path prefix.
+ * @param url The URL, such as http://localhost:7468/v2.
+ * @return The scheme and host, such as http://localhost:7468, and the prefix, such as /v2.
+ */
+pair<string, string> split_api(const string &url) {
+  const size_t host_end = url.find('/', url.find("://") + 3);
+  return { url.substr(0, host_end), host_end == string::npos ? "" : url.substr(host_end) };
+}
+
+constexpr auto sync_interval = 100ms;
+
+/**
+ * Check that an API is served on the loopback interface, so that load is never sent to a remote server.
+ * @param url The URL of the API.
+ * @return Whether the host of the API is a loopback address.
+ */
+bool is_loopback_api(const string &url) {
+  const string host = url.substr(url.find("://") + 3);
+  return host.starts_with("localhost") || host.starts_with("127.") || host.starts_with("[::1]");
+}
+
+// API client
+
+class api_client_t {
+public:
+  /**
+   * @param url The URL of the API.
+   */
+  explicit api_client_t(const string &url = api) : client(split_api(url).first), prefix(split_api(url).second) {
+    if (!password.empty()) headers.emplace("Authorization", "Bearer " + password);
+    client.set_keep_alive(true);
+    client.set_read_timeout(10);
+    // rooms and sessions owned by other nodes of a cluster are redirected to them
+    client.set_follow_location(true);
+  }
+
+  /**
+   * Send a msgpack request.
+   * @param path The path of the endpoint.
+   * @param body The request body.
+   * @return The status code and the response body. The status code is 0 if the request failed.
+   */
+  pair<int, json> post(const string &path, const json &body) {
+    const auto msgpack = json::to_msgpack(body);
+    const auto res = client.Post(
+      prefix + path, headers, string(msgpack.begin(), msgpack.end()), "application/msgpack"
+    );
+    if (!res) return { 0, nullptr };
+    try {
+      return { res->status, res->body.empty() ? json(nullptr) : json::from_msgpack(res->body) };
+    } catch (const json::exception &) {
+      return { res->status, nullptr };
+    }
+  }
+
+  string get_text(const string &path) {
+    const auto res = client.Get(prefix + path, headers);
+    return res && res->status == 200 ? res->body : "";
+  }
+
+protected:
+  httplib::Client client;
+  const string prefix;
+  httplib::Headers headers;
+};
+
+// results
+
+struct player_result_t {
+  vector<double> latencies; // ms
+  size_t syncs = 0, events_sent = 0, events_received = 0, too_many = 0, errors = 0;
+};
+
+/**
+ * Read the closed round counters from the metrics of the server.
+ * @return The number of rounds closed by timeout and by all users arriving.
+ */
+pair<double, double> get_round_counts() {
+  api_client_t client;
+  const string text = client.get_text("/metrics");
+  double timeout = 0, all_arrived = 0;
+  for (const auto line: views::split(text, '\n')) {
+    const string_view row(line.begin(), line.end());
+    const size_t space = row.rfind(' ');
+    if (space == string_view::npos) continue;
+    if (row.starts_with(R"(shoutwars_rounds_total{reason="timeout"})")) timeout = stod(string(row.substr(space + 1)));
+    if (row.starts_with(R"(shoutwars_rounds_total{reason="all_arrived"})")) {
+      all_arrived = stod(string(row.substr(space + 1)));
+    }
+  }
+  return { timeout, all_arrived };
+}
+
+/**
+ * Play the sync loop of a player.
+ * @param session_id The session ID of the player.
+ * @param is_owner Whether the player is the owner of the room.
+ * @param result The result to write into.
+ */
+void run_player(const string &session_id, const bool is_owner, player_result_t &result) {
+  api_client_t client(sync_api);
+  thread_local time_generator_v7 gen_id;
+  thread_local mt19937_64 gen_rand(random_device{}());
+  uniform_int_distribution<long long> dist_jitter(0, jitter.count());
+  const string payload(payload_size, 'x');
+  uint64_t users_version = 0, info_version = 0;
+  for (size_t round = 0; round < round_count; round++) {
+    this_thread::sleep_for(sync_interval + chrono::milliseconds(dist_jitter(gen_rand)));
+    json reports = json::array(), actions = json::array();
+    for (size_t i = 0; i < event_count; i++) {
+      reports.push_back({ { "id", to_string(gen_id()) }, { "type", "load" }, { "event", payload } });
+      actions.push_back({ { "id", to_string(gen_id()) }, { "type", "load" }, { "event", payload } });
+    }
+    json req = {
+      { "session_id", session_id },
+      { "users_version", users_version },
+      { "info_version", info_version },
+      { "reports", reports },
+      { "actions", actions }
+    };
+    if (is_owner) req["room_info"] = round;
+
+    const auto start_time = chrono::steady_clock::now();
+    const auto [status, res] = client.post("/room/sync", req);
+    const chrono::duration<double, milli> latency = chrono::steady_clock::now() - start_time;
+    if (status == 429) {
+      result.too_many++;
+      continue;
+    }
+    if (status != 200) {
+      result.errors++;
+      if (status == 401 || status == 403 || status == 404) return;
+      continue;
+    }
+    result.latencies.emplace_back(latency.count());
+    result.syncs++;
+    result.events_sent += event_count * 2;
+    result.events_received += res.at("reports").size() + res.at("actions").size();
+    users_version = res.at("users_version");
+    info_version = res.at("info_version");
+  }
+}
+
+/**
+ * Create a room, fill it with players, start the game and play it.
+ * @param index The index of the room.
+ * @param results The results of the players of the room.
+ */
+void run_room(const size_t index, vector<player_result_t> &results) {
+  api_client_t client;
+  const auto [create_status, created] = client.post(
+    "/room/create",
+    { { "version", version }, { "user", { { "name", format("owner{}", index) } } }, { "size", room_size } }
+  );
+  if (create_status != 200) {
+    cerr << format("Room {}: create failed with {}", index, create_status) << endl;
+    return;
+  }
+  vector<string> session_ids{ created.at("session_id") };
+  for (size_t i = 1; i < room_size; i++) {
+    const auto [status, joined] = client.post(
+      "/room/join",
+      { { "version", version }, { "name", created.at("name") }, { "user", { { "name", format("player{}", i) } } } }
+    );
+    if (status != 200) {
+      cerr << format("Room {}: join failed with {}", index, status) << endl;
+      return;
+    }
+    session_ids.emplace_back(joined.at("session_id"));
+  }
+  if (const auto [status, _] = client.post("/room/start", { { "session_id", session_ids.front() } }); status != 200) {
+    cerr << format("Room {}: start failed with {}", index, status) << endl;
+    return;
+  }
+
+  vector<thread> players;
+  for (size_t i = 0; i < session_ids.size(); i++) {
+    players.emplace_back(run_player, cref(session_ids[i]), i == 0, ref(results[i]));
+  }
+  for (thread &player: players) player.join();
+}
+
+/**
+ * Get a percentile of sorted values.
+ * @param sorted The sorted values.
+ * @param p The percentile between 0 and 1.
+ * @return The percentile, or 0 if there are no values.
+ */
+double percentile(const vector<double> &sorted, const double p) {
+  if (sorted.empty()) return 0;
+  return sorted[min(sorted.size() - 1, static_cast<size_t>(p * static_cast<double>(sorted.size())))];
+}
+
+// entry point
+
+int main() {
+  for (const string &url: { api, sync_api }) {
+    if (!is_loopback_api(url)) {
+      cerr << format("API must be on the loopback interface: {}", url) << endl;
+      return 1;
+    }
+  }
+  if (room_size < 2 || room_size > 4) {
+    cerr << "ROOM_SIZE must be between 2 and 4." << endl;
+    return 1;
+  }
+  cout << format(
+    "Playing {} rooms of {} players, {} rounds, {} reports and actions of {} bytes, jitter {} ms against {}",
+    room_count,
+    room_size,
+    round_count,
+    event_count,
+    payload_size,
+    jitter.count(),
+    api
+  ) << endl;
+
+  const auto [timeout_before, all_arrived_before] = get_round_counts();
+  vector<vector<player_result_t>> results(room_count, vector<player_result_t>(room_size));
+  const auto start_time = chrono::steady_clock::now();
+  vector<thread> rooms;
+  for (size_t i = 0; i < room_count; i++) rooms.emplace_back(run_room, i, ref(results[i]));
+  for (thread &room: rooms) room.join();
+  const chrono::duration<double> elapsed = chrono::steady_clock::now() - start_time;
+  const auto [timeout_after, all_arrived_after] = get_round_counts();
+
+  player_result_t total;
+  for (const auto &room_results: results) {
+    for (const player_result_t &result: room_results) {
+      total.latencies.insert(total.latencies.end(), result.latencies.begin(), result.latencies.end());
+      total.syncs += result.syncs;
+      total.events_sent += result.events_sent;
+      total.events_received += result.events_received;
+      total.too_many += result.too_many;
+      total.errors += result.errors;
+    }
+  }
+  ranges::sort(total.latencies);
+  const double timeout_rounds = timeout_after - timeout_before;
+  const double rounds = timeout_rounds + all_arrived_after - all_arrived_before;
+
+  cout << format("elapsed: {:.2f} s", elapsed.count()) << endl;
+  cout << format(
+    "syncs: {} ({:.1f}/s), events sent: {} ({:.1f}/s), events received: {} ({:.1f}/s)",
+    total.syncs,
+    total.syncs / elapsed.count(),
+    total.events_sent,
+    total.events_sent / elapsed.count(),
+    total.events_received,
+    total.events_received / elapsed.count()
+  ) << endl;
+  cout << format(
+    "sync latency: p50 {:.2f} ms, p99 {:.2f} ms, p999 {:.2f} ms, max {:.2f} ms",
+    percentile(total.latencies, 0.5),
+    percentile(total.latencies, 0.99),
+    percentile(total.latencies, 0.999),
+    total.latencies.empty() ? 0.0 : total.latencies.back()
+  ) << endl;
+  if (rounds > 0) {
+    cout << format("rounds: {}, closed by timeout: {} ({:.1f}%)", rounds, timeout_rounds, timeout_rounds / rounds * 100)
+         << endl;
+  } else {
+    cout << "rounds: unknown (metrics not available)" << endl;
+  }
+  cout << format("429: {}, errors: {}", total.too_many, total.errors) << endl;
+  return total.errors > 0 ? 1 : 0;
+}
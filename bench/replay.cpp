@@ -0,0 +1,409 @@
+// Replays a trace recorded with TRACE_PATH against a local server and compares the latency with the recording.
+
+#include "../trace.hpp"
+#include "../msgpack.hpp"
+
+#include <httplib.h>
+#include <chrono>
+#include <condition_variable>
+#include <fstream>
+#include <iterator>
+#include <iostream>
+#include <format>
+#include <map>
+#include <mutex>
+#include <optional>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+#include <algorithm>
+#include <ranges>
+#include <cstdlib>
+
+using namespace std;
+
+/**
+ * Get the value of an environment variable or a default value.
+ * @param key The name of the environment variable.
+ * @param default_value The default value.
+ * @return The value of the environment variable if it exists, or the default value.
+ */
+string getenv_or(const string &key, const string &default_value) {
+  const char *value = getenv(key.c_str());
+  return value ? value : default_value;
+}
+
+// constants
+
+const string api = getenv_or("API", "http://localhost:7468/v2");
+// /room/sync on API redirects to ASYNC_PORT, so it is sent there directly to keep the connection alive
+const string sync_api = getenv_or("SYNC_API", "http://localhost:7469/v2");
+const string password = getenv_or("PASSWORD", "");
+const string trace_path = getenv_or("TRACE", "trace.bin");
+const double speed = stod(getenv_or("SPEED", "1"));
+
+/**
+ * Split the URL of an API into its scheme and host, and its path prefix.
+ * @param url The URL, such as http://localhost:7468/v2.
+ * @return The scheme and host, such as http://localhost:7468, and the prefix, such as /v2.
+ */
+pair<string, string> split_api(const string &url) {
+  const size_t host_end = url.find('/', url.find("://") + 3);
+  return { url.substr(0, host_end), host_end == string::npos ? "" : url.substr(host_end) };
+}
+
+// the server rejects sync requests sent sooner than this after the previous one, however fast the replay is
+constexpr auto sync_interval = 100ms;
+constexpr auto room_name_timeout = 30s;
+
+/**
+ * Check that an API is served on the loopback interface, so that load is never sent to a remote server.
+ * @param url The URL of the API.
+ * @return Whether the host of the API is a loopback address.
+ */
+bool is_loopback_api(const string &url) {
+  const string host = url.substr(url.find("://") + 3);
+  return host.starts_with("localhost") || host.starts_with("127.") || host.starts_with("[::1]");
+}
+
+/**
+ * Get the endpoint of a recorded path, which is the path without its API version.
+ * @param path The path, such as /v2/room/sync.
+ * @return The endpoint, such as /room/sync.
+ */
+string get_endpoint(const string &path) {
+  const size_t slash = path.find('/', 1);
+  return slash == string::npos ? path : path.substr(slash);
+}
+
+// API client
+
+class api_client_t {
+public:
+  /**
+   * @param url The URL of the API.
+   */
+  explicit api_client_t(const string &url = api) : client(split_api(url).first), prefix(split_api(url).second) {
+    if (!password.empty()) headers.emplace("Authorization", "Bearer " + password);
+    client.set_keep_alive(true);
+    client.set_read_timeout(10);
+    // rooms and sessions owned by other nodes of a cluster are redirected to them
+    client.set_follow_location(true);
+  }
+
+  /**
+   * Send a msgpack request.
+   * @param endpoint The endpoint.
+   * @param body The msgpack request body.
+   * @return The status code and the response body. The status code is 0 if the request failed.
+   */
+  pair<int, string> post(const string &endpoint, const string &body) {
+    const auto res = client.Post(prefix + endpoint, headers, body, "application/msgpack");
+    if (!res) return { 0, "" };
+    return { res->status, res->body };
+  }
+
+protected:
+  httplib::Client client;
+  const string prefix;
+  httplib::Headers headers;
+};
+
+// room names
+
+// The names of the rooms created by the replay, by the names they had in the trace.
+// Joins wait here until the room they join has been created again.
+class room_names_t {
+public:
+  /**
+   * Set the new name of a room.
+   * @param old_name The name in the trace.
+   * @param new_name The name in the replay, or nullopt if the room could not be created.
+   */
+  void publish(const string &old_name, optional<string> new_name) {
+    {
+      lock_guard lock(names_mutex);
+      names.insert_or_assign(old_name, move(new_name));
+    }
+    published.notify_all();
+  }
+
+  /**
+   * Wait for the new name of a room.
+   * @param old_name The name in the trace.
+   * @return The name in the replay, or nullopt if the room was not created in time.
+   */
+  optional<string> wait(const string &old_name) {
+    unique_lock lock(names_mutex);
+    published.wait_for(lock, room_name_timeout, [&] { return names.contains(old_name); });
+    const auto it = names.find(old_name);
+    return it == names.end() ? nullopt : it->second;
+  }
+
+protected:
+  mutex names_mutex;
+  condition_variable published;
+  map<string, optional<string>> names;
+};
+
+// results
+
+struct endpoint_result_t {
+  vector<double> recorded, replayed; // ms
+  size_t status_mismatches = 0, errors = 0;
+};
+
+using client_result_t = map<string, endpoint_result_t>;
+
+/**
+ * Read the string values of the top level of a msgpack map.
+ * @param body The msgpack map.
+ * @param keys The keys to read.
+ * @return The values of the keys found, by key.
+ */
+map<string, string> read_strings(const string_view body, const vector<string_view> &keys) {
+  map<string, string> values;
+  try {
+    msgpack_reader_t reader(body);
+    const size_t size = reader.map();
+    for (size_t i = 0; i < size; i++) {
+      const string_view key = reader.str();
+      if (ranges::find(keys, key) != keys.end()) values.emplace(key, reader.str());
+      else reader.skip();
+    }
+  } catch (const exception &) {}
+  return values;
+}
+
+/**
+ * Replace the session ID and the room name of a request body, keeping every other value as recorded.
+ * @param body The recorded msgpack request body.
+ * @param session_id The session ID of the replay, or empty to keep the recorded one.
+ * @param name The room name of the replay, or empty to keep the recorded one.
+ * @return The msgpack request body to send.
+ */
+string rewrite_body(const string_view body, const string &session_id, const string &name) {
+  try {
+    msgpack_reader_t reader(body);
+    string msgpack;
+    msgpack_writer_t writer(msgpack);
+    const size_t size = reader.map();
+    writer.map(size);
+    for (size_t i = 0; i < size; i++) {
+      const string_view key = reader.str();
+      const string_view value = reader.skip();
+      writer.str(key);
+      if (key == "session_id" && !session_id.empty()) writer.str(session_id);
+      else if (key == "name" && !name.empty()) writer.str(name);
+      else writer.raw(value);
+    }
+    return msgpack;
+  } catch (const exception &) {
+    // the server rejected it as recorded, and will again
+    return string(body);
+  }
+}
+
+/**
+ * Replay the requests of a client, each at its recorded time scaled by SPEED.
+ * @param entries The requests of the client, the first of which creates its session.
+ * @param trace_start The time of the first request of the trace.
+ * @param start The time at which the replay of the first request of the trace starts.
+ * @param room_names The names of the rooms created by the replay.
+ * @param result The result to write into.
+ */
+void run_client(
+  const vector<const trace_entry_t *> &entries, const chrono::system_clock::time_point trace_start,
+  const chrono::steady_clock::time_point start, room_names_t &room_names, client_result_t &result
+) {
+  api_client_t client, sync_client(sync_api);
+  string session_id;
+  auto last_sync_time = chrono::steady_clock::time_point::min();
+  for (const trace_entry_t *entry: entries) {
+    const string endpoint = get_endpoint(entry->path);
+    endpoint_result_t &endpoint_result = result[endpoint];
+    const chrono::duration<double, micro> offset = entry->time - trace_start;
+    auto send_time = start + chrono::duration_cast<chrono::steady_clock::duration>(offset / speed);
+    if (endpoint == "/room/sync") send_time = max(send_time, last_sync_time + sync_interval);
+    this_thread::sleep_until(send_time);
+
+    string name;
+    if (endpoint == "/room/join") {
+      const optional<string> new_name = room_names.wait(read_strings(entry->body, { "name" })["name"]);
+      if (!new_name) {
+        endpoint_result.errors++;
+        return;
+      }
+      name = *new_name;
+    }
+    const string body = rewrite_body(entry->body, session_id, name);
+    const auto start_time = chrono::steady_clock::now();
+    if (endpoint == "/room/sync") last_sync_time = start_time;
+    const auto [status, res] = (endpoint == "/room/sync" ? sync_client : client).post(endpoint, body);
+    const chrono::duration<double, milli> latency = chrono::steady_clock::now() - start_time;
+    if (status == 0) {
+      endpoint_result.errors++;
+      if (endpoint == "/room/create") room_names.publish(read_strings(*entry->response, { "name" })["name"], nullopt);
+      return;
+    }
+    endpoint_result.recorded.emplace_back(chrono::duration<double, milli>(entry->latency).count());
+    endpoint_result.replayed.emplace_back(latency.count());
+    if (status != entry->status) endpoint_result.status_mismatches++;
+
+    if (endpoint == "/room/create" || endpoint == "/room/join") {
+      auto values = read_strings(res, { "session_id", "name" });
+      const bool created = status == 200 && values.contains("session_id");
+      if (endpoint == "/room/create") {
+        room_names.publish(
+          read_strings(*entry->response, { "name" })["name"], created ? optional(values["name"]) : nullopt
+        );
+      }
+      // the rest of the requests of the client have no session
+      if (!created) return;
+      session_id = values["session_id"];
+    }
+  }
+}
+
+/**
+ * Get a percentile of sorted values.
+ * @param sorted The sorted values.
+ * @param p The percentile between 0 and 1.
+ * @return The percentile, or 0 if there are no values.
+ */
+double percentile(const vector<double> &sorted, const double p) {
+  if (sorted.empty()) return 0;
+  return sorted[min(sorted.size() - 1, static_cast<size_t>(p * static_cast<double>(sorted.size())))];
+}
+
+/**
+ * Format the latency distribution of sorted values.
+ * @param sorted The sorted latencies in ms.
+ * @return The percentiles and the maximum.
+ */
+string format_latency(const vector<double> &sorted) {
+  return format(
+    "p50 {:.2f} ms, p99 {:.2f} ms, p999 {:.2f} ms, max {:.2f} ms",
+    percentile(sorted, 0.5),
+    percentile(sorted, 0.99),
+    percentile(sorted, 0.999),
+    sorted.empty() ? 0.0 : sorted.back()
+  );
+}
+
+// entry point
+
+int main() {
+  for (const string &url: { api, sync_api }) {
+    if (!is_loopback_api(url)) {
+      cerr << format("API must be on the loopback interface: {}", url) << endl;
+      return 1;
+    }
+  }
+  if (speed <= 0) {
+    cerr << "SPEED must be positive." << endl;
+    return 1;
+  }
+  ifstream file(trace_path, ios::binary);
+  if (!file) {
+    cerr << format("Failed to open {}", trace_path) << endl;
+    return 1;
+  }
+  vector<trace_entry_t> trace;
+  try {
+    trace = read_trace(string(istreambuf_iterator<char>(file), istreambuf_iterator<char>()));
+  } catch (const exception &err) {
+    cerr << err.what() << endl;
+    return 1;
+  }
+  // requests are written when they complete, so a long sync is written after requests which arrived later
+  ranges::stable_sort(trace, {}, &trace_entry_t::time);
+
+  // A client starts with a request which created a session and continues with every request using it.
+  // Requests of sessions created before the trace and everything but /room/ requests are skipped.
+  vector<vector<const trace_entry_t *>> clients;
+  map<string, size_t> client_indexes;
+  set<string> created_names;
+  size_t skipped = 0;
+  for (const trace_entry_t &entry: trace) {
+    const string endpoint = get_endpoint(entry.path);
+    const bool creates_session = endpoint == "/room/create" || endpoint == "/room/join";
+    if (creates_session && entry.status == 200 && entry.response && !entry.session_id.empty()) {
+      // joins of rooms created before the trace have no room to join
+      if (endpoint == "/room/join" && !created_names.contains(read_strings(entry.body, { "name" })["name"])) {
+        skipped++;
+        continue;
+      }
+      if (endpoint == "/room/create") created_names.insert(read_strings(*entry.response, { "name" })["name"]);
+      client_indexes.insert_or_assign(entry.session_id, clients.size());
+      clients.push_back({ &entry });
+      continue;
+    }
+    const auto it = client_indexes.find(entry.session_id);
+    const bool replayable = entry.method == "POST" && endpoint.starts_with("/room/");
+    if (it == client_indexes.end() || !replayable) {
+      skipped++;
+      continue;
+    }
+    clients[it->second].push_back(&entry);
+  }
+  if (clients.empty()) {
+    cerr << format("No sessions were created in {}", trace_path) << endl;
+    return 1;
+  }
+  cout << format(
+    "Replaying {} requests of {} clients from {} at {}x against {} ({} requests skipped)",
+    trace.size() - skipped,
+    clients.size(),
+    trace_path,
+    speed,
+    api,
+    skipped
+  ) << endl;
+
+  room_names_t room_names;
+  vector<client_result_t> results(clients.size());
+  const auto trace_start = clients.front().front()->time;
+  const auto start_time = chrono::steady_clock::now();
+  vector<thread> threads;
+  for (size_t i = 0; i < clients.size(); i++) {
+    threads.emplace_back(run_client, cref(clients[i]), trace_start, start_time, ref(room_names), ref(results[i]));
+  }
+  for (thread &client: threads) client.join();
+  const chrono::duration<double> elapsed = chrono::steady_clock::now() - start_time;
+  const chrono::duration<double> recorded_elapsed = trace.back().time - trace_start;
+
+  client_result_t total;
+  for (const client_result_t &result: results) {
+    for (const auto &[endpoint, endpoint_result]: result) {
+      endpoint_result_t &total_result = total[endpoint];
+      total_result.recorded.insert(
+        total_result.recorded.end(), endpoint_result.recorded.begin(), endpoint_result.recorded.end()
+      );
+      total_result.replayed.insert(
+        total_result.replayed.end(), endpoint_result.replayed.begin(), endpoint_result.replayed.end()
+      );
+      total_result.status_mismatches += endpoint_result.status_mismatches;
+      total_result.errors += endpoint_result.errors;
+    }
+  }
+
+  cout << format("elapsed: {:.2f} s (recorded {:.2f} s)", elapsed.count(), recorded_elapsed.count()) << endl;
+  size_t errors = 0;
+  for (auto &[endpoint, result]: total) {
+    ranges::sort(result.recorded);
+    ranges::sort(result.replayed);
+    errors += result.errors;
+    cout << format(
+      "{}: {} requests, status mismatches: {}, errors: {}",
+      endpoint,
+      result.replayed.size(),
+      result.status_mismatches,
+      result.errors
+    ) << endl;
+    cout << format("  recorded: {}", format_latency(result.recorded)) << endl;
+    cout << format("  replayed: {}", format_latency(result.replayed)) << endl;
+  }
+  return errors > 0 ? 1 : 0;
+}
@@ -0,0 +1,68 @@
+#include "cluster.hpp"
+
+#include <algorithm>
+#include <charconv>
+#include <format>
+#include <stdexcept>
+#include <utility>
+
+using namespace std;
+
+// cluster
+
+cluster_t::cluster_t(const size_t node_id, vector<string> node_urls) : node_id(node_id), node_urls(move(node_urls)) {
+  if (node_id >= count()) {
+    throw invalid_argument(format("Invalid node ID: {}. Must be less than the node count {}.", node_id, count()));
+  }
+}
+
+size_t cluster_t::count() const {
+  return node_urls.empty() ? 1 : node_urls.size();
+}
+
+bool cluster_t::is_local(const size_t node) const {
+  return node == node_id;
+}
+
+size_t cluster_t::get_name_owner(const uint32_t name_number) const {
+  return name_number % count();
+}
+
+const string &cluster_t::get_url(const size_t node) const {
+  return node_urls.at(node);
+}
+
+string cluster_t::get_url(const size_t node, const int port_offset) const {
+  const string &url = get_url(node);
+  if (port_offset == 0) return url;
+  const size_t scheme_end = url.find("://");
+  const size_t host_begin = scheme_end == string::npos ? 0 : scheme_end + 3;
+  const size_t host_end = min(url.find('/', host_begin), url.size());
+  const string_view host = string_view(url).substr(host_begin, host_end - host_begin);
+  size_t colon = host.rfind(':');
+  // the colons of an IPv6 address without a port are inside its brackets
+  if (colon != string_view::npos && host.find(']', colon) != string_view::npos) colon = string_view::npos;
+  int port = url.starts_with("https://") ? 443 : 80;
+  if (colon != string_view::npos) {
+    const string_view value = host.substr(colon + 1);
+    const auto result = from_chars(value.data(), value.data() + value.size(), port);
+    if (result.ec != errc() || result.ptr != value.data() + value.size()) {
+      throw invalid_argument(format("Invalid port in URL: {}", url));
+    }
+  }
+  const size_t hostname_end = colon == string_view::npos ? host_end : host_begin + colon;
+  return format("{}:{}{}", url.substr(0, hostname_end), port + port_offset, url.substr(host_end));
+}
+
+vector<string> cluster_t::parse_urls(const string_view list) {
+  vector<string> urls;
+  size_t begin = 0;
+  while (begin < list.size()) {
+    const size_t end = min(list.find(',', begin), list.size());
+    string_view url = list.substr(begin, end - begin);
+    while (url.ends_with('/')) url.remove_suffix(1);
+    if (!url.empty()) urls.emplace_back(url);
+    begin = end + 1;
+  }
+  return urls;
+}
@@ -0,0 +1,33 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// Nodes of a deployment, each of which owns the rooms whose name numbers are its node ID modulo the node count.
+// Requests for rooms of other nodes are redirected to them, which needs nothing shared between nodes.
+class cluster_t {
+public:
+  const size_t node_id;
+  // base URLs of all nodes ordered by node ID, including this node; empty for a single node
+  const std::vector<std::string> node_urls;
+
+  // Throws invalid_argument if node_id is not one of the nodes.
+  [[nodiscard]] explicit cluster_t(size_t node_id = 0, std::vector<std::string> node_urls = {});
+
+  [[nodiscard]] size_t count() const;
+
+  [[nodiscard]] bool is_local(size_t node) const;
+
+  [[nodiscard]] size_t get_name_owner(uint32_t name_number) const;
+
+  [[nodiscard]] const std::string &get_url(size_t node) const;
+
+  // Returns the URL of a node with its port shifted, for a second server which every node runs at the same offset.
+  // Throws invalid_argument if the URL has an invalid port.
+  [[nodiscard]] std::string get_url(size_t node, int port_offset) const;
+
+  // Splits a comma-separated list of URLs, dropping trailing slashes.
+  [[nodiscard]] static std::vector<std::string> parse_urls(std::string_view list);
+};
@@ -34,6 +34,13 @@ public:
   explicit too_many_requests_error(const std::string &what) : error(429, what) {}
 };
 
+// Thrown for a room or session owned by another node of the cluster.
+class redirect_error final : public error {
+public:
+  const size_t node_id;
+  explicit redirect_error(size_t node_id) : error(307, "Owned by another node."), node_id(node_id) {}
+};
+
 class internal_server_error final : public error {
 public:
   explicit internal_server_error(const std::string &what) : error(500, what) {}
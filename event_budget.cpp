@@ -0,0 +1,37 @@
+#include "event_budget.hpp"
+
+#include "errors.hpp"
+#include <format>
+
+using namespace std;
+
+// event budget
+
+event_budget_t::event_budget_t(const size_t room_limit, const size_t total_limit)
+  : room_limit(room_limit), total_limit(total_limit), used(0), rejected(0) {}
+
+void event_budget_t::acquire(const size_t room_used, const size_t size) {
+  if (room_used + size > room_limit) {
+    rejected.fetch_add(1, memory_order_relaxed);
+    throw too_many_requests_error(
+      format("Too many events buffered in the room. Max size is {} bytes. Wait for other users to sync.", room_limit)
+    );
+  }
+  if (used.fetch_add(size, memory_order_relaxed) + size > total_limit) {
+    used.fetch_sub(size, memory_order_relaxed);
+    rejected.fetch_add(1, memory_order_relaxed);
+    throw service_unavailable_error("Too many events buffered in the server. Try again later.");
+  }
+}
+
+void event_budget_t::release(const size_t size) {
+  used.fetch_sub(size, memory_order_relaxed);
+}
+
+size_t event_budget_t::get_used() const {
+  return used.load(memory_order_relaxed);
+}
+
+size_t event_budget_t::count_rejected() const {
+  return rejected.load(memory_order_relaxed);
+}
@@ -0,0 +1,34 @@
+#pragma once
+
+#include <atomic>
+
+// Bytes of sync events buffered by all rooms, bounded per room and in total.
+// Rooms charge events before buffering them and release them when their rounds are dropped.
+// Timer tasks keep their rooms, and so their events, alive until the tasks are destroyed,
+// so a budget is declared before the timer queue and the rooms to outlive the last release.
+class event_budget_t {
+public:
+  const size_t room_limit;
+  const size_t total_limit;
+
+  [[nodiscard]] explicit event_budget_t(size_t room_limit, size_t total_limit);
+
+  event_budget_t(const event_budget_t &) = delete;
+
+  event_budget_t &operator=(const event_budget_t &) = delete;
+
+  // Charges size bytes to a room which already holds room_used bytes.
+  // Throws too_many_requests_error if the room is full, or service_unavailable_error if the process is full.
+  void acquire(size_t room_used, size_t size);
+
+  void release(size_t size);
+
+  [[nodiscard]] size_t get_used() const;
+
+  // Returns the number of rejected charges.
+  [[nodiscard]] size_t count_rejected() const;
+
+protected:
+  std::atomic<size_t> used;
+  std::atomic<size_t> rejected;
+};
@@ -0,0 +1,95 @@
+#include "gzip.hpp"
+
+#include "errors.hpp"
+#include <algorithm>
+#include <utility>
+
+using namespace std;
+
+/**
+ * Initialize a raw deflate stream, which has no header so that its output can be spliced.
+ * @param stream The stream.
+ * @param level The compression level.
+ */
+void init_raw_deflate(z_stream &stream, const int level) {
+  stream = {};
+  if (deflateInit2(&stream, level, Z_DEFLATED, -MAX_WBITS, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+    throw internal_server_error("Failed to initialize gzip.");
+  }
+}
+
+/**
+ * Compress data and append the output to a buffer.
+ * @param stream The deflate stream.
+ * @param buffer The buffer to append to.
+ * @param data The data to compress.
+ * @param flush The zlib flush mode.
+ */
+void deflate_into(z_stream &stream, string &buffer, const string_view data, const int flush) {
+  stream.next_in = reinterpret_cast<Bytef *>(const_cast<char *>(data.data()));
+  stream.avail_in = static_cast<uInt>(data.size());
+  do {
+    const size_t pos = buffer.size();
+    // room for a flush marker even if no input is left
+    const size_t chunk = max<size_t>(deflateBound(&stream, stream.avail_in), 64);
+    buffer.resize(pos + chunk);
+    stream.next_out = reinterpret_cast<Bytef *>(buffer.data() + pos);
+    stream.avail_out = static_cast<uInt>(chunk);
+    const int result = deflate(&stream, flush);
+    buffer.resize(buffer.size() - stream.avail_out);
+    if (result == Z_STREAM_ERROR) throw internal_server_error("Failed to compress with gzip.");
+  } while (stream.avail_out == 0);
+}
+
+// gzip block
+
+gzip_block_t gzip_block_t::compress(const string_view data, const int level) {
+  z_stream stream;
+  init_raw_deflate(stream, level);
+  gzip_block_t block{
+    {}, static_cast<uint32_t>(crc32(0, reinterpret_cast<const Bytef *>(data.data()), data.size())), data.size()
+  };
+  try {
+    // a sync flush ends the data at a byte boundary without marking it as the last block
+    deflate_into(stream, block.deflated, data, Z_SYNC_FLUSH);
+  } catch (...) {
+    deflateEnd(&stream);
+    throw;
+  }
+  deflateEnd(&stream);
+  return block;
+}
+
+// gzip writer
+
+gzip_writer_t::gzip_writer_t(const int level) : crc(crc32(0, nullptr, 0)), size(0) {
+  init_raw_deflate(stream, level);
+  // magic, deflate, no flags, no mtime, no extra flags, unknown OS
+  buffer.assign("\x1f\x8b\x08\x00\x00\x00\x00\x00\x00\xff", 10);
+}
+
+gzip_writer_t::~gzip_writer_t() {
+  deflateEnd(&stream);
+}
+
+void gzip_writer_t::write(const string_view data) {
+  deflate_into(stream, buffer, data, Z_NO_FLUSH);
+  crc = crc32(crc, reinterpret_cast<const Bytef *>(data.data()), data.size());
+  size += data.size();
+}
+
+void gzip_writer_t::splice(const gzip_block_t &block) {
+  // a full flush ends the data at a byte boundary and keeps later data from referring back across the block
+  deflate_into(stream, buffer, {}, Z_FULL_FLUSH);
+  buffer.append(block.deflated);
+  crc = crc32_combine(crc, block.crc, static_cast<z_off_t>(block.size));
+  size += block.size;
+}
+
+string gzip_writer_t::finish() {
+  deflate_into(stream, buffer, {}, Z_FINISH);
+  // CRC-32 and size modulo 2^32, little endian
+  for (size_t i = 0; i < 4; i++) buffer.push_back(static_cast<char>(crc >> (i * 8)));
+  for (size_t i = 0; i < 4; i++) buffer.push_back(static_cast<char>(size >> (i * 8)));
+  return move(buffer);
+}
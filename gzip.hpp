@@ -0,0 +1,42 @@
+#pragma once
+
+#include <zlib.h>
+#include <cstdint>
+#include <string>
+#include <string_view>
+
+// Raw deflate data compressed on its own and ending at a byte boundary, so that it can be spliced into gzip streams.
+struct gzip_block_t {
+  std::string deflated;
+  uint32_t crc;
+  size_t size; // uncompressed bytes
+
+  [[nodiscard]] static gzip_block_t compress(std::string_view data, int level = Z_DEFAULT_COMPRESSION);
+};
+
+// Writes a gzip stream into which blocks compressed once elsewhere can be spliced.
+// Throws internal_server_error if zlib fails.
+class gzip_writer_t {
+public:
+  [[nodiscard]] explicit gzip_writer_t(int level = Z_DEFAULT_COMPRESSION);
+
+  gzip_writer_t(const gzip_writer_t &) = delete;
+
+  gzip_writer_t &operator=(const gzip_writer_t &) = delete;
+
+  ~gzip_writer_t();
+
+  void write(std::string_view data);
+
+  void splice(const gzip_block_t &block);
+
+  // Returns the whole stream. Nothing can be written afterwards.
+  [[nodiscard]] std::string finish();
+
+protected:
+  z_stream stream;
+  // header and deflate data written so far
+  std::string buffer;
+  uint32_t crc;
+  size_t size;
+};
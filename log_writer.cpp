@@ -0,0 +1,68 @@
+#include "log_writer.hpp"
+
+#include <nlohmann/json.hpp>
+#include <bit>
+#include <format>
+#include <iostream>
+#include <utility>
+
+using namespace std;
+
+using json = nlohmann::json;
+
+// log writer
+
+log_writer_t::log_writer_t(const format_t format, const size_t capacity)
+  : format(format), capacity(bit_ceil(max<size_t>(capacity, 2))), entries(this->capacity), signaled(false),
+    running(true), reported_dropped(0) {
+  worker = thread([this] { run(); });
+}
+
+log_writer_t::~log_writer_t() {
+  running.store(false, memory_order_release);
+  signaled.store(true, memory_order_release);
+  signaled.notify_one();
+  worker.join();
+}
+
+bool log_writer_t::push(const level_t level, string msg) {
+  if (!entries.push({ chrono::system_clock::now(), level, move(msg) })) return false;
+  if (!signaled.exchange(true, memory_order_acq_rel)) signaled.notify_one();
+  return true;
+}
+
+size_t log_writer_t::get_dropped() const {
+  return entries.get_dropped();
+}
+
+void log_writer_t::write(const entry_t &entry) const {
+  ostream &out = entry.level == level_t::ERROR ? cerr : cout;
+  if (format == format_t::TEXT) {
+    out << entry.msg << '\n';
+    return;
+  }
+  out << json{
+    { "time", std::format("{:%FT%TZ}", chrono::floor<chrono::milliseconds>(entry.time)) },
+    { "level", entry.level == level_t::ERROR ? "error" : "info" },
+    { "msg", entry.msg }
+  }.dump(-1, ' ', false, json::error_handler_t::replace) << '\n';
+}
+
+void log_writer_t::run() {
+  entry_t entry;
+  while (true) {
+    signaled.wait(false, memory_order_acquire);
+    signaled.exchange(false, memory_order_acq_rel);
+    const bool stopping = !running.load(memory_order_acquire);
+    while (entries.pop(entry)) write(entry);
+    if (const size_t count = get_dropped(); count != reported_dropped) {
+      const string msg = std::format("Log lines dropped: {}", count - reported_dropped);
+      write({ chrono::system_clock::now(), level_t::ERROR, msg });
+      reported_dropped = count;
+    }
+    // flush once per batch instead of once per line
+    cout.flush();
+    cerr.flush();
+    if (stopping) return;
+  }
+}
@@ -0,0 +1,51 @@
+#pragma once
+
+#include "ring_buffer.hpp"
+
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <thread>
+
+// Writes log lines on a background thread so that callers, often holding locks, never wait for the terminal.
+// Lines are passed through a lock-free ring buffer and dropped when it is full.
+class log_writer_t {
+public:
+  enum class level_t { INFO = 0, ERROR = 1 };
+
+  enum class format_t { TEXT = 0, JSON = 1 };
+
+  const format_t format;
+  const size_t capacity;
+
+  // capacity is rounded up to a power of two.
+  [[nodiscard]] explicit log_writer_t(format_t format, size_t capacity);
+
+  log_writer_t(const log_writer_t &) = delete;
+
+  log_writer_t &operator=(const log_writer_t &) = delete;
+
+  // Writes every line pushed so far before returning.
+  ~log_writer_t();
+
+  bool push(level_t level, std::string msg);
+
+  [[nodiscard]] size_t get_dropped() const;
+
+protected:
+  struct entry_t {
+    std::chrono::system_clock::time_point time;
+    level_t level;
+    std::string msg;
+  };
+
+  ring_buffer_t<entry_t> entries;
+  std::atomic<bool> signaled;
+  std::atomic<bool> running;
+  size_t reported_dropped;
+  std::thread worker;
+
+  void write(const entry_t &entry) const;
+
+  void run();
+};
@@ -1,20 +1,33 @@
 #include "session.hpp"
+#include "cluster.hpp"
 #include "room_list.hpp"
 #include "room.hpp"
 #include "errors.hpp"
 #include "sync_record.hpp"
+#include "event_budget.hpp"
+#include "timer_queue.hpp"
+#include "timer_wheel.hpp"
+#include "stream.hpp"
+#include "msgpack.hpp"
+#include "metrics.hpp"
+#include "sync_codec.hpp"
+#include "log_writer.hpp"
+#include "snapshot.hpp"
+#include "trace.hpp"
+#include "async_server.hpp"
 
 #include <nlohmann/json.hpp>
 #include <httplib.h>
 #include <boost/uuid.hpp>
 #include <chrono>
 #include <atomic>
-#include <thread>
-#include <iostream>
 #include <format>
 #include <string>
 #include <functional>
+#include <optional>
 #include <exception>
+#include <csignal>
+#include <thread>
 #include <cstdlib>
 
 using namespace std;
@@ -46,12 +59,51 @@ const string password = getenv_or("PASSWORD", "");
 const int room_limit = stoi(getenv_or("ROOM_LIMIT", "100"));
 const chrono::minutes lobby_lifetime(stoi(getenv_or("LOBBY_LIFETIME", "10")));
 const chrono::minutes game_lifetime(stoi(getenv_or("GAME_LIFETIME", "20")));
+const size_t thread_count = stoul(getenv_or("THREAD_COUNT", to_string(CPPHTTPLIB_THREAD_POOL_COUNT)));
+const int async_port = stoi(getenv_or("ASYNC_PORT", to_string(port + 1)));
+const size_t async_thread_count = stoul(
+  getenv_or("ASYNC_THREAD_COUNT", to_string(max(thread::hardware_concurrency(), 1u)))
+);
+const string session_mode = getenv_or("SESSION_MODE", "map");
+const string log_format = getenv_or("LOG_FORMAT", "text");
+const size_t log_buffer_size = stoul(getenv_or("LOG_BUFFER", "8192"));
+const size_t sync_history_limit = stoul(getenv_or("SYNC_HISTORY_LIMIT", "100"));
+const size_t sync_room_memory_limit = stoul(getenv_or("SYNC_ROOM_MEMORY_LIMIT", "8388608"));
+const size_t sync_memory_limit = stoul(getenv_or("SYNC_MEMORY_LIMIT", "1073741824"));
+const chrono::milliseconds sync_timeout_min(stoi(getenv_or("SYNC_TIMEOUT_MIN", "10")));
+const chrono::milliseconds sync_timeout_max(stoi(getenv_or("SYNC_TIMEOUT_MAX", "100")));
+const size_t gzip_threshold = stoul(getenv_or("GZIP_THRESHOLD", "1024"));
+const size_t node_id = stoul(getenv_or("NODE_ID", "0"));
+const string peers = getenv_or("PEERS", "");
+const string snapshot_path = getenv_or("SNAPSHOT_PATH", "");
+const chrono::seconds snapshot_interval(stoi(getenv_or("SNAPSHOT_INTERVAL", "0")));
+const string trace_path = getenv_or("TRACE_PATH", "");
+const size_t trace_buffer_size = stoul(getenv_or("TRACE_BUFFER", "16384"));
 
 constexpr auto expire_timeout = 10s;
-constexpr auto cleaner_interval = 3s;
+constexpr size_t async_body_limit = 1 << 24;
+
+log_writer_t log_writer(
+  log_format == "json" ? log_writer_t::format_t::JSON : log_writer_t::format_t::TEXT, log_buffer_size
+);
 
-void log_stdout(const string &msg) { cout << msg << endl; }
-void log_stderr(const string &msg) { cerr << msg << endl; }
+void log_stdout(const string &msg) { log_writer.push(log_writer_t::level_t::INFO, msg); }
+void log_stderr(const string &msg) { log_writer.push(log_writer_t::level_t::ERROR, msg); }
+
+// the server stopped by SIGTERM and SIGINT
+atomic<Server *> signal_server = nullptr;
+
+/**
+ * Stop the server on a signal, so that main saves the snapshot after the requests in flight are done.
+ * Server::stop only flips a flag and closes the listening socket, which is safe in a signal handler.
+ */
+void stop_on_signal(int) {
+  if (Server *server = signal_server.load()) server->stop();
+}
+
+// set by the pre-routing handler and read by the logger, which run on the same worker thread
+thread_local chrono::system_clock::time_point request_arrival_time;
+thread_local chrono::steady_clock::time_point request_start_time;
 
 // UUID
 
@@ -72,27 +124,108 @@ template<> struct nlohmann::adl_serializer<uuid> {
 // API handler
 
 /**
- * Generate a handler for the API endpoint.
- * @param handle_json The function to handle the JSON request.
+ * Check the password of a request.
+ * @param req The request.
+ * @return Whether the request has the correct password or no password is required.
+ */
+bool is_authorized(const Request &req) {
+  return password.empty() || req.get_header_value("Authorization") == "Bearer "s + password;
+}
+
+/**
+ * Check the password of a request to the async server.
+ * @param req The request.
+ * @return Whether the request has the correct password or no password is required.
+ */
+bool is_authorized(const async_server_t::request_t &req) {
+  return password.empty() || req.get_header("authorization") == "Bearer "s + password;
+}
+
+/**
+ * Check whether the client of a request accepts gzip responses.
+ * @param req The request.
+ * @return Whether Accept-Encoding lists gzip.
+ */
+bool accepts_gzip(const Request &req) {
+  return req.get_header_value("Accept-Encoding").find("gzip") != string::npos;
+}
+
+/**
+ * Check whether the client of a request to the async server accepts gzip responses.
+ * @param req The request.
+ * @return Whether Accept-Encoding lists gzip.
+ */
+bool accepts_gzip(const async_server_t::request_t &req) {
+  return req.get_header("accept-encoding").find("gzip") != string_view::npos;
+}
+
+/**
+ * Generate the URL of a request on ASYNC_PORT of the host it was sent to.
+ * @param req The request.
+ * @return The URL with the hostname of the Host header, ASYNC_PORT and the path of the request.
+ */
+string gen_async_url(const Request &req) {
+  const string host = req.get_header_value("Host");
+  const size_t colon = host.rfind(':');
+  // an IPv6 address without a port ends with ']'
+  const string hostname = colon == string::npos || host.ends_with(']') ? host : host.substr(0, colon);
+  return format("http://{}:{}{}", hostname.empty() ? "localhost" : hostname, async_port, req.path);
+}
+
+/**
+ * Get the status of a node of the cluster.
+ * @param url The base URL of the node.
+ * @return The status of the node itself, or nullopt if the node did not respond.
+ */
+optional<json> fetch_node_status(const string &url) {
+  httplib::Client client(url);
+  client.set_connection_timeout(1);
+  client.set_read_timeout(1);
+  httplib::Headers headers;
+  if (!password.empty()) headers.emplace("Authorization", "Bearer " + password);
+  const auto res = client.Get(api_path + "/status?scope=node", headers);
+  if (!res || res->status != 200) return nullopt;
+  try {
+    return json::from_msgpack(res->body);
+  } catch (const json::exception &) {
+    return nullopt;
+  }
+}
+
+/**
+ * Generate a handler for the API endpoint which decodes the request and encodes the response by itself.
+ * @param handle_body The function to handle the msgpack request body and return the msgpack response body.
  * @return The handler for the API endpoint.
  */
-auto gen_auth_handler(const function<json(const json &)> &handle_json) {
+auto gen_auth_raw_handler(const function<string(const string &)> &handle_body) {
   return [=](const Request &req, Response &res) {
-    if (!password.empty() && req.get_header_value("Authorization") != "Bearer "s + password) {
+    if (!is_authorized(req)) {
       res.status = 404;
       return;
     }
     try {
-      const auto msgpack = json::to_msgpack(
-        handle_json(req.body.empty() ? json(nullptr) : json::from_msgpack(req.body))
-      );
-      res.set_content(string(msgpack.begin(), msgpack.end()), "application/msgpack");
+      res.set_content(handle_body(req.body), "application/msgpack");
     } catch (const json::exception &err) {
       throw bad_request_error(err.what());
     }
   };
 }
 
+/**
+ * Generate a handler for the API endpoint.
+ * @param handle_json The function to handle the JSON request.
+ * @return The handler for the API endpoint.
+ */
+auto gen_auth_handler(const function<json(const json &)> &handle_json) {
+  return gen_auth_raw_handler(
+    [=](const string &body) {
+      string msgpack;
+      json::to_msgpack(handle_json(body.empty() ? json(nullptr) : json::from_msgpack(body)), msgpack);
+      return msgpack;
+    }
+  );
+}
+
 // entry point
 
 int main() {
@@ -100,26 +233,354 @@ int main() {
   log_stdout("==========================================================");
   log_stdout(format("ShoutWars backend server v{} starting...", api_ver));
 
-  session_list_t session_list(log_stderr, log_stdout);
-  room_list_t room_list(room_limit, lobby_lifetime, game_lifetime, log_stderr, log_stdout);
+  event_budget_t event_budget(sync_room_memory_limit, sync_memory_limit);
+  timer_queue_t timer_queue;
+  timer_wheel_t timer_wheel;
+  metrics_t metrics;
+  auto &sync_latency = metrics.histogram(
+    "shoutwars_sync_request_seconds", "Latency of /room/sync requests.", metrics_t::latency_bounds()
+  );
+  auto &sync_wait_punctual = metrics.histogram(
+    "shoutwars_sync_wait_seconds",
+    "Time from the arrival of a sync to the close of its round.",
+    metrics_t::latency_bounds(),
+    R"(arrival="punctual")"
+  );
+  auto &sync_wait_lagging = metrics.histogram(
+    "shoutwars_sync_wait_seconds", "", metrics_t::latency_bounds(), R"(arrival="lagging")"
+  );
+  auto &rounds_all_arrived = metrics.counter(
+    "shoutwars_rounds_total", "Closed sync rounds.", R"(reason="all_arrived")"
+  );
+  auto &rounds_timed_out = metrics.counter("shoutwars_rounds_total", "", R"(reason="timeout")");
+  auto &round_latency = metrics.histogram(
+    "shoutwars_round_close_seconds", "Time from the first arrival to the close of a round.", metrics_t::latency_bounds()
+  );
+  auto &round_window = metrics.histogram(
+    "shoutwars_round_window_seconds",
+    "Time from the first arrival to the deadline chosen for a round from the arrival jitter of its users.",
+    metrics_t::latency_bounds()
+  );
+  auto &round_events = metrics.histogram(
+    "shoutwars_round_events", "Events sent in a closed round.", metrics_t::size_bounds()
+  );
+  auto &request_bytes = metrics.histogram(
+    "shoutwars_request_bytes", "Size of request bodies.", metrics_t::size_bounds()
+  );
+  auto &response_bytes = metrics.histogram(
+    "shoutwars_response_bytes", "Size of response bodies.", metrics_t::size_bounds()
+  );
+  auto &too_many_requests = metrics.counter(
+    "shoutwars_too_many_requests_total", "Sync requests rejected because they came within 100 ms."
+  );
+  auto &gzip_responses = metrics.counter("shoutwars_gzip_responses_total", "Sync responses compressed with gzip.");
+  auto &gzip_input_bytes = metrics.counter(
+    "shoutwars_gzip_input_bytes_total", "Size of sync responses compressed with gzip before compression."
+  );
+  auto &gzip_output_bytes = metrics.counter(
+    "shoutwars_gzip_output_bytes_total", "Size of sync responses compressed with gzip after compression."
+  );
+  auto &gzip_seconds = metrics.counter(
+    "shoutwars_gzip_seconds_total", "Time spent compressing sync responses, including shared round actions."
+  );
+  atomic<chrono::microseconds::rep> round_latency_max = 0;
+
+  // sync requests wait for their rounds here without holding a thread, and streams are closed from the room list
+  async_server_t async_server(async_thread_count, async_body_limit, log_stderr);
+  metrics.gauge(
+    "shoutwars_async_connections",
+    "Open connections to the async server.",
+    [&] { return static_cast<double>(async_server.count_connections()); }
+  );
+
+  stream_list_t stream_list;
+
+  const cluster_t cluster(node_id, cluster_t::parse_urls(peers));
+  // redirects from ASYNC_PORT shift the ports of PEERS, so a URL with an invalid port fails here rather than there
+  for (size_t node = 0; node < cluster.node_urls.size(); node++) (void) cluster.get_url(node, async_port - port);
+  session_list_t session_list(
+    session_mode == "token" ? session_list_t::mode_t::TOKEN : session_list_t::mode_t::MAP,
+    cluster.node_id,
+    cluster.count(),
+    log_stderr,
+    log_stdout
+  );
+  room_list_t room_list(
+    cluster,
+    room_limit,
+    lobby_lifetime,
+    game_lifetime,
+    expire_timeout,
+    sync_history_limit,
+    timer_queue,
+    timer_wheel,
+    event_budget,
+    log_stderr,
+    log_stdout,
+    [&](const room_t::round_stats_t &stats) {
+      (stats.timed_out ? rounds_timed_out : rounds_all_arrived).add();
+      round_latency.observe(stats.close_latency);
+      round_window.observe(stats.window);
+      round_events.observe(static_cast<double>(stats.event_count));
+      for (size_t i = 0; i < min(stats.user_count, room_t::size_max); i++) {
+        (stats.waits[i].lagging ? sync_wait_lagging : sync_wait_punctual).observe(stats.waits[i].time);
+      }
+      const auto latency = chrono::duration_cast<chrono::microseconds>(stats.close_latency).count();
+      auto max = round_latency_max.load();
+      while (latency > max && !round_latency_max.compare_exchange_weak(max, latency)) {}
+    },
+    [&](const uuid &room_id) {
+      session_list.remove_room(room_id);
+      for (const uint64_t connection_id: stream_list.remove_room(room_id)) {
+        async_server.close_websocket(connection_id, 1000, "Room removed.");
+      }
+    },
+    [&](const uuid &room_id, const uuid &user_id) {
+      session_list.remove_user(room_id, user_id);
+      if (const auto connection_id = stream_list.remove_user(room_id, user_id)) {
+        async_server.close_websocket(*connection_id, 1000, "User kicked.");
+      }
+    }
+  );
+  // The room may be removed or the user kicked before the session is registered, so check again afterwards.
+  const auto create_session = [&](const shared_ptr<room_t> &room, const uuid &user_id) {
+    session_t session = session_list.create(room->id, user_id);
+    if (!room_list.exists(room->id)) {
+      session_list.remove_room(room->id);
+      throw not_found_error("Room not found.");
+    }
+    if (!room->has_user(user_id)) {
+      session_list.remove_user(room->id, user_id);
+      throw forbidden_error("User not in the room.");
+    }
+    return session;
+  };
+
+  // Joins the round of a sync request, then calls done with the response body and whether it is gzip-compressed.
+  // The round closes on this thread or later on timer_queue, which only hands the result to the loop thread of
+  // the connection, so the response is encoded and done is called there.
+  // Paced syncs of a user must be 100 ms apart. A stream sends its next sync only after the result, so it is not paced.
+  // check_session may reject the session before the round is joined.
+  // Throws if the request is rejected before it joins the round.
+  const auto begin_sync = [&](
+    const uint64_t connection_id, const string_view body, const bool gzip_accepted, const bool paced,
+    function<void(const exception_ptr &, string, bool)> done,
+    const function<void(const session_t &)> &check_session = nullptr
+  ) {
+    const auto start_time = chrono::steady_clock::now();
+    const auto req = parse_sync_request(body);
+    const auto session = session_list.get(req.session_id);
+    if (check_session) check_session(session);
+    const auto room = room_list.get(session.room_id);
+    if (paced && start_time - room->get_user(session.user_id).get_last_time() < 100ms) {
+      too_many_requests.add();
+      throw too_many_requests_error("Wait 100ms before sending another sync request.");
+    }
+
+    update_room_info(*room, session.user_id, req.room_info);
+    room->sync(
+      session.user_id,
+      req.reports,
+      req.actions,
+      [&, room, connection_id, user_id = session.user_id, users_version = req.users_version,
+        info_version = req.info_version, gzip_accepted, start_time, done = move(done)
+      ](const exception_ptr &error, room_t::sync_result_t result) mutable {
+        async_server.dispatch(
+          connection_id,
+          [&, room, user_id, users_version, info_version, gzip_accepted, start_time, done = move(done), error,
+            result = move(result)] {
+            if (error) return done(error, {}, false);
+            try {
+              string msgpack = gen_sync_response(*room, user_id, result, users_version, info_version);
+              const bool gzipped = msgpack.size() >= gzip_threshold && gzip_accepted;
+              if (gzipped) {
+                const auto gzip_start_time = chrono::steady_clock::now();
+                string gzip = gzip_sync_response(msgpack, result);
+                gzip_seconds.add(chrono::duration<double>(chrono::steady_clock::now() - gzip_start_time).count());
+                gzip_responses.add();
+                gzip_input_bytes.add(static_cast<double>(msgpack.size()));
+                gzip_output_bytes.add(static_cast<double>(gzip.size()));
+                msgpack = move(gzip);
+              }
+              sync_latency.observe(chrono::steady_clock::now() - start_time);
+              done(nullptr, move(msgpack), gzipped);
+            } catch (...) {
+              done(current_exception(), {}, false);
+            }
+          }
+        );
+      },
+      sync_timeout_min,
+      sync_timeout_max
+    );
+  };
+
+  // Converts an error thrown by a request into its response, logging errors which are not the client's fault.
+  // Redirects point at the port of the owner which serves the same endpoints as request_port does here.
+  const auto gen_error_response = [&](
+    const exception_ptr &ep, const string &method, const string &path, const int request_port
+  ) {
+    async_server_t::response_t res;
+    const auto set_error = [&](const error &err) {
+      res.status = err.code;
+      const auto msgpack = json::to_msgpack(json{ { "error", err.what() } });
+      res.body.assign(msgpack.begin(), msgpack.end());
+      res.content_type = "application/msgpack";
+    };
+    try {
+      rethrow_exception(ep);
+    } catch (const redirect_error &err) {
+      if (err.node_id >= cluster.node_urls.size()) {
+        res.status = 500;
+        log_stderr(format("Redirect to unknown node {}\n  when {} {}", err.node_id, method, path));
+        return res;
+      }
+      // 307 keeps the method and the body
+      set_error(err);
+      res.headers.emplace_back("Location", cluster.get_url(err.node_id, request_port - port) + path);
+    } catch (const error &err) {
+      set_error(err);
+    } catch (const exception &err) {
+      res.status = 500;
+      log_stderr(format("Internal server error: {}\n  when {} {}", err.what(), method, path));
+    } catch (...) {
+      res.status = 500;
+      log_stderr(format("Unknown error\n  when {} {}", method, path));
+    }
+    return res;
+  };
+
+  const auto save_rooms = [&] {
+    try {
+      const auto start = chrono::steady_clock::now();
+      const size_t count = save_snapshot(snapshot_path, room_list, session_list);
+      const chrono::duration<double, milli> elapsed = chrono::steady_clock::now() - start;
+      log_stdout(format("Snapshot saved: {} rooms in {:.1f} ms", count, elapsed.count()));
+    } catch (const exception &err) {
+      log_stderr(format("Snapshot not saved: {}", err.what()));
+    }
+  };
+  // runs on timer_wheel, which delays room deadlines by the time of a save
+  function<void()> save_rooms_periodically = [&] {
+    save_rooms();
+    timer_wheel.schedule(chrono::steady_clock::now() + snapshot_interval, save_rooms_periodically);
+  };
+  if (!snapshot_path.empty()) {
+    try {
+      const auto start = chrono::steady_clock::now();
+      const size_t count = load_snapshot(snapshot_path, room_list, session_list);
+      const chrono::duration<double, milli> elapsed = chrono::steady_clock::now() - start;
+      log_stdout(format("Snapshot loaded: {} rooms in {:.1f} ms", count, elapsed.count()));
+    } catch (const exception &err) {
+      log_stderr(format("Snapshot not loaded: {}", err.what()));
+    }
+    if (snapshot_interval > 0s) {
+      timer_wheel.schedule(chrono::steady_clock::now() + snapshot_interval, save_rooms_periodically);
+    }
+  }
+
+  // declared after session_list so that the writer thread stops before the sessions it resolves are gone
+  optional<trace_writer_t> trace_writer;
+  if (!trace_path.empty()) {
+    try {
+      trace_writer.emplace(
+        trace_path,
+        trace_buffer_size,
+        [&](const string_view session_id) {
+          try {
+            return session_list.get(session_id).room_id;
+          } catch (const error &) {
+            return nil_uuid();
+          }
+        }
+      );
+      log_stdout(format("Tracing requests to {}", trace_path));
+    } catch (const exception &err) {
+      log_stderr(format("Trace not started: {}", err.what()));
+    }
+  }
+
+  metrics.gauge("shoutwars_rooms", "Active rooms.", [&] { return static_cast<double>(room_list.count()); });
+  metrics.gauge(
+    "shoutwars_users",
+    "Users in active rooms.",
+    [&] {
+      size_t count = 0;
+      for (const auto &room: room_list.get_all()) count += room->count_users();
+      return static_cast<double>(count);
+    }
+  );
+  metrics.gauge("shoutwars_sessions", "Active sessions.", [&] { return static_cast<double>(session_list.count()); });
+  metrics.gauge(
+    "shoutwars_deadlines",
+    "Pending room and session deadlines.",
+    [&] { return static_cast<double>(timer_wheel.count()); }
+  );
+  metrics.gauge(
+    "shoutwars_sync_buffered_bytes",
+    "Bytes of sync events buffered by all rooms.",
+    [&] { return static_cast<double>(event_budget.get_used()); }
+  );
+  metrics.counter(
+    "shoutwars_sync_rejected_total",
+    "Sync requests rejected because the events would exceed the memory limits.",
+    [&] { return static_cast<double>(event_budget.count_rejected()); }
+  );
+  metrics.gauge("shoutwars_streams", "Open push streams.", [&] { return static_cast<double>(stream_list.count()); });
+  metrics.counter(
+    "shoutwars_log_dropped_total",
+    "Log lines dropped because the log buffer was full.",
+    [] { return static_cast<double>(log_writer.get_dropped()); }
+  );
+  if (trace_writer) {
+    metrics.counter(
+      "shoutwars_trace_requests_total",
+      "Requests written to the trace.",
+      [&] { return static_cast<double>(trace_writer->get_written()); }
+    );
+    metrics.counter(
+      "shoutwars_trace_dropped_total",
+      "Requests left out of the trace because the trace buffer was full.",
+      [&] { return static_cast<double>(trace_writer->get_dropped()); }
+    );
+  }
 
   Server server;
+  signal_server.store(&server);
+  signal(SIGTERM, stop_on_signal);
+  signal(SIGINT, stop_on_signal);
+  server.new_task_queue = [] { return new httplib::ThreadPool(thread_count); };
+  server.set_pre_routing_handler(
+    [](const Request &, Response &) {
+      request_arrival_time = chrono::system_clock::now();
+      request_start_time = chrono::steady_clock::now();
+      return Server::HandlerResponse::Unhandled;
+    }
+  );
+  server.set_logger(
+    [&](const Request &req, const Response &res) {
+      request_bytes.observe(static_cast<double>(req.body.size()));
+      response_bytes.observe(static_cast<double>(res.body.size()));
+      if (!trace_writer) return;
+      const auto elapsed = chrono::steady_clock::now() - request_start_time;
+      const auto latency = chrono::duration_cast<chrono::microseconds>(elapsed);
+      // replays map the sessions and rooms of the trace to new ones through these responses
+      const bool creates_session = req.path == api_path + "/room/create" || req.path == api_path + "/room/join";
+      trace_writer->push(
+        {
+          request_arrival_time, latency, req.method, req.path, res.status, {}, nil_uuid(), 0, 0, req.body,
+          creates_session && res.status == 200 ? optional(res.body) : nullopt
+        }
+      );
+    }
+  );
 
   server.set_exception_handler(
     [&](const Request &req, Response &res, const exception_ptr &ep) {
-      try {
-        rethrow_exception(ep);
-      } catch (const error &err) {
-        res.status = err.code;
-        const auto msgpack = json::to_msgpack(json{ { "error", err.what() } });
-        res.set_content(string(msgpack.begin(), msgpack.end()), "application/msgpack");
-      } catch (const exception &err) {
-        res.status = 500;
-        log_stderr(format("Internal server error: {}\n  when {} {}", err.what(), req.method, req.path));
-      } catch (...) {
-        res.status = 500;
-        log_stderr(format("Unknown error\n  when {} {}", req.method, req.path));
-      }
+      async_server_t::response_t error_res = gen_error_response(ep, req.method, req.path, port);
+      res.status = error_res.status;
+      for (const auto &[name, value]: error_res.headers) res.set_header(name, value);
+      if (!error_res.body.empty()) res.set_content(move(error_res.body), error_res.content_type);
     }
   );
 
@@ -138,7 +599,7 @@ int main() {
         const room_t::user_t owner(req.at("user").at("name"));
         const size_t size = req.at("size");
         const auto room = room_list.create(version, owner, size);
-        const auto session = session_list.create(room->id, owner.id);
+        const auto session = create_session(room, owner.id);
         return { { "session_id", session.id }, { "user_id", owner.id }, { "id", room->id }, { "name", room->name } };
       }
     )
@@ -146,19 +607,25 @@ int main() {
 
   server.Post(
     api_path + "/room/join"s,
-    gen_auth_handler(
-      [&](const json &req) -> json {
+    gen_auth_raw_handler(
+      [&](const string &body) -> string {
+        const json req = json::from_msgpack(body);
         const string version = req.at("version");
         const auto room = room_list.get(string(req.at("name")));
         const room_t::user_t user(req.at("user").at("name"));
         room->join(version, user);
-        const auto session = session_list.create(room->id, user.id);
-        return {
-          { "session_id", session.id },
-          { "id", room->id },
-          { "user_id", user.id },
-          { "room_info", room->get_info() }
-        };
+        const auto session = create_session(room, user.id);
+        // room_info is spliced as the owner sent it
+        string msgpack;
+        const auto info = room->get_info();
+        msgpack_writer_t(msgpack)
+          .map(5)
+          .str("session_id").str(session.id)
+          .str("id").uuid(room->id)
+          .str("user_id").uuid(user.id)
+          .str("room_info").raw(info->data)
+          .str("info_version").uint(info->version);
+        return msgpack;
       }
     )
   );
@@ -167,10 +634,11 @@ int main() {
     api_path + "/room/start"s,
     gen_auth_handler(
       [&](const json &req) -> json {
-        const auto session = session_list.get(req.at("session_id"));
+        const auto session = session_list.get(req.at("session_id").get<string>());
         const auto room = room_list.get(session.room_id);
         if (session.user_id != room->get_owner().id) throw forbidden_error("Only owner can start the game.");
         room->start_game();
+        room_list.watch(room->id);
         return {};
       }
     )
@@ -178,88 +646,179 @@ int main() {
 
   server.Post(
     api_path + "/room/sync"s,
-    gen_auth_handler(
-      [&](const json &req) -> json {
-        const auto session = session_list.get(req.at("session_id"));
-        const auto room = room_list.get(session.room_id);
-        if (std::chrono::steady_clock::now() - room->get_user(session.user_id).get_last_time() < 100ms) {
-          throw too_many_requests_error("Wait 100ms before sending another sync request.");
-        }
-        vector<shared_ptr<sync_record_t::event_t>> user_reports, user_actions;
-        for (const auto &report_j: req.at("reports")) {
-          user_reports.emplace_back(
-            make_shared<sync_record_t::event_t>(
-              report_j.at("id"),
-              session.user_id,
-              report_j.at("type"),
-              report_j.at("event")
-            )
-          );
-        }
-        for (const auto &action_j: req.at("actions")) {
-          user_actions.emplace_back(
-            make_shared<sync_record_t::event_t>(
-              action_j.at("id"),
-              session.user_id,
-              action_j.at("type"),
-              action_j.at("event")
-            )
-          );
-        }
-
-        if (session.user_id == room->get_owner().id) room->update_info(req.at("room_info"));
-        const auto records = room->sync(session.user_id, user_reports, user_actions);
+    [&](const Request &http_req, Response &res) {
+      if (!is_authorized(http_req)) {
+        res.status = 404;
+        return;
+      }
+      // httplib cannot defer a response, so a worker would be parked until the round closes.
+      // The same endpoint on async_server holds no thread while it waits.
+      res.status = 307;
+      res.set_header("Location", gen_async_url(http_req));
+    }
+  );
 
-        json reports = json::array(), actions = json::array();
-        for (const auto &record: records) {
-          for (const auto &report: record->get_reports() | views::filter(
-                                     [&](const auto &r) { return r->from != session.user_id; }
-                                   )) {
-            reports.emplace_back(*report);
-            if (record->id != records.back()->id) reports.back()["sync_id"] = record->id;
-          }
-          for (const auto &action: record->get_actions()) {
-            actions.emplace_back(*action);
-            if (record->id != records.back()->id) actions.back()["sync_id"] = record->id;
+  server.Get(
+    api_path + "/status"s,
+    [&](const Request &req, Response &res) {
+      if (!is_authorized(req)) {
+        res.status = 404;
+        return;
+      }
+      const double rounds = rounds_all_arrived.get() + rounds_timed_out.get();
+      size_t room_buffered_max = 0;
+      for (const auto &room: room_list.get_all()) {
+        room_buffered_max = max(room_buffered_max, room->get_buffered_size());
+      }
+      json status = {
+        { "node_id", cluster.node_id },
+        { "room_count", room_list.count() },
+        { "room_limit", room_list.get_limit() },
+        { "round_count", rounds },
+        { "round_timeout_count", rounds_timed_out.get() },
+        { "round_close_latency_avg_ms", rounds > 0 ? round_latency.get_sum() * 1000 / rounds : 0.0 },
+        { "round_close_latency_max_ms", round_latency_max / 1000.0 },
+        { "round_window_avg_ms", rounds > 0 ? round_window.get_sum() * 1000 / rounds : 0.0 },
+        { "sync_buffered_bytes", event_budget.get_used() },
+        { "sync_buffered_bytes_limit", event_budget.total_limit },
+        { "room_buffered_bytes_max", room_buffered_max },
+        { "room_buffered_bytes_limit", event_budget.room_limit },
+        { "sync_rejected_count", event_budget.count_rejected() },
+        { "gzip_response_count", gzip_responses.get() },
+        { "gzip_saved_bytes", gzip_input_bytes.get() - gzip_output_bytes.get() },
+        { "gzip_cpu_ms", gzip_seconds.get() * 1000 }
+      };
+      // nodes ask each other for their own status only, so that they never recurse
+      if (cluster.count() > 1 && req.get_param_value("scope") != "node") {
+        json nodes = json::array();
+        size_t cluster_room_count = 0, cluster_room_limit = 0;
+        for (size_t node = 0; node < cluster.count(); node++) {
+          const auto node_status = cluster.is_local(node) ? optional(status) : fetch_node_status(cluster.get_url(node));
+          if (!node_status) {
+            nodes.push_back({ { "node_id", node }, { "url", cluster.get_url(node) }, { "available", false } });
+            continue;
           }
+          const size_t room_count = node_status->value("room_count", size_t{ 0 });
+          const size_t room_limit = node_status->value("room_limit", size_t{ 0 });
+          cluster_room_count += room_count;
+          cluster_room_limit += room_limit;
+          nodes.push_back(
+            {
+              { "node_id", node },
+              { "url", cluster.get_url(node) },
+              { "available", true },
+              { "room_count", room_count },
+              { "room_limit", room_limit }
+            }
+          );
         }
-        return {
-          { "id", records.back()->id },
-          { "reports", reports },
-          { "actions", actions },
-          { "room_users", room->get_users() }
-        };
+        status["cluster_room_count"] = cluster_room_count;
+        status["cluster_room_limit"] = cluster_room_limit;
+        status["nodes"] = move(nodes);
       }
-    )
+      string msgpack;
+      json::to_msgpack(status, msgpack);
+      res.set_content(move(msgpack), "application/msgpack");
+    }
   );
 
   server.Get(
-    api_path + "/status"s,
-    gen_auth_handler(
-      [&](const json &req) -> json {
-        return { { "room_count", room_list.count() }, { "room_limit", room_list.get_limit() } };
+    api_path + "/metrics"s,
+    [&](const Request &req, Response &res) {
+      if (!is_authorized(req)) {
+        res.status = 404;
+        return;
       }
-    )
+      res.set_content(metrics.render(), metrics_t::content_type);
+    }
   );
 
-  atomic<bool> running = true;
-  thread cleaner_thread(
-    [&] {
-      while (running) {
+  async_server.post(
+    api_path + "/room/sync"s,
+    [&](const async_server_t::request_t &req, async_server_t::responder respond) {
+      if (!is_authorized(req)) return respond({ 404, {}, {}, {} });
+      // records the request as the logger of server does before responding
+      const auto finish = [
+        &, respond = move(respond), arrival_time = chrono::system_clock::now(),
+        start_time = chrono::steady_clock::now(), body = trace_writer ? req.body : string(),
+        request_size = req.body.size(), path = req.path
+      ](async_server_t::response_t res) {
+        request_bytes.observe(static_cast<double>(request_size));
+        response_bytes.observe(static_cast<double>(res.body.size()));
+        if (trace_writer) {
+          const auto latency = chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now() - start_time);
+          trace_writer->push({ arrival_time, latency, "POST", path, res.status, {}, nil_uuid(), 0, 0, body, nullopt });
+        }
+        respond(move(res));
+      };
+      try {
+        begin_sync(
+          req.connection_id,
+          req.body,
+          accepts_gzip(req),
+          true,
+          [&, finish, path = req.path](const exception_ptr &error, string msgpack, const bool gzipped) {
+            if (error) return finish(gen_error_response(error, "POST", path, async_port));
+            async_server_t::response_t res{ 200, "application/msgpack", {}, move(msgpack) };
+            if (gzipped) res.headers.emplace_back("Content-Encoding", "gzip");
+            finish(move(res));
+          }
+        );
+      } catch (...) {
+        finish(gen_error_response(current_exception(), req.method, req.path, async_port));
+      }
+    }
+  );
+
+  async_server.websocket(
+    api_path + "/room/ws"s,
+    {
+      [](const async_server_t::request_t &req) { return is_authorized(req); },
+      [&](const uint64_t connection_id, const string_view message, const async_server_t::sender &send) {
+        // sent back in place of a round, closing the stream if the client cannot go on
+        const auto send_error = [&async_server, &gen_error_response, connection_id, send](const exception_ptr &ep) {
+          const auto res = gen_error_response(ep, "WS", api_path + "/room/ws"s, async_port);
+          // a WebSocket cannot follow a redirect, so the client is told where to open the stream instead
+          if (res.status == 307) {
+            string location = res.headers.front().second;
+            location.replace(0, location.find("://"), location.starts_with("https://") ? "wss" : "ws");
+            string msgpack;
+            json::to_msgpack(json{ { "error", "Owned by another node." }, { "location", location } }, msgpack);
+            send(move(msgpack));
+            async_server.close_websocket(connection_id, 4307, "Owned by another node.");
+            return;
+          }
+          string msgpack = res.body;
+          if (msgpack.empty()) json::to_msgpack(json{ { "error", "Internal server error." } }, msgpack);
+          send(move(msgpack));
+          if (res.status != 400 && res.status != 429) async_server.close_websocket(connection_id, 1008, "Sync failed.");
+        };
         try {
-          room_list.clean(expire_timeout);
-          session_list.clean(
-            [&](const session_t &session) {
-              return !room_list.exists(session.room_id) || !room_list.get(session.room_id)->has_user(session.user_id);
+          begin_sync(
+            connection_id,
+            message,
+            false,
+            false,
+            [send, send_error](const exception_ptr &error, string msgpack, bool) {
+              if (error) return send_error(error);
+              send(move(msgpack));
+            },
+            [&, connection_id](const session_t &session) {
+              // the first message binds the stream to its user, replacing any earlier stream of the user
+              if (const auto stream = stream_list.get(connection_id)) {
+                if (stream->user_id != session.user_id) throw forbidden_error("Stream opened by another session.");
+                return;
+              }
+              if (const auto old_connection_id = stream_list.open(session.room_id, session.user_id, connection_id)) {
+                async_server.close_websocket(*old_connection_id, 1000, "Stream replaced.");
+              }
             }
           );
-        } catch (exception &err) {
-          log_stderr(format("Cleanup error: {}", err.what()));
         } catch (...) {
-          log_stderr("Unknown cleanup error");
+          send_error(current_exception());
         }
-        this_thread::sleep_for(cleaner_interval);
-      }
+      },
+      [&](const uint64_t connection_id) { stream_list.close(connection_id); }
     }
   );
 
@@ -268,6 +827,9 @@ int main() {
   if (!password.empty()) log_stdout(format("Password: {}", password));
 
   try {
+    // /room/sync on PORT redirects here, so the server does not run without it
+    async_server.listen("0.0.0.0", async_port);
+    log_stdout(format("Async server started at http://localhost:{}", async_port));
     server.listen("0.0.0.0", port);
   } catch (const exception &err) {
     log_stderr("");
@@ -277,8 +839,14 @@ int main() {
     log_stderr("Unknown server error");
   }
 
-  running = false;
-  cleaner_thread.join();
+  async_server.stop();
+  // sync timers close rounds, which report to metrics and run completions, so they stop before those are destroyed
+  timer_queue.stop();
+  // deadline tasks refer to the room list
+  timer_wheel.stop();
+  signal_server.store(nullptr);
+  // listen returns once the requests in flight are done, and no periodic save runs after timer_wheel stops
+  if (!snapshot_path.empty()) save_rooms();
 
   log_stdout("");
   log_stdout("Server stopped");
@@ -0,0 +1,98 @@
+#pragma once
+
+#include <boost/uuid.hpp>
+#include <array>
+#include <bit>
+#include <cstdint>
+#include <optional>
+
+// Members of a small group stored inline in fixed slots, so that membership never allocates.
+// A member keeps its slot until it is erased, which lets other state be indexed by slot,
+// and members are visited in ID order. Not thread-safe.
+template<typename member_t, size_t capacity>
+class member_table_t {
+public:
+  static_assert(capacity <= 32, "slots are addressed by a 32-bit mask");
+
+  // returned by find when no member has the ID
+  static constexpr size_t npos = capacity;
+
+  [[nodiscard]] size_t size() const { return count; }
+
+  [[nodiscard]] bool empty() const { return count == 0; }
+
+  // Returns the bits of the occupied slots.
+  [[nodiscard]] uint32_t get_mask() const { return mask; }
+
+  [[nodiscard]] size_t find(const boost::uuids::uuid &id) const {
+    for (size_t i = 0; i < count; i++) {
+      if (slots[order[i]]->id == id) return order[i];
+    }
+    return npos;
+  }
+
+  [[nodiscard]] bool contains(const boost::uuids::uuid &id) const { return find(id) != npos; }
+
+  [[nodiscard]] member_t &at(const size_t slot) { return *slots[slot]; }
+
+  [[nodiscard]] const member_t &at(const size_t slot) const { return *slots[slot]; }
+
+  // Returns the member with the smallest ID. The table must not be empty.
+  [[nodiscard]] const member_t &front() const { return *slots[order[0]]; }
+
+  // Puts a member in the lowest free slot and returns the slot. The table must not be full.
+  size_t insert(const member_t &member) {
+    const auto slot = static_cast<size_t>(std::countr_one(mask));
+    insert_at(slot, member);
+    return slot;
+  }
+
+  // Puts a member in the given slot, which must be free, as when restoring a table with its slots.
+  void insert_at(const size_t slot, const member_t &member) {
+    slots[slot].emplace(member);
+    mask |= 1u << slot;
+    size_t i = count++;
+    for (; i > 0 && member.id < slots[order[i - 1]]->id; i--) order[i] = order[i - 1];
+    order[i] = static_cast<uint8_t>(slot);
+  }
+
+  bool erase(const boost::uuids::uuid &id) {
+    return erase_if([&](const member_t &member) { return member.id == id; }) > 0;
+  }
+
+  // Erases the members for which pred returns true and returns the number of erased members.
+  template<typename pred_t>
+  size_t erase_if(pred_t pred) {
+    size_t kept = 0;
+    for (size_t i = 0; i < count; i++) {
+      const uint8_t slot = order[i];
+      if (pred(*slots[slot])) {
+        slots[slot].reset();
+        mask &= ~(1u << slot);
+      } else {
+        order[kept++] = slot;
+      }
+    }
+    const size_t erased = count - kept;
+    count = kept;
+    return erased;
+  }
+
+  // Visits members in ID order.
+  template<typename fn_t>
+  void for_each(fn_t fn) const {
+    for (size_t i = 0; i < count; i++) fn(*slots[order[i]]);
+  }
+
+  template<typename fn_t>
+  void for_each(fn_t fn) {
+    for (size_t i = 0; i < count; i++) fn(*slots[order[i]]);
+  }
+
+protected:
+  std::array<std::optional<member_t>, capacity> slots;
+  // occupied slots in ID order
+  std::array<uint8_t, capacity> order{};
+  size_t count = 0;
+  uint32_t mask = 0;
+};
@@ -0,0 +1,116 @@
+#include "metrics.hpp"
+
+#include <algorithm>
+#include <format>
+#include <tuple>
+#include <utility>
+
+using namespace std;
+
+// counter
+
+void counter_t::add(const double value) {
+  shards[shard_index()].value.fetch_add(value, memory_order_relaxed);
+}
+
+double counter_t::get() const {
+  double value = 0;
+  for (const shard_t &shard: shards) value += shard.value.load(memory_order_relaxed);
+  return value;
+}
+
+size_t counter_t::shard_index() {
+  static atomic<size_t> next_index = 0;
+  thread_local const size_t index = next_index.fetch_add(1, memory_order_relaxed) % shard_count;
+  return index;
+}
+
+// histogram
+
+histogram_t::histogram_t(vector<double> bounds) : bounds(move(bounds)), buckets(this->bounds.size() + 1) {}
+
+void histogram_t::observe(const double value) {
+  buckets[ranges::lower_bound(bounds, value) - bounds.begin()].add();
+  sum.add(value);
+}
+
+void histogram_t::observe(const chrono::steady_clock::duration duration) {
+  observe(chrono::duration<double>(duration).count());
+}
+
+vector<double> histogram_t::get_buckets() const {
+  vector<double> counts;
+  double count = 0;
+  for (const counter_t &bucket: buckets) counts.emplace_back(count += bucket.get());
+  return counts;
+}
+
+double histogram_t::get_sum() const {
+  return sum.get();
+}
+
+// metrics
+
+vector<double> metrics_t::latency_bounds() {
+  return { 0.001, 0.0025, 0.005, 0.01, 0.025, 0.05, 0.075, 0.1, 0.15, 0.2, 0.25, 0.3, 0.5, 1, 2.5 };
+}
+
+vector<double> metrics_t::size_bounds() {
+  return { 0, 1, 2, 4, 8, 16, 32, 64, 128, 256, 512, 1024, 4096, 16384, 65536, 262144, 1048576 };
+}
+
+counter_t &metrics_t::counter(const string &name, const string &help, const string &labels) {
+  lock_guard lock(metrics_mutex);
+  return get_family(name, help, "counter").counters.emplace_back(
+    piecewise_construct, forward_as_tuple(labels), forward_as_tuple()
+  ).second;
+}
+
+histogram_t &metrics_t::histogram(
+  const string &name, const string &help, vector<double> bounds, const string &labels
+) {
+  lock_guard lock(metrics_mutex);
+  return get_family(name, help, "histogram").histograms.emplace_back(
+    piecewise_construct, forward_as_tuple(labels), forward_as_tuple(move(bounds))
+  ).second;
+}
+
+void metrics_t::counter(const string &name, const string &help, function<double()> get) {
+  lock_guard lock(metrics_mutex);
+  get_family(name, help, "counter").get = move(get);
+}
+
+void metrics_t::gauge(const string &name, const string &help, function<double()> get) {
+  lock_guard lock(metrics_mutex);
+  get_family(name, help, "gauge").get = move(get);
+}
+
+string metrics_t::render() const {
+  lock_guard lock(metrics_mutex);
+  string text;
+  for (const family_t &family: families) {
+    text += format("# HELP {} {}\n# TYPE {} {}\n", family.name, family.help, family.name, family.type);
+    for (const auto &[labels, counter]: family.counters) {
+      text += format("{}{} {}\n", family.name, labels.empty() ? "" : "{" + labels + "}", counter.get());
+    }
+    for (const auto &[labels, histogram]: family.histograms) {
+      const string prefix = labels.empty() ? "" : labels + ",";
+      const vector<double> counts = histogram.get_buckets();
+      for (size_t i = 0; i < histogram.bounds.size(); i++) {
+        text += format("{}_bucket{{{}le=\"{}\"}} {}\n", family.name, prefix, histogram.bounds[i], counts[i]);
+      }
+      text += format("{}_bucket{{{}le=\"+Inf\"}} {}\n", family.name, prefix, counts.back());
+      const string suffix = labels.empty() ? "" : "{" + labels + "}";
+      text += format("{}_sum{} {}\n", family.name, suffix, histogram.get_sum());
+      text += format("{}_count{} {}\n", family.name, suffix, counts.back());
+    }
+    if (family.get) text += format("{} {}\n", family.name, family.get());
+  }
+  return text;
+}
+
+metrics_t::family_t &metrics_t::get_family(const string &name, const string &help, const string &type) {
+  const auto it = ranges::find(families, name, &family_t::name);
+  if (it != families.end()) return *it;
+  return families.emplace_back(name, help, type);
+}
@@ -0,0 +1,87 @@
+#pragma once
+
+#include <atomic>
+#include <array>
+#include <chrono>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <functional>
+
+// Counter split into per-thread shards so that hot paths never contend on one cache line.
+class counter_t {
+public:
+  static constexpr size_t shard_count = 16;
+
+  void add(double value = 1);
+
+  [[nodiscard]] double get() const;
+
+protected:
+  struct alignas(64) shard_t {
+    std::atomic<double> value = 0;
+  };
+
+  std::array<shard_t, shard_count> shards;
+
+  static size_t shard_index();
+};
+
+class histogram_t {
+public:
+  const std::vector<double> bounds;
+
+  [[nodiscard]] explicit histogram_t(std::vector<double> bounds);
+
+  void observe(double value);
+
+  void observe(std::chrono::steady_clock::duration duration);
+
+  // Returns cumulative counts of each bound followed by the total count.
+  [[nodiscard]] std::vector<double> get_buckets() const;
+
+  [[nodiscard]] double get_sum() const;
+
+protected:
+  std::deque<counter_t> buckets;
+  counter_t sum;
+};
+
+// Registry rendering metrics in the Prometheus text exposition format.
+class metrics_t {
+public:
+  static constexpr auto content_type = "text/plain; version=0.0.4";
+
+  [[nodiscard]] static std::vector<double> latency_bounds();
+
+  [[nodiscard]] static std::vector<double> size_bounds();
+
+  // Labels are written as is, e.g. R"(reason="timeout")".
+  counter_t &counter(const std::string &name, const std::string &help, const std::string &labels = "");
+
+  histogram_t &histogram(
+    const std::string &name, const std::string &help, std::vector<double> bounds, const std::string &labels = ""
+  );
+
+  // Counters kept elsewhere, read only when metrics are rendered.
+  void counter(const std::string &name, const std::string &help, std::function<double()> get);
+
+  // Gauges are read only when metrics are rendered.
+  void gauge(const std::string &name, const std::string &help, std::function<double()> get);
+
+  [[nodiscard]] std::string render() const;
+
+protected:
+  struct family_t {
+    std::string name, help, type;
+    std::deque<std::pair<std::string, counter_t>> counters;
+    std::deque<std::pair<std::string, histogram_t>> histograms;
+    std::function<double()> get;
+  };
+
+  mutable std::mutex metrics_mutex;
+  std::deque<family_t> families;
+
+  family_t &get_family(const std::string &name, const std::string &help, const std::string &type);
+};
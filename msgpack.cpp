@@ -0,0 +1,283 @@
+#include "msgpack.hpp"
+
+#include "errors.hpp"
+#include <algorithm>
+#include <array>
+#include <format>
+
+using namespace std;
+
+constexpr auto hex_values = [] {
+  array<int8_t, 256> values{};
+  values.fill(-1);
+  for (int8_t i = 0; i < 10; i++) values['0' + i] = i;
+  for (int8_t i = 0; i < 6; i++) values['a' + i] = values['A' + i] = static_cast<int8_t>(10 + i);
+  return values;
+}();
+
+// msgpack reader
+
+msgpack_reader_t::msgpack_reader_t(const string_view buffer) : buffer(buffer), pos(0) {}
+
+bool msgpack_reader_t::empty() const {
+  return pos >= buffer.size();
+}
+
+size_t msgpack_reader_t::remaining() const {
+  return buffer.size() - min(pos, buffer.size());
+}
+
+size_t msgpack_reader_t::map() {
+  const uint8_t type = get();
+  size_t size;
+  if ((type & 0xf0) == 0x80) size = type & 0x0f;
+  else if (type == 0xde) size = get_be(2);
+  else if (type == 0xdf) size = get_be(4);
+  else throw bad_request_error(format("Invalid msgpack: expected map at {}.", pos - 1));
+  // every key and value takes at least a byte, so callers can size containers by the count
+  if (size > remaining() / 2) throw bad_request_error(format("Invalid msgpack: map of {} truncated.", size));
+  return size;
+}
+
+size_t msgpack_reader_t::array() {
+  const uint8_t type = get();
+  size_t size;
+  if ((type & 0xf0) == 0x90) size = type & 0x0f;
+  else if (type == 0xdc) size = get_be(2);
+  else if (type == 0xdd) size = get_be(4);
+  else throw bad_request_error(format("Invalid msgpack: expected array at {}.", pos - 1));
+  if (size > remaining()) throw bad_request_error(format("Invalid msgpack: array of {} truncated.", size));
+  return size;
+}
+
+bool msgpack_reader_t::nil() {
+  if (empty() || static_cast<uint8_t>(buffer[pos]) != 0xc0) return false;
+  pos++;
+  return true;
+}
+
+bool msgpack_reader_t::boolean() {
+  const uint8_t type = get();
+  if (type == 0xc2 || type == 0xc3) return type == 0xc3;
+  throw bad_request_error(format("Invalid msgpack: expected boolean at {}.", pos - 1));
+}
+
+uint64_t msgpack_reader_t::uint() {
+  const uint8_t type = get();
+  if (type <= 0x7f) return type;
+  if (type == 0xcc) return get_be(1);
+  if (type == 0xcd) return get_be(2);
+  if (type == 0xce) return get_be(4);
+  if (type == 0xcf) return get_be(8);
+  throw bad_request_error(format("Invalid msgpack: expected unsigned integer at {}.", pos - 1));
+}
+
+string_view msgpack_reader_t::str() {
+  const uint8_t type = get();
+  if ((type & 0xe0) == 0xa0) return take(type & 0x1f);
+  if (type == 0xd9) return take(get_be(1));
+  if (type == 0xda) return take(get_be(2));
+  if (type == 0xdb) return take(get_be(4));
+  throw bad_request_error(format("Invalid msgpack: expected string at {}.", pos - 1));
+}
+
+boost::uuids::uuid msgpack_reader_t::uuid() {
+  const string_view value = str();
+  // the canonical form, which clients and the server write, is decoded without the generic parser
+  if (value.size() == 36 && value[8] == '-' && value[13] == '-' && value[18] == '-' && value[23] == '-') {
+    boost::uuids::uuid result;
+    int invalid = 0;
+    size_t i = 0;
+    for (uint8_t &byte: result) {
+      if (i == 8 || i == 13 || i == 18 || i == 23) i++;
+      const int high = hex_values[static_cast<uint8_t>(value[i])], low = hex_values[static_cast<uint8_t>(value[i + 1])];
+      invalid |= high | low;
+      byte = static_cast<uint8_t>(high << 4 | low);
+      i += 2;
+    }
+    if (invalid >= 0) return result;
+  }
+  try {
+    return boost::uuids::string_generator()(value.begin(), value.end());
+  } catch (const runtime_error &err) {
+    throw bad_request_error(format("Invalid UUID: {}", err.what()));
+  }
+}
+
+string_view msgpack_reader_t::skip() {
+  const size_t begin = pos;
+  // count pending values instead of recursing so that deep nesting cannot overflow the stack
+  uint64_t pending = 1;
+  while (pending > 0) {
+    pending--;
+    const uint8_t type = get();
+    if (type <= 0x7f || type >= 0xe0 || type == 0xc0 || type == 0xc2 || type == 0xc3) continue;
+    if ((type & 0xf0) == 0x80) {
+      pending += (type & 0x0f) * 2uLL;
+    } else if ((type & 0xf0) == 0x90) {
+      pending += type & 0x0f;
+    } else if ((type & 0xe0) == 0xa0) {
+      take(type & 0x1f);
+    } else {
+      switch (type) {
+        case 0xc4: case 0xd9: take(get_be(1)); break;
+        case 0xc5: case 0xda: take(get_be(2)); break;
+        case 0xc6: case 0xdb: take(get_be(4)); break;
+        case 0xc7: take(get_be(1) + 1); break;
+        case 0xc8: take(get_be(2) + 1); break;
+        case 0xc9: take(get_be(4) + 1); break;
+        case 0xcc: case 0xd0: take(1); break;
+        case 0xcd: case 0xd1: take(2); break;
+        case 0xca: case 0xce: case 0xd2: take(4); break;
+        case 0xcb: case 0xcf: case 0xd3: take(8); break;
+        case 0xd4: take(2); break;
+        case 0xd5: take(3); break;
+        case 0xd6: take(5); break;
+        case 0xd7: take(9); break;
+        case 0xd8: take(17); break;
+        case 0xdc: pending += get_be(2); break;
+        case 0xdd: pending += get_be(4); break;
+        case 0xde: pending += get_be(2) * 2; break;
+        case 0xdf: pending += get_be(4) * 2; break;
+        default: throw bad_request_error(format("Invalid msgpack: unknown type 0x{:02x} at {}.", type, pos - 1));
+      }
+    }
+  }
+  return buffer.substr(begin, pos - begin);
+}
+
+uint8_t msgpack_reader_t::get() {
+  if (empty()) throw bad_request_error("Invalid msgpack: unexpected end of data.");
+  return static_cast<uint8_t>(buffer[pos++]);
+}
+
+uint64_t msgpack_reader_t::get_be(const size_t bytes) {
+  uint64_t value = 0;
+  for (const char c: take(bytes)) value = value << 8 | static_cast<uint8_t>(c);
+  return value;
+}
+
+string_view msgpack_reader_t::take(const size_t size) {
+  if (size > buffer.size() - pos) throw bad_request_error("Invalid msgpack: unexpected end of data.");
+  const string_view value = buffer.substr(pos, size);
+  pos += size;
+  return value;
+}
+
+// msgpack writer
+
+msgpack_writer_t::msgpack_writer_t(string &buffer) : buffer(buffer) {}
+
+msgpack_writer_t &msgpack_writer_t::map(const size_t size) {
+  put_header(0x80, 0x0f, 0xde, size);
+  return *this;
+}
+
+msgpack_writer_t &msgpack_writer_t::array(const size_t size) {
+  put_header(0x90, 0x0f, 0xdc, size);
+  return *this;
+}
+
+size_t msgpack_writer_t::open_array() {
+  const size_t pos = buffer.size();
+  buffer.push_back(static_cast<char>(0xdd));
+  put_be(0, 4);
+  return pos;
+}
+
+void msgpack_writer_t::close_array(const size_t pos, const size_t size) {
+  for (size_t i = 0; i < 4; i++) buffer[pos + 1 + i] = static_cast<char>(size >> (24 - i * 8));
+}
+
+msgpack_writer_t &msgpack_writer_t::nil() {
+  buffer.push_back(static_cast<char>(0xc0));
+  return *this;
+}
+
+msgpack_writer_t &msgpack_writer_t::boolean(const bool value) {
+  buffer.push_back(static_cast<char>(value ? 0xc3 : 0xc2));
+  return *this;
+}
+
+msgpack_writer_t &msgpack_writer_t::uint(const uint64_t value) {
+  if (value < 0x80) {
+    buffer.push_back(static_cast<char>(value));
+  } else if (value <= UINT8_MAX) {
+    buffer.push_back(static_cast<char>(0xcc));
+    put_be(value, 1);
+  } else if (value <= UINT16_MAX) {
+    buffer.push_back(static_cast<char>(0xcd));
+    put_be(value, 2);
+  } else if (value <= UINT32_MAX) {
+    buffer.push_back(static_cast<char>(0xce));
+    put_be(value, 4);
+  } else {
+    buffer.push_back(static_cast<char>(0xcf));
+    put_be(value, 8);
+  }
+  return *this;
+}
+
+msgpack_writer_t &msgpack_writer_t::str(const string_view value) {
+  if (value.size() <= 0x1f) {
+    buffer.push_back(static_cast<char>(0xa0 | value.size()));
+  } else if (value.size() <= UINT8_MAX) {
+    buffer.push_back(static_cast<char>(0xd9));
+    put_be(value.size(), 1);
+  } else if (value.size() <= UINT16_MAX) {
+    buffer.push_back(static_cast<char>(0xda));
+    put_be(value.size(), 2);
+  } else {
+    buffer.push_back(static_cast<char>(0xdb));
+    put_be(value.size(), 4);
+  }
+  buffer.append(value);
+  return *this;
+}
+
+size_t msgpack_writer_t::str_size(const size_t size) {
+  if (size <= 0x1f) return 1 + size;
+  if (size <= UINT8_MAX) return 2 + size;
+  if (size <= UINT16_MAX) return 3 + size;
+  return 5 + size;
+}
+
+msgpack_writer_t &msgpack_writer_t::uuid(const boost::uuids::uuid &value) {
+  static constexpr char hex[] = "0123456789abcdef";
+  // format into a local array so that the buffer is grown once
+  char chars[uuid_size] = { static_cast<char>(0xd9), 36 };
+  size_t pos = 2;
+  for (size_t i = 0; i < value.size(); i++) {
+    if (i == 4 || i == 6 || i == 8 || i == 10) chars[pos++] = '-';
+    chars[pos++] = hex[value.data[i] >> 4];
+    chars[pos++] = hex[value.data[i] & 0x0f];
+  }
+  buffer.append(chars, uuid_size);
+  return *this;
+}
+
+msgpack_writer_t &msgpack_writer_t::json(const nlohmann::json &value) {
+  nlohmann::json::to_msgpack(value, buffer);
+  return *this;
+}
+
+msgpack_writer_t &msgpack_writer_t::raw(const string_view msgpack) {
+  buffer.append(msgpack);
+  return *this;
+}
+
+void msgpack_writer_t::put_header(const uint8_t fix, const uint8_t fix_max, const uint8_t base, const size_t size) {
+  if (size <= fix_max) {
+    buffer.push_back(static_cast<char>(fix | size));
+  } else if (size <= UINT16_MAX) {
+    buffer.push_back(static_cast<char>(base));
+    put_be(size, 2);
+  } else {
+    buffer.push_back(static_cast<char>(base + 1));
+    put_be(size, 4);
+  }
+}
+
+void msgpack_writer_t::put_be(const uint64_t value, const size_t bytes) {
+  for (size_t i = bytes; i > 0; i--) buffer.push_back(static_cast<char>(value >> ((i - 1) * 8)));
+}
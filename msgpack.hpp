@@ -0,0 +1,89 @@
+#pragma once
+
+#include <nlohmann/json.hpp>
+#include <boost/uuid.hpp>
+#include <cstdint>
+#include <string>
+#include <string_view>
+
+// Reads msgpack values from a buffer without building a DOM.
+// Throws bad_request_error if the buffer is not the expected msgpack.
+class msgpack_reader_t {
+public:
+  [[nodiscard]] explicit msgpack_reader_t(std::string_view buffer);
+
+  [[nodiscard]] bool empty() const;
+
+  // Returns the number of bytes not read yet.
+  [[nodiscard]] size_t remaining() const;
+
+  // Returns the number of key-value pairs, which is never more than the remaining bytes could hold.
+  size_t map();
+
+  // Returns the number of elements, which is never more than the remaining bytes could hold.
+  size_t array();
+
+  bool nil();
+
+  bool boolean();
+
+  uint64_t uint();
+
+  std::string_view str();
+
+  boost::uuids::uuid uuid();
+
+  // Skips the next value and returns its raw msgpack bytes.
+  std::string_view skip();
+
+protected:
+  std::string_view buffer;
+  size_t pos;
+
+  uint8_t get();
+
+  uint64_t get_be(size_t bytes);
+
+  std::string_view take(size_t size);
+};
+
+// Appends msgpack values to a buffer without building a DOM.
+class msgpack_writer_t {
+public:
+  static constexpr size_t uuid_size = 38; // str8 header + 36 characters
+
+  std::string &buffer;
+
+  [[nodiscard]] explicit msgpack_writer_t(std::string &buffer);
+
+  msgpack_writer_t &map(size_t size);
+
+  msgpack_writer_t &array(size_t size);
+
+  // Writes a fixed-width array header whose size is patched by close_array.
+  [[nodiscard]] size_t open_array();
+
+  void close_array(size_t pos, size_t size);
+
+  msgpack_writer_t &nil();
+
+  msgpack_writer_t &boolean(bool value);
+
+  msgpack_writer_t &uint(uint64_t value);
+
+  msgpack_writer_t &str(std::string_view value);
+
+  msgpack_writer_t &uuid(const boost::uuids::uuid &value);
+
+  msgpack_writer_t &json(const nlohmann::json &value);
+
+  msgpack_writer_t &raw(std::string_view msgpack);
+
+  // Returns the bytes that str writes for a string of the size.
+  [[nodiscard]] static size_t str_size(size_t size);
+
+protected:
+  void put_header(uint8_t fix, uint8_t fix_max, uint8_t base, size_t size);
+
+  void put_be(uint64_t value, size_t bytes);
+};
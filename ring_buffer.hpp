@@ -0,0 +1,71 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <bit>
+#include <memory>
+
+// Bounded queue of many producers and one consumer, where producers never wait.
+// Entries pushed while it is full are dropped and counted.
+template<typename entry_t>
+class ring_buffer_t {
+public:
+  const size_t capacity;
+
+  // capacity is rounded up to a power of two.
+  [[nodiscard]] explicit ring_buffer_t(const size_t capacity)
+    : capacity(std::bit_ceil(std::max<size_t>(capacity, 2))), slots(std::make_unique<slot_t[]>(this->capacity)),
+      head(0), tail(0), dropped(0) {
+    for (size_t i = 0; i < this->capacity; i++) slots[i].seq.store(i, std::memory_order_relaxed);
+  }
+
+  ring_buffer_t(const ring_buffer_t &) = delete;
+
+  ring_buffer_t &operator=(const ring_buffer_t &) = delete;
+
+  // Returns false if the entry was dropped.
+  bool push(entry_t entry) {
+    size_t pos = head.load(std::memory_order_relaxed);
+    slot_t *slot;
+    while (true) {
+      slot = &slots[pos & (capacity - 1)];
+      const size_t seq = slot->seq.load(std::memory_order_acquire);
+      if (seq == pos) {
+        if (head.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) break;
+      } else if (seq < pos) {
+        // the consumer has not emptied this slot since the last lap
+        dropped.fetch_add(1, std::memory_order_relaxed);
+        return false;
+      } else {
+        pos = head.load(std::memory_order_relaxed);
+      }
+    }
+    slot->entry = std::move(entry);
+    slot->seq.store(pos + 1, std::memory_order_release);
+    return true;
+  }
+
+  // Only the consumer thread may pop. Returns false if the buffer is empty.
+  bool pop(entry_t &entry) {
+    slot_t &slot = slots[tail & (capacity - 1)];
+    if (slot.seq.load(std::memory_order_acquire) != tail + 1) return false;
+    entry = std::move(slot.entry);
+    slot.seq.store(tail + capacity, std::memory_order_release);
+    tail++;
+    return true;
+  }
+
+  [[nodiscard]] size_t get_dropped() const { return dropped.load(std::memory_order_relaxed); }
+
+protected:
+  struct slot_t {
+    // equals the position when empty and the position + 1 when filled
+    std::atomic<size_t> seq;
+    entry_t entry;
+  };
+
+  std::unique_ptr<slot_t[]> slots;
+  alignas(64) std::atomic<size_t> head;
+  alignas(64) size_t tail; // only touched by the consumer
+  alignas(64) std::atomic<size_t> dropped;
+};
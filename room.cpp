@@ -1,6 +1,8 @@
 #include "room.hpp"
 
 #include "errors.hpp"
+#include <bit>
+#include <cmath>
 #include <format>
 #include <ranges>
 #include <utility>
@@ -10,6 +12,13 @@ using namespace boost::uuids;
 
 using json = nlohmann::json;
 
+// the weight of the latest arrival in the moving average and variance
+constexpr double arrival_weight = 1.0 / 8;
+// the margin for jitter in standard deviations
+constexpr double arrival_deviations = 3;
+// users who have not been observed yet are expected within this, the timeout before windows adapted
+constexpr chrono::milliseconds initial_sync_window{ 50 };
+
 uuid room_t::gen_id() {
   thread_local time_generator_v7 gen;
   return gen();
@@ -18,7 +27,14 @@ uuid room_t::gen_id() {
 // room user
 
 room_t::user_t::user_t(const string &name)
-  : id(gen_id()), last_sync_id(nil_uuid()), last_time(chrono::steady_clock::now()) {
+  : id(gen_id()), sync_cursor(0), last_time(chrono::steady_clock::now()), arrival_mean(0), arrival_variance(0),
+    has_arrival(false) {
+  set_name(name);
+}
+
+room_t::user_t::user_t(
+  const uuid id, const string &name, const uint64_t sync_cursor, const chrono::steady_clock::time_point last_time
+) : id(id), sync_cursor(sync_cursor), last_time(last_time), arrival_mean(0), arrival_variance(0), has_arrival(false) {
   set_name(name);
 }
 
@@ -26,6 +42,10 @@ void to_json(json &j, const room_t::user_t &user) {
   j = { { "id", to_string(user.id) }, { "name", user.name } };
 }
 
+void to_msgpack(msgpack_writer_t &writer, const room_t::user_t &user) {
+  writer.map(2).str("id").uuid(user.id).str("name").str(user.name);
+}
+
 string room_t::user_t::get_name() const {
   return name;
 }
@@ -39,28 +59,54 @@ void room_t::user_t::set_name(const string &new_name) {
   name = new_name;
 }
 
-uuid room_t::user_t::get_last_sync_id() const {
-  return last_sync_id;
+uint64_t room_t::user_t::get_sync_cursor() const {
+  return sync_cursor;
 }
 
 chrono::steady_clock::time_point room_t::user_t::get_last_time() const {
   return last_time;
 }
 
-void room_t::user_t::update_last(const uuid new_sync_id) {
-  last_sync_id = new_sync_id;
+void room_t::user_t::update_last(const uint64_t new_sync_cursor) {
+  sync_cursor = new_sync_cursor;
   last_time = chrono::steady_clock::now();
 }
 
+optional<chrono::steady_clock::duration> room_t::user_t::predict_arrival() const {
+  if (!has_arrival) return nullopt;
+  const chrono::duration<double, milli> offset(arrival_mean + arrival_deviations * sqrt(arrival_variance));
+  return chrono::duration_cast<chrono::steady_clock::duration>(offset);
+}
+
+void room_t::user_t::observe_arrival(const chrono::steady_clock::duration offset) {
+  const double ms = chrono::duration<double, milli>(offset).count();
+  if (!has_arrival) {
+    // as TCP does with its first RTT sample, assume a deviation of half the first offset
+    arrival_mean = ms;
+    arrival_variance = ms * ms / 4;
+    has_arrival = true;
+    return;
+  }
+  const double diff = ms - arrival_mean;
+  arrival_mean += arrival_weight * diff;
+  arrival_variance = (1 - arrival_weight) * (arrival_variance + arrival_weight * diff * diff);
+}
+
 // room
 
 room_t::room_t(
   string version, const user_t &owner, string name, size_t size, const chrono::minutes lobby_lifetime,
-  const chrono::minutes game_lifetime, logger log_error, logger log_info
+  const chrono::minutes game_lifetime, const size_t history_limit, timer_queue_t &timer_queue,
+  event_budget_t &event_budget, logger log_error, logger log_info, round_observer on_round_closed,
+  user_observer on_user_kicked
 )
-  : log_error(move(log_error)), log_info(move(log_info)), lobby_lifetime(lobby_lifetime), game_lifetime(game_lifetime),
-    id(gen_id()), version(move(version)), name(move(name)), size(size),
-    expire_time(chrono::steady_clock::now() + lobby_lifetime), users{ { owner.id, owner } }, in_lobby(true) {
+  : log_error(move(log_error)), log_info(move(log_info)), on_round_closed(move(on_round_closed)),
+    on_user_kicked(move(on_user_kicked)), lobby_lifetime(lobby_lifetime), game_lifetime(game_lifetime),
+    history_limit(history_limit), id(gen_id()), version(move(version)), name(move(name)), size(size),
+    timer_queue(timer_queue), event_budget(event_budget),
+    info(make_shared<const info_t>(string(1, static_cast<char>(0xc0)), 0)),
+    expire_time(chrono::steady_clock::now() + lobby_lifetime), users_version(1), in_lobby(true),
+    sync_history(history_limit + 1), history_begin(0), history_end(0), buffered_size(0) {
   if (this->version.empty() || this->version.size() > version_max_length) {
     throw bad_request_error(
       format("Invalid room version length: {}. Must be between 1 and {}.", this->version.size(), version_max_length)
@@ -69,9 +115,58 @@ room_t::room_t(
   if (size < 2 || size > size_max) {
     throw bad_request_error(format("Invalid room size: {}. Must be between 2 and {}.", size, size_max));
   }
-  const auto record = make_shared<sync_record_t>();
-  sync_records.emplace(record->id, record);
-  users.begin()->second.update_last(nil_uuid());
+  push_record();
+  users.at(users.insert(owner)).update_last(history_begin);
+}
+
+room_t::room_t(
+  const snapshot_t &snapshot, const chrono::minutes lobby_lifetime, const chrono::minutes game_lifetime,
+  const size_t history_limit, timer_queue_t &timer_queue, event_budget_t &event_budget, logger log_error,
+  logger log_info, round_observer on_round_closed, user_observer on_user_kicked
+)
+  : log_error(move(log_error)), log_info(move(log_info)), on_round_closed(move(on_round_closed)),
+    on_user_kicked(move(on_user_kicked)), lobby_lifetime(lobby_lifetime), game_lifetime(game_lifetime),
+    history_limit(history_limit), id(snapshot.id), version(snapshot.version), name(snapshot.name),
+    size(snapshot.size), timer_queue(timer_queue), event_budget(event_budget), info(snapshot.info),
+    expire_time(snapshot.expire_time), users_version(snapshot.users_version), in_lobby(snapshot.in_lobby),
+    sync_history(history_limit + 1), history_begin(snapshot.history_begin), history_end(snapshot.history_begin),
+    buffered_size(0) {
+  if (size < 2 || size > size_max || snapshot.users.size() > size) throw bad_request_error("Invalid room size.");
+  if (!snapshot.info) throw bad_request_error("Invalid room info.");
+  const size_t dropped = snapshot.records.size() - min(snapshot.records.size(), history_limit);
+  history_begin += dropped;
+  history_end = history_begin;
+  size_t records_size = 0;
+  for (const shared_ptr<sync_record_t> &record: snapshot.records | views::drop(dropped)) {
+    records_size += record->get_buffered_size();
+    sync_history[history_end++ % sync_history.size()] = record;
+  }
+  push_record();
+  for (const auto &[slot, user]: snapshot.users) {
+    if (slot >= size_max || (users.get_mask() >> slot & 1) != 0 || users.contains(user.id)) {
+      throw bad_request_error("Invalid user slot.");
+    }
+    if (user.get_sync_cursor() >= history_end) throw bad_request_error("Invalid user sync cursor.");
+    users.insert_at(slot, user);
+  }
+  // charged last, as the destructor does not run if the constructor throws
+  event_budget.acquire(0, records_size);
+  buffered_size = records_size;
+}
+
+room_t::~room_t() {
+  event_budget.release(buffered_size);
+}
+
+room_t::snapshot_t room_t::save() const {
+  shared_lock lock(room_mutex);
+  snapshot_t snapshot{
+    id, version, name, size, expire_time, in_lobby, info.load(memory_order_acquire), {}, users_version, history_begin,
+    {}
+  };
+  users.for_each([&](const user_t &user) { snapshot.users.emplace_back(users.find(user.id), user); });
+  for (uint64_t seq = history_begin; seq + 1 < history_end; seq++) snapshot.records.emplace_back(get_record(seq));
+  return snapshot;
 }
 
 chrono::steady_clock::time_point room_t::get_expire_time() const {
@@ -79,6 +174,13 @@ chrono::steady_clock::time_point room_t::get_expire_time() const {
   return expire_time;
 }
 
+chrono::steady_clock::time_point room_t::get_next_deadline(const chrono::milliseconds user_timeout) const {
+  shared_lock lock(room_mutex);
+  auto deadline = expire_time;
+  users.for_each([&](const user_t &user) { deadline = min(deadline, user.get_last_time() + user_timeout); });
+  return deadline;
+}
+
 void room_t::join(string version, const user_t &user) {
   if (version != this->version) {
     throw bad_request_error(format("Invalid room version: {}. This roon version is {}.", version, this->version));
@@ -87,17 +189,18 @@ void room_t::join(string version, const user_t &user) {
   if (!in_lobby) throw forbidden_error("Game already started.");
   if (users.size() >= size) throw forbidden_error(format("Room is full. Max user count is {}.", size));
   if (users.contains(user.id)) throw forbidden_error("User already in the room.");
-  user_t &new_user = users.emplace(user.id, user).first->second;
-  new_user.update_last(sync_records.size() > 1 ? next(sync_records.rbegin())->first : nil_uuid());
+  const size_t slot = users.insert(user);
+  // the slot may have been left by a kicked user, so every kept round starts the new user at CREATED
+  for (uint64_t seq = history_begin; seq < history_end; seq++) get_record(seq)->reset_phase(slot);
+  users.at(slot).update_last(history_end - 1);
+  users_version++;
 }
 
 room_t::user_t room_t::get_user(const uuid id) const {
   shared_lock lock(room_mutex);
-  try {
-    return users.at(id);
-  } catch (const out_of_range &) {
-    throw not_found_error("User not found.");
-  }
+  const size_t slot = users.find(id);
+  if (slot == users.npos) throw not_found_error("User not found.");
+  return users.at(slot);
 }
 
 bool room_t::has_user(const uuid id) const {
@@ -106,14 +209,31 @@ bool room_t::has_user(const uuid id) const {
 }
 
 bool room_t::kick(const uuid id) {
-  lock_guard lock(room_mutex);
-  return users.erase(id) > 0;
+  {
+    lock_guard lock(room_mutex);
+    if (!users.erase(id)) return false;
+    users_version++;
+  }
+  on_user_kicked(this->id, id);
+  return true;
 }
 
 size_t room_t::kick_expired(const chrono::milliseconds timeout) {
-  lock_guard lock(room_mutex);
-  const auto now = chrono::steady_clock::now();
-  return erase_if(users, [&](const pair<uuid, user_t> &user) { return now - user.second.get_last_time() > timeout; });
+  vector<uuid> kicked;
+  {
+    lock_guard lock(room_mutex);
+    const auto now = chrono::steady_clock::now();
+    users.erase_if(
+      [&](const user_t &user) {
+        if (now - user.get_last_time() <= timeout) return false;
+        kicked.emplace_back(user.id);
+        return true;
+      }
+    );
+    if (!kicked.empty()) users_version++;
+  }
+  for (const uuid &user_id: kicked) on_user_kicked(id, user_id);
+  return kicked.size();
 }
 
 size_t room_t::count_users() const {
@@ -123,20 +243,34 @@ size_t room_t::count_users() const {
 
 vector<uuid> room_t::get_user_ids() const {
   shared_lock lock(room_mutex);
-  const auto view = users | views::keys;
-  return move(vector(view.begin(), view.end()));
+  vector<uuid> user_ids;
+  user_ids.reserve(users.size());
+  users.for_each([&](const user_t &user) { user_ids.emplace_back(user.id); });
+  return user_ids;
 }
 
 vector<room_t::user_t> room_t::get_users() const {
   shared_lock lock(room_mutex);
-  const auto view = users | views::values;
-  return move(vector(view.begin(), view.end()));
+  vector<user_t> result;
+  result.reserve(users.size());
+  users.for_each([&](const user_t &user) { result.emplace_back(user); });
+  return result;
+}
+
+uint64_t room_t::get_users_version() const {
+  shared_lock lock(room_mutex);
+  return users_version;
+}
+
+void room_t::for_each_user(const function<void(const user_t &)> &fn) const {
+  shared_lock lock(room_mutex);
+  users.for_each([&](const user_t &user) { fn(user); });
 }
 
 room_t::user_t room_t::get_owner() const {
   shared_lock lock(room_mutex);
   if (users.empty()) throw not_found_error("Room is empty.");
-  return users.begin()->second;
+  return users.front();
 }
 
 bool room_t::is_in_lobby() const {
@@ -150,10 +284,9 @@ void room_t::start_game() {
   if (users.size() < 2) throw forbidden_error("Not enough players to start the game.");
   in_lobby = false;
   expire_time = chrono::steady_clock::now() + game_lifetime;
-  const auto users_view = users | views::values;
-  log_info(
-    format("Game started: {} (users={})", to_string(id), json(vector(users_view.begin(), users_view.end())).dump())
-  );
+  json users_json = json::array();
+  users.for_each([&](const user_t &user) { users_json.push_back(user); });
+  log_info(format("Game started: {} (users={})", to_string(id), users_json.dump()));
 }
 
 bool room_t::is_available() const {
@@ -163,83 +296,173 @@ bool room_t::is_available() const {
   return users.size() > 1;
 }
 
-json room_t::get_info() const {
-  shared_lock lock(room_mutex);
-  return info;
+shared_ptr<const room_t::info_t> room_t::get_info() const {
+  return info.load(memory_order_acquire);
 }
 
-void room_t::update_info(const json &new_info) {
-  lock_guard lock(room_mutex);
-  info = new_info;
+void room_t::update_info(string new_info) {
+  auto current = info.load(memory_order_acquire);
+  // the owner usually sends the same info every round
+  if (current->data == new_info) return;
+  const auto next = make_shared<info_t>(move(new_info), 0);
+  do {
+    if (current->data == next->data) return;
+    next->version = current->version + 1;
+  } while (!info.compare_exchange_weak(current, next, memory_order_acq_rel, memory_order_acquire));
 }
 
-vector<shared_ptr<sync_record_t>> room_t::sync(
-  const uuid user_id, const vector<shared_ptr<sync_record_t::event_t>> &reports,
-  const vector<shared_ptr<sync_record_t::event_t>> &actions, const chrono::milliseconds wait_timeout,
-  const chrono::milliseconds sync_timeout
+void room_t::sync(
+  const uuid user_id, const span<const sync_record_t::new_event_t> reports,
+  const span<const sync_record_t::new_event_t> actions, sync_handler handler,
+  const chrono::milliseconds sync_timeout_min, const chrono::milliseconds sync_timeout_max,
+  const chrono::milliseconds wait_timeout
 ) {
-  unique_lock lock(room_mutex);
-  if (!users.contains(user_id)) throw forbidden_error("User not in the room.");
-  user_t &user = users.at(user_id);
-  const shared_ptr<sync_record_t> record = sync_records.rbegin()->second;
-  if (record->get_phase(user.id) > sync_record_t::phase_t::CREATED) throw forbidden_error("User already synced.");
-  if (record->get_max_phase() >= sync_record_t::phase_t::SYNCED) throw forbidden_error("Room already synced.");
-
-  record->add_events(user.id, reports, actions);
-
-  // wait for users who didn't skip last sync
-  if (record->get_max_phase() <= sync_record_t::phase_t::WAITING && sync_records.size() > 1) {
-    if (next(sync_records.rbegin())->second->get_phase(user.id) < sync_record_t::phase_t::SYNCED) {
-      sync_cv.wait_for(lock, wait_timeout, [&] { return record->get_max_phase() > sync_record_t::phase_t::WAITING; });
+  vector<sync_completion_t> completions;
+  {
+    lock_guard lock(room_mutex);
+    const size_t slot = users.find(user_id);
+    if (slot == users.npos) throw forbidden_error("User not in the room.");
+    const shared_ptr<sync_record_t> record = get_record(history_end - 1);
+    if (record->get_phase(slot) > sync_record_t::phase_t::CREATED) throw forbidden_error("User already synced.");
+
+    const size_t events_size = sync_record_t::measure_events(reports) + sync_record_t::measure_events(actions);
+    event_budget.acquire(buffered_size, events_size);
+    try {
+      record->add_events(user_id, slot, reports, actions);
+    } catch (...) {
+      event_budget.release(events_size);
+      throw;
+    }
+    buffered_size += events_size;
+    const auto now = chrono::steady_clock::now();
+    if (sync_waiters.empty()) {
+      round_open_time = now;
+      round_deadline = chrono::steady_clock::time_point::max();
+    }
+    user_t &user = users.at(slot);
+    // users who skipped last sync also wait for users who didn't
+    const bool lagging = user.get_sync_cursor() + 1 < history_end;
+    if (!lagging) {
+      user.observe_arrival(now - round_open_time);
+    } else if (user.get_sync_cursor() + 2 == history_end && now - last_round_close_time <= sync_timeout_max) {
+      // the user just missed the last round, which shows how late the user tends to be
+      user.observe_arrival(now - last_round_open_time);
     }
+    sync_waiters.emplace_back(user_id, now, lagging, move(handler));
+    const auto window = get_sync_window(*record, sync_timeout_min, sync_timeout_max);
+    const auto deadline = lagging ? now + wait_timeout + window : max(round_open_time + window, now + sync_timeout_min);
+    if (deadline < round_deadline) {
+      round_deadline = deadline;
+      schedule_sync_timer(record->id, deadline);
+    }
+
+    // close the round as soon as all users have arrived
+    if (record->all_reached(users.get_mask(), sync_record_t::phase_t::WAITING)) close_round(false, completions);
+  }
+  for (auto &[completion_handler, result]: completions) completion_handler(nullptr, move(result));
+}
+
+void room_t::on_sync_timer(const uuid record_id) {
+  vector<sync_completion_t> completions;
+  {
+    lock_guard lock(room_mutex);
+    if (get_record(history_end - 1)->id != record_id || sync_waiters.empty()) return;
+    if (chrono::steady_clock::now() < round_deadline) return;
+    close_round(true, completions);
   }
-  record->advance_phase(user.id, sync_record_t::phase_t::SYNCING);
-  sync_cv.notify_all();
-
-  // wait for all users to sync
-  if (ranges::any_of(
-    users,
-    [&](const pair<uuid, user_t> &u) { return record->get_phase(u.first) <= sync_record_t::phase_t::CREATED; }
-  )) {
-    sync_cv.wait_for(lock, sync_timeout, [&] { return record->get_max_phase() > sync_record_t::phase_t::SYNCING; });
+  for (auto &[completion_handler, result]: completions) completion_handler(nullptr, move(result));
+}
+
+const shared_ptr<sync_record_t> &room_t::get_record(const uint64_t seq) const {
+  return sync_history[seq % sync_history.size()];
+}
+
+chrono::steady_clock::duration room_t::get_sync_window(
+  const sync_record_t &record, const chrono::milliseconds sync_timeout_min, const chrono::milliseconds sync_timeout_max
+) const {
+  chrono::steady_clock::duration window = sync_timeout_min;
+  for (uint32_t mask = users.get_mask(); mask != 0; mask &= mask - 1) {
+    const auto slot = static_cast<size_t>(countr_zero(mask));
+    if (record.get_phase(slot) >= sync_record_t::phase_t::WAITING) continue;
+    window = max(window, users.at(slot).predict_arrival().value_or(initial_sync_window));
   }
-  record->advance_phase(user.id, sync_record_t::phase_t::SYNCED);
-  sync_cv.notify_all();
-
-  vector<shared_ptr<sync_record_t>> records;
-  for (const shared_ptr<sync_record_t> &r: ranges::subrange(
-                                             sync_records.upper_bound(user.get_last_sync_id()),
-                                             sync_records.end()
-                                           ) | views::values) {
-    records.emplace_back(r);
-    r->advance_phase(user.id, sync_record_t::phase_t::SYNCED);
+  return min<chrono::steady_clock::duration>(window, sync_timeout_max);
+}
+
+void room_t::schedule_sync_timer(const uuid record_id, const chrono::steady_clock::time_point time) {
+  timer_queue.schedule(time, [room = shared_from_this(), record_id] { room->on_sync_timer(record_id); });
+}
+
+void room_t::close_round(const bool timed_out, vector<sync_completion_t> &completions) {
+  const shared_ptr<sync_record_t> record = get_record(history_end - 1);
+  const size_t unsealed_size = record->get_buffered_size();
+  record->seal();
+  // events with duplicate IDs have been dropped
+  const size_t sealed_size = record->get_buffered_size();
+  event_budget.release(unsealed_size - sealed_size);
+  buffered_size -= unsealed_size - sealed_size;
+  const auto now = chrono::steady_clock::now();
+  round_stats_t stats{
+    record->id, now - round_open_time, round_deadline - round_open_time, timed_out, sync_waiters.size(),
+    record->count_events(), {}
+  };
+  for (size_t i = 0; i < min(sync_waiters.size(), size_max); i++) {
+    stats.waits[i] = { now - sync_waiters[i].arrival_time, sync_waiters[i].lagging };
   }
-  // if all users synced, create new record
-  if (ranges::all_of(
-    users,
-    [&](const pair<uuid, user_t> &u) {
-      if (record->get_phase(u.first) <= sync_record_t::phase_t::CREATED) return true;
-      return record->get_phase(u.first) >= sync_record_t::phase_t::SYNCED;
+  on_round_closed(stats);
+
+  for (sync_waiter_t &waiter: sync_waiters) {
+    sync_result_t result{ {}, false };
+    // the user may have been kicked while waiting, and its slot taken over
+    if (const size_t slot = users.find(waiter.user_id); slot != users.npos) {
+      user_t &user = users.at(slot);
+      result.resync = user.get_sync_cursor() < history_begin;
+      for (uint64_t seq = max(user.get_sync_cursor(), history_begin); seq < history_end; seq++) {
+        result.records.emplace_back(get_record(seq));
+        get_record(seq)->advance_phase(slot, sync_record_t::phase_t::SYNCED);
+      }
+      user.update_last(history_end);
+    } else {
+      result.records.emplace_back(record);
     }
-  )) {
-    const auto next_record = make_shared<sync_record_t>();
-    sync_records.emplace(next_record->id, next_record);
+    completions.emplace_back(move(waiter.handler), move(result));
   }
-  user.update_last(record->id);
-  return move(records);
+  sync_waiters.clear();
+  last_round_open_time = round_open_time;
+  last_round_close_time = now;
+
+  push_record();
+  erase_synced_records();
+}
+
+void room_t::push_record() {
+  if (history_end - history_begin == sync_history.size()) pop_record();
+  sync_history[history_end++ % sync_history.size()] = make_shared<sync_record_t>();
 }
 
 size_t room_t::clean_sync_records() {
   lock_guard lock(room_mutex);
-  return erase_if(
-    sync_records,
-    [&](const pair<uuid, shared_ptr<sync_record_t>> &record) {
-      return ranges::all_of(
-        users,
-        [&](const pair<uuid, user_t> &user) {
-          return record.second->get_phase(user.first) >= sync_record_t::phase_t::SYNCED;
-        }
-      );
-    }
-  );
+  return erase_synced_records();
+}
+
+size_t room_t::get_buffered_size() const {
+  shared_lock lock(room_mutex);
+  return buffered_size;
+}
+
+size_t room_t::erase_synced_records() {
+  // the current round is never erased
+  uint64_t min_cursor = history_end - 1;
+  users.for_each([&](const user_t &user) { min_cursor = min(min_cursor, user.get_sync_cursor()); });
+  size_t count = 0;
+  for (; history_begin < min_cursor; count++) pop_record();
+  return count;
+}
+
+void room_t::pop_record() {
+  shared_ptr<sync_record_t> &record = sync_history[history_begin++ % sync_history.size()];
+  const size_t size = record->get_buffered_size();
+  event_budget.release(size);
+  buffered_size -= size;
+  record.reset();
 }
@@ -1,19 +1,27 @@
 #pragma once
 
+#include "member_table.hpp"
 #include "sync_record.hpp"
+#include "event_budget.hpp"
+#include "timer_queue.hpp"
+#include "msgpack.hpp"
 
 #include <nlohmann/json.hpp>
 #include <boost/uuid.hpp>
+#include <atomic>
 #include <chrono>
-#include <condition_variable>
 #include <shared_mutex>
-#include <map>
+#include <exception>
+#include <array>
+#include <optional>
 #include <string>
 #include <vector>
+#include <span>
+#include <utility>
 #include <functional>
 #include <memory>
 
-class room_t {
+class room_t : public std::enable_shared_from_this<room_t> {
 public:
   // Note that although user_t is mutable, it is not thread-safe.
   class user_t {
@@ -24,33 +32,109 @@ public:
 
     [[nodiscard]] explicit user_t(const std::string &name);
 
+    // Restores a user saved in a snapshot.
+    [[nodiscard]] explicit user_t(
+      boost::uuids::uuid id, const std::string &name, uint64_t sync_cursor,
+      std::chrono::steady_clock::time_point last_time
+    );
+
     friend void to_json(nlohmann::json &j, const user_t &user);
 
+    friend void to_msgpack(msgpack_writer_t &writer, const user_t &user);
+
     [[nodiscard]] std::string get_name() const;
 
     void set_name(const std::string &new_name);
 
-    [[nodiscard]] boost::uuids::uuid get_last_sync_id() const;
+    // Returns the sequence number of the first round not delivered to the user yet.
+    [[nodiscard]] uint64_t get_sync_cursor() const;
 
     [[nodiscard]] std::chrono::steady_clock::time_point get_last_time() const;
 
-    void update_last(boost::uuids::uuid new_sync_id);
+    void update_last(uint64_t new_sync_cursor);
+
+    // Returns the expected offset of the user's arrival from the first arrival of a round, with a margin for jitter,
+    // or nullopt if the user has not been observed yet.
+    [[nodiscard]] std::optional<std::chrono::steady_clock::duration> predict_arrival() const;
+
+    void observe_arrival(std::chrono::steady_clock::duration offset);
 
   protected:
     std::string name;
-    boost::uuids::uuid last_sync_id;
+    uint64_t sync_cursor;
     std::chrono::steady_clock::time_point last_time;
+    // exponentially weighted moving average and variance of arrival offsets in ms, not saved in snapshots
+    double arrival_mean, arrival_variance;
+    bool has_arrival;
+  };
+
+  // Raw msgpack room info, which is never decoded by the server, and its version.
+  struct info_t {
+    std::string data;
+    uint64_t version;
+  };
+
+  // The rounds delivered by a sync. The last record is the round the user synced.
+  struct sync_result_t {
+    std::vector<std::shared_ptr<sync_record_t>> records;
+    // set when rounds the user missed have been dropped from the history
+    bool resync;
+  };
+
+  // The state of a room that outlives the process. Sealed rounds are shared rather than copied, as they never change.
+  struct snapshot_t {
+    boost::uuids::uuid id;
+    std::string version;
+    std::string name;
+    size_t size;
+    std::chrono::steady_clock::time_point expire_time;
+    bool in_lobby;
+    std::shared_ptr<const info_t> info;
+    // users with their slots, by which the rounds track their phases
+    std::vector<std::pair<size_t, user_t>> users;
+    uint64_t users_version;
+    // sealed rounds from history_begin; the open round is left out, as its waiters do not outlive the process
+    uint64_t history_begin;
+    std::vector<std::shared_ptr<sync_record_t>> records;
   };
 
   using logger = std::function<void(const std::string &)>;
+  // Called exactly once when the user's sync completes, outside the room lock.
+  // Rounds closed by timeout call it on the thread of timer_queue, which every room shares, so it must return quickly.
+  using sync_handler = std::function<void(std::exception_ptr error, sync_result_t result)>;
 
   static constexpr size_t version_max_length = 32;
   static constexpr size_t size_max = 4;
+  static_assert(size_max <= sync_record_t::slot_count);
+
+  struct round_stats_t {
+    struct wait_t {
+      std::chrono::steady_clock::duration time; // from the arrival to the close
+      bool lagging; // whether the user skipped last sync
+    };
+
+    boost::uuids::uuid record_id;
+    std::chrono::steady_clock::duration close_latency; // from the first arrival to the close
+    std::chrono::steady_clock::duration window; // from the first arrival to the deadline chosen for the round
+    bool timed_out;
+    size_t user_count;
+    size_t event_count;
+    std::array<wait_t, size_max> waits; // only the first min(user_count, size_max) are set
+  };
+
+  // Called under the room lock each time a round closes, so it must be cheap.
+  using round_observer = std::function<void(const round_stats_t &)>;
+  // Called outside the room lock each time a user is kicked.
+  using user_observer = std::function<void(const boost::uuids::uuid &room_id, const boost::uuids::uuid &user_id)>;
 
   const logger log_error, log_info;
+  const round_observer on_round_closed;
+  const user_observer on_user_kicked;
 
   const std::chrono::minutes lobby_lifetime;
   const std::chrono::minutes game_lifetime;
+  // the number of past rounds kept for users who skipped syncs
+  const size_t history_limit;
   const boost::uuids::uuid id;
   const std::string version;
   const std::string name;
@@ -58,12 +142,31 @@ public:
 
   [[nodiscard]] explicit room_t(
     std::string version, const user_t &owner, std::string name, size_t size, std::chrono::minutes lobby_lifetime,
-    std::chrono::minutes game_lifetime, logger log_error = [](const std::string &) {},
-    logger log_info = [](const std::string &) {}
+    std::chrono::minutes game_lifetime, size_t history_limit, timer_queue_t &timer_queue,
+    event_budget_t &event_budget, logger log_error = [](const std::string &) {},
+    logger log_info = [](const std::string &) {}, round_observer on_round_closed = [](const round_stats_t &) {},
+    user_observer on_user_kicked = [](const boost::uuids::uuid &, const boost::uuids::uuid &) {}
+  );
+
+  // Restores a room from a snapshot, dropping the oldest rounds beyond history_limit.
+  // Throws bad_request_error if the snapshot is inconsistent, or the errors of event_budget_t::acquire.
+  [[nodiscard]] explicit room_t(
+    const snapshot_t &snapshot, std::chrono::minutes lobby_lifetime, std::chrono::minutes game_lifetime,
+    size_t history_limit, timer_queue_t &timer_queue, event_budget_t &event_budget,
+    logger log_error = [](const std::string &) {}, logger log_info = [](const std::string &) {},
+    round_observer on_round_closed = [](const round_stats_t &) {},
+    user_observer on_user_kicked = [](const boost::uuids::uuid &, const boost::uuids::uuid &) {}
   );
 
+  ~room_t();
+
+  [[nodiscard]] snapshot_t save() const;
+
   [[nodiscard]] std::chrono::steady_clock::time_point get_expire_time() const;
 
+  // Returns the earliest of the room expiry and the inactivity deadlines of the users.
+  [[nodiscard]] std::chrono::steady_clock::time_point get_next_deadline(std::chrono::milliseconds user_timeout) const;
+
   void join(std::string version, const user_t &user);
 
   [[nodiscard]] user_t get_user(boost::uuids::uuid id) const;
@@ -80,6 +183,12 @@ public:
 
   [[nodiscard]] std::vector<user_t> get_users() const;
 
+  // Returns the version of the members, which changes each time a user joins or is kicked.
+  [[nodiscard]] uint64_t get_users_version() const;
+
+  // Visits users without copying them. The room is locked while visiting.
+  void for_each_user(const std::function<void(const user_t &)> &fn) const;
+
   [[nodiscard]] user_t get_owner() const;
 
   [[nodiscard]] bool is_in_lobby() const;
@@ -88,27 +197,79 @@ public:
 
   [[nodiscard]] bool is_available() const;
 
-  [[nodiscard]] nlohmann::json get_info() const;
-
-  void update_info(const nlohmann::json &new_info);
-
-  [[nodiscard]] std::vector<std::shared_ptr<sync_record_t>> sync(
-    boost::uuids::uuid user_id, const std::vector<std::shared_ptr<sync_record_t::event_t>> &reports,
-    const std::vector<std::shared_ptr<sync_record_t::event_t>> &actions,
-    std::chrono::milliseconds wait_timeout = std::chrono::milliseconds{ 200 },
-    std::chrono::milliseconds sync_timeout = std::chrono::milliseconds{ 50 }
+  // Updates replace the whole info, so it can be read without locking the room.
+  [[nodiscard]] std::shared_ptr<const info_t> get_info() const;
+
+  // Bumps the version unless the info is unchanged.
+  void update_info(std::string new_info);
+
+  // A round closes when all users have arrived, or when the users who have not are no longer expected.
+  // Each user is expected by the average offset of their arrivals plus a margin for jitter, which is clamped
+  // between sync_timeout_min and sync_timeout_max. Users who skipped last sync also wait wait_timeout for the others.
+  void sync(
+    boost::uuids::uuid user_id, std::span<const sync_record_t::new_event_t> reports,
+    std::span<const sync_record_t::new_event_t> actions, sync_handler handler,
+    std::chrono::milliseconds sync_timeout_min = std::chrono::milliseconds{ 10 },
+    std::chrono::milliseconds sync_timeout_max = std::chrono::milliseconds{ 100 },
+    std::chrono::milliseconds wait_timeout = std::chrono::milliseconds{ 200 }
   );
 
+  // Drops the rounds every user has received and returns the number of dropped rounds.
   size_t clean_sync_records();
 
+  // Returns the bytes of events held by the rounds in the history, which are charged to the event budget.
+  [[nodiscard]] size_t get_buffered_size() const;
+
 protected:
+  struct sync_waiter_t {
+    boost::uuids::uuid user_id;
+    std::chrono::steady_clock::time_point arrival_time;
+    bool lagging;
+    sync_handler handler;
+  };
+
+  using sync_completion_t = std::pair<sync_handler, sync_result_t>;
+
   static boost::uuids::uuid gen_id();
 
+  timer_queue_t &timer_queue;
+  event_budget_t &event_budget;
+
   mutable std::shared_mutex room_mutex;
+  std::atomic<std::shared_ptr<const info_t>> info;
   std::chrono::steady_clock::time_point expire_time;
-  std::map<boost::uuids::uuid, user_t> users;
+  // users in slots, by which sync records track their phases
+  member_table_t<user_t, size_max> users;
+  uint64_t users_version;
   bool in_lobby;
-  nlohmann::json info;
-  std::map<boost::uuids::uuid, std::shared_ptr<sync_record_t>> sync_records;
-  std::condition_variable_any sync_cv;
+  // ring of rounds by sequence number, where the round of seq is at seq % size
+  std::vector<std::shared_ptr<sync_record_t>> sync_history;
+  uint64_t history_begin; // the oldest round kept
+  uint64_t history_end; // one past the current round
+  size_t buffered_size;
+  // these are reset each time the current round closes
+  std::vector<sync_waiter_t> sync_waiters;
+  std::chrono::steady_clock::time_point round_open_time;
+  std::chrono::steady_clock::time_point round_deadline;
+  // of the last closed round, to observe users who arrived just too late for it
+  std::chrono::steady_clock::time_point last_round_open_time;
+  std::chrono::steady_clock::time_point last_round_close_time;
+
+  void on_sync_timer(boost::uuids::uuid record_id);
+
+  // This requires room_mutex to be locked.
+  [[nodiscard]] const std::shared_ptr<sync_record_t> &get_record(uint64_t seq) const;
+  // Returns the time from the first arrival by which the users who have not arrived in the round are expected.
+  [[nodiscard]] std::chrono::steady_clock::duration get_sync_window(
+    const sync_record_t &record, std::chrono::milliseconds sync_timeout_min, std::chrono::milliseconds sync_timeout_max
+  ) const;
+
+  // These require room_mutex to be locked exclusively.
+  void schedule_sync_timer(boost::uuids::uuid record_id, std::chrono::steady_clock::time_point time);
+  void close_round(bool timed_out, std::vector<sync_completion_t> &completions);
+  // Opens the next round, dropping the oldest one if the history is full.
+  void push_record();
+  size_t erase_synced_records();
+  // Drops the oldest round and releases its events from the budget.
+  void pop_record();
 };
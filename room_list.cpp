@@ -1,6 +1,8 @@
 #include "room_list.hpp"
 
 #include "errors.hpp"
+#include <algorithm>
+#include <cstring>
 #include <random>
 #include <format>
 #include <utility>
@@ -11,24 +13,59 @@ using namespace boost::uuids;
 // room list
 
 room_list_t::room_list_t(
-  const size_t limit, const chrono::minutes lobby_lifetime, const chrono::minutes game_lifetime, logger log_error,
-  logger log_info
+  const cluster_t &cluster, const size_t limit, const chrono::minutes lobby_lifetime,
+  const chrono::minutes game_lifetime, const chrono::milliseconds user_timeout, const size_t history_limit,
+  timer_queue_t &timer_queue, timer_wheel_t &timer_wheel, event_budget_t &event_budget, logger log_error,
+  logger log_info, room_t::round_observer on_round_closed, room_observer on_room_removed,
+  room_t::user_observer on_user_kicked
 )
-  : log_error(move(log_error)), log_info(move(log_info)), lobby_lifetime(lobby_lifetime), game_lifetime(game_lifetime),
-    limit(limit) {}
+  : log_error(move(log_error)), log_info(move(log_info)), on_round_closed(move(on_round_closed)),
+    on_room_removed(move(on_room_removed)), on_user_kicked(move(on_user_kicked)),
+    lobby_lifetime(lobby_lifetime), game_lifetime(game_lifetime), user_timeout(user_timeout),
+    history_limit(history_limit), cluster(cluster), timer_queue(timer_queue), timer_wheel(timer_wheel),
+    event_budget(event_budget), limit(limit), room_count(0) {
+  vector<uint32_t> names;
+  names.reserve(name_count / cluster.count() + 1);
+  for (uint32_t name = 0; name < name_count; name++) {
+    if (cluster.is_local(cluster.get_name_owner(name))) names.emplace_back(name);
+  }
+  ranges::shuffle(names, mt19937_64(random_device{}()));
+  free_names.assign(names.begin(), names.end());
+}
 
 shared_ptr<room_t> room_list_t::create(const string &version, const room_t::user_t &owner, const size_t size) {
-  lock_guard lock(rooms_mutex);
-  if (rooms.size() >= limit) throw forbidden_error(format("Room limit reached. Max room count is {}.", limit));
-  thread_local mt19937_64 gen_rand(random_device{}());
-  thread_local uniform_int_distribution dist(0uLL, stoull(string(name_length, '9')));
-  string name;
-  do {
-    name = format("{:0{}}", dist(gen_rand), name_length);
-  } while (name_to_id.contains(name));
-  const auto room = make_shared<room_t>(version, owner, name, size, lobby_lifetime, game_lifetime, log_error, log_info);
-  rooms[room->id] = room;
-  name_to_id[name] = room->id;
+  const size_t max_count = limit.load();
+  if (room_count.fetch_add(1) >= max_count) {
+    room_count.fetch_sub(1);
+    throw forbidden_error(format("Room limit reached. Max room count is {}.", max_count));
+  }
+  uint32_t name_number;
+  {
+    lock_guard lock(names_mutex);
+    if (free_names.empty()) {
+      room_count.fetch_sub(1);
+      throw forbidden_error("Room limit reached. No room name is available.");
+    }
+    name_number = free_names.front();
+    free_names.pop_front();
+  }
+  const string name = format("{:0{}}", name_number, name_length);
+  shared_ptr<room_t> room;
+  try {
+    room = make_shared<room_t>(
+      version, owner, name, size, lobby_lifetime, game_lifetime, history_limit, timer_queue, event_budget, log_error,
+      log_info, on_round_closed, on_user_kicked
+    );
+  } catch (...) {
+    // an invalid request must not keep the slot or the name
+    {
+      lock_guard lock(names_mutex);
+      free_names.push_front(name_number);
+    }
+    room_count.fetch_sub(1);
+    throw;
+  }
+  add(room, name_number);
   log_info(
     format(
       "Room created: {} (version={}, owner_id={}, name={}, size={})",
@@ -43,68 +80,188 @@ shared_ptr<room_t> room_list_t::create(const string &version, const room_t::user
 }
 
 shared_ptr<room_t> room_list_t::get(const uuid id) const {
-  shared_lock lock(rooms_mutex);
-  try {
-    return rooms.at(id);
-  } catch (const out_of_range &) {
-    throw not_found_error("Room not found.");
-  }
+  const id_shard_t &shard = id_shards[shard_index(id)];
+  shared_lock lock(shard.shard_mutex);
+  const auto it = shard.rooms.find(id);
+  if (it == shard.rooms.end()) throw not_found_error("Room not found.");
+  return it->second.room;
 }
 
 shared_ptr<room_t> room_list_t::get(const string &name) const {
-  shared_lock lock(rooms_mutex);
-  try {
-    return rooms.at(name_to_id.at(name));
-  } catch (const out_of_range &) {
-    throw not_found_error("Room not found.");
-  }
+  const auto name_number = parse_name(name);
+  if (!name_number) throw not_found_error("Room not found.");
+  if (const size_t owner = cluster.get_name_owner(*name_number); !cluster.is_local(owner)) throw redirect_error(owner);
+  const name_shard_t &shard = name_shards[shard_index(*name_number)];
+  shared_lock lock(shard.shard_mutex);
+  const auto it = shard.rooms.find(*name_number);
+  if (it == shard.rooms.end()) throw not_found_error("Room not found.");
+  return it->second;
 }
 
 bool room_list_t::exists(const uuid id) const {
-  shared_lock lock(rooms_mutex);
-  return rooms.contains(id);
+  const id_shard_t &shard = id_shards[shard_index(id)];
+  shared_lock lock(shard.shard_mutex);
+  return shard.rooms.contains(id);
 }
 
 bool room_list_t::exists(const string &name) const {
-  shared_lock lock(rooms_mutex);
-  return name_to_id.contains(name);
+  const auto name_number = parse_name(name);
+  if (!name_number || !cluster.is_local(cluster.get_name_owner(*name_number))) return false;
+  const name_shard_t &shard = name_shards[shard_index(*name_number)];
+  shared_lock lock(shard.shard_mutex);
+  return shard.rooms.contains(*name_number);
 }
 
 bool room_list_t::remove(const uuid id) {
-  lock_guard lock(rooms_mutex);
-  name_to_id.erase(rooms.at(id)->name);
-  if (rooms.erase(id) > 0) {
-    log_info(format("Room removed: {}", to_string(id)));
-    return true;
+  room_entry_t entry;
+  {
+    id_shard_t &shard = id_shards[shard_index(id)];
+    lock_guard lock(shard.shard_mutex);
+    const auto it = shard.rooms.find(id);
+    if (it == shard.rooms.end()) return false;
+    entry = move(it->second);
+    shard.rooms.erase(it);
+  }
+  timer_wheel.cancel(entry.timer_id);
+  const shared_ptr<room_t> &room = entry.room;
+  const uint32_t name_number = *parse_name(room->name);
+  {
+    name_shard_t &shard = name_shards[shard_index(name_number)];
+    lock_guard lock(shard.shard_mutex);
+    shard.rooms.erase(name_number);
   }
-  return false;
+  {
+    lock_guard lock(names_mutex);
+    free_names.push_back(name_number);
+  }
+  room_count.fetch_sub(1);
+  log_info(format("Room removed: {}", to_string(id)));
+  on_room_removed(id);
+  return true;
 }
 
 size_t room_list_t::count() const {
-  shared_lock lock(rooms_mutex);
-  return rooms.size();
+  return room_count.load();
 }
 
 vector<shared_ptr<room_t>> room_list_t::get_all() const {
-  shared_lock lock(rooms_mutex);
-  const auto view = rooms | views::transform([](const pair<uuid, shared_ptr<room_t>> &room) { return room.second; });
-  return move(vector(view.begin(), view.end()));
+  vector<shared_ptr<room_t>> rooms;
+  rooms.reserve(count());
+  for (const id_shard_t &shard: id_shards) {
+    shared_lock lock(shard.shard_mutex);
+    for (const room_entry_t &entry: shard.rooms | views::values) rooms.emplace_back(entry.room);
+  }
+  return rooms;
 }
 
 size_t room_list_t::get_limit() const {
-  shared_lock lock(rooms_mutex);
-  return limit;
+  return limit.load();
 }
 
 void room_list_t::set_limit(const size_t new_limit) {
-  lock_guard lock(rooms_mutex);
-  limit = new_limit;
+  limit.store(new_limit);
+}
+
+size_t room_list_t::restore(const vector<room_t::snapshot_t> &snapshots) {
+  size_t count = 0;
+  // held throughout so that no room is created with a restored name
+  lock_guard names_lock(names_mutex);
+  unordered_set<uint32_t> restored_names;
+  for (const room_t::snapshot_t &snapshot: snapshots) {
+    try {
+      const auto name_number = parse_name(snapshot.name);
+      if (!name_number) throw bad_request_error("Invalid room name.");
+      if (!cluster.is_local(cluster.get_name_owner(*name_number))) throw forbidden_error("Owned by another node.");
+      if (exists(snapshot.id) || exists(snapshot.name)) throw forbidden_error("Room already exists.");
+      const size_t max_count = limit.load();
+      if (room_count.fetch_add(1) >= max_count) {
+        room_count.fetch_sub(1);
+        throw forbidden_error(format("Room limit reached. Max room count is {}.", max_count));
+      }
+      shared_ptr<room_t> room;
+      try {
+        room = make_shared<room_t>(
+          snapshot, lobby_lifetime, game_lifetime, history_limit, timer_queue, event_budget, log_error, log_info,
+          on_round_closed, on_user_kicked
+        );
+      } catch (...) {
+        room_count.fetch_sub(1);
+        throw;
+      }
+      add(room, *name_number);
+      restored_names.emplace(*name_number);
+      count++;
+    } catch (const exception &err) {
+      log_error(format("Room not restored: {} ({})", to_string(snapshot.id), err.what()));
+    }
+  }
+  if (!restored_names.empty()) erase_if(free_names, [&](const uint32_t name) { return restored_names.contains(name); });
+  log_info(format("Rooms restored: {}", count));
+  return count;
+}
+
+void room_list_t::watch(const uuid id) {
+  const auto deadline = get(id)->get_next_deadline(user_timeout);
+  const id_shard_t &shard = id_shards[shard_index(id)];
+  shared_lock lock(shard.shard_mutex);
+  // the timer keeps its entry while on_deadline runs, so this also re-arms it from there
+  if (const auto it = shard.rooms.find(id); it != shard.rooms.end()) {
+    timer_wheel.reschedule(it->second.timer_id, deadline);
+  }
 }
 
-void room_list_t::clean(const chrono::milliseconds user_timeout) {
-  for (const shared_ptr<room_t> &room: get_all()) {
-    if (!room->is_available()) remove(room->id);
-    room->kick_expired(user_timeout);
-    room->clean_sync_records();
+void room_list_t::add(const shared_ptr<room_t> &room, const uint32_t name_number) {
+  // the room is in both shards before its deadline can fire and remove it
+  {
+    name_shard_t &shard = name_shards[shard_index(name_number)];
+    lock_guard lock(shard.shard_mutex);
+    shard.rooms.emplace(name_number, room);
   }
+  id_shard_t &shard = id_shards[shard_index(room->id)];
+  lock_guard lock(shard.shard_mutex);
+  room_entry_t &entry = shard.rooms.emplace(room->id, room_entry_t{ room, {} }).first->second;
+  // on_deadline waits for the lock, so watch and remove never see the entry before it has its timer
+  entry.timer_id = timer_wheel.schedule(
+    room->get_next_deadline(user_timeout), [this, id = room->id] { on_deadline(id); }
+  );
+}
+
+void room_list_t::on_deadline(const uuid id) {
+  try {
+    const shared_ptr<room_t> room = get(id);
+    if (room->kick_expired(user_timeout) > 0) room->clean_sync_records();
+    if (!room->is_available()) {
+      remove(id);
+      return;
+    }
+    // user activity never touches the wheel; the deadline of an active user is re-checked here when it is reached
+    watch(id);
+  } catch (const not_found_error &) {
+    // removed before its deadline
+  } catch (const exception &err) {
+    log_error(format("Room expiry error: {}", err.what()));
+  }
+}
+
+size_t room_list_t::shard_index(const uuid &id) {
+  return id_hash_t()(id) % shard_count;
+}
+
+size_t room_list_t::shard_index(const uint32_t name) {
+  return name % shard_count;
+}
+
+optional<uint32_t> room_list_t::parse_name(const string &name) {
+  if (name.size() != name_length || !ranges::all_of(name, [](const char c) { return c >= '0' && c <= '9'; })) {
+    return nullopt;
+  }
+  return static_cast<uint32_t>(stoul(name));
+}
+
+// room ID hash
+
+size_t room_list_t::id_hash_t::operator()(const uuid &id) const {
+  uint64_t value;
+  memcpy(&value, id.data + 8, sizeof(value));
+  return value;
 }
@@ -1,12 +1,21 @@
 #pragma once
 
 #include "room.hpp"
+#include "cluster.hpp"
+#include "timer_queue.hpp"
+#include "timer_wheel.hpp"
 
 #include <boost/uuid.hpp>
+#include <atomic>
 #include <chrono>
+#include <mutex>
 #include <shared_mutex>
-#include <map>
+#include <array>
+#include <deque>
+#include <optional>
 #include <string>
+#include <unordered_map>
+#include <unordered_set>
 #include <vector>
 #include <functional>
 #include <memory>
@@ -14,23 +23,40 @@
 class room_list_t {
 public:
   using logger = std::function<void(const std::string &)>;
+  // Called outside the room list locks each time a room is removed.
+  using room_observer = std::function<void(const boost::uuids::uuid &room_id)>;
 
   static constexpr size_t name_length = 6; // name is actually a 6-digit number
+  static constexpr uint32_t name_count = 1'000'000; // 10^name_length
+  static constexpr size_t shard_count = 64;
 
   const logger log_error, log_info;
+  const room_t::round_observer on_round_closed;
+  const room_observer on_room_removed;
+  const room_t::user_observer on_user_kicked;
 
   const std::chrono::minutes lobby_lifetime;
   const std::chrono::minutes game_lifetime;
+  const std::chrono::milliseconds user_timeout;
+  const size_t history_limit;
 
+  // Rooms are removed and inactive users are kicked at their deadlines on timer_wheel.
+  // Only names owned by this node of the cluster are used.
   [[nodiscard]] explicit room_list_t(
-    size_t limit, std::chrono::minutes lobby_lifetime, std::chrono::minutes game_lifetime,
-    logger log_error = [](const std::string &) {}, logger log_info = [](const std::string &) {}
+    const cluster_t &cluster, size_t limit, std::chrono::minutes lobby_lifetime, std::chrono::minutes game_lifetime,
+    std::chrono::milliseconds user_timeout, size_t history_limit, timer_queue_t &timer_queue,
+    timer_wheel_t &timer_wheel, event_budget_t &event_budget, logger log_error = [](const std::string &) {},
+    logger log_info = [](const std::string &) {},
+    room_t::round_observer on_round_closed = [](const room_t::round_stats_t &) {},
+    room_observer on_room_removed = [](const boost::uuids::uuid &) {},
+    room_t::user_observer on_user_kicked = [](const boost::uuids::uuid &, const boost::uuids::uuid &) {}
   );
 
   [[nodiscard]] std::shared_ptr<room_t> create(const std::string &version, const room_t::user_t &owner, size_t size);
 
   [[nodiscard]] std::shared_ptr<room_t> get(boost::uuids::uuid id) const;
 
+  // Throws redirect_error if another node owns the name.
   [[nodiscard]] std::shared_ptr<room_t> get(const std::string &name) const;
 
   [[nodiscard]] bool exists(boost::uuids::uuid id) const;
@@ -47,11 +73,56 @@ public:
 
   void set_limit(size_t new_limit);
 
-  void clean(std::chrono::milliseconds user_timeout);
+  // Restores rooms from snapshots and returns the number of rooms restored.
+  // Rooms which are invalid, owned by another node, already present or beyond the limit are skipped.
+  size_t restore(const std::vector<room_t::snapshot_t> &snapshots);
+
+  // Re-arms the deadline of a room after its lifetime has changed.
+  void watch(boost::uuids::uuid id);
+
+  // Returns the number of a name, or nullopt if it is not a valid name.
+  [[nodiscard]] static std::optional<uint32_t> parse_name(const std::string &name);
 
 protected:
-  mutable std::shared_mutex rooms_mutex;
-  size_t limit;
-  std::map<boost::uuids::uuid, std::shared_ptr<room_t>> rooms;
-  std::map<std::string, boost::uuids::uuid> name_to_id;
+  // uuid v7 is random in its last 8 bytes
+  struct id_hash_t {
+    size_t operator()(const boost::uuids::uuid &id) const;
+  };
+
+  // Rooms are split into shards by ID and by name so that lookups only contend within a shard.
+  template<typename key_t, typename value_t, typename hash_t>
+  struct alignas(64) shard_t {
+    mutable std::shared_mutex shard_mutex;
+    std::unordered_map<key_t, value_t, hash_t> rooms;
+  };
+
+  struct room_entry_t {
+    std::shared_ptr<room_t> room;
+    timer_wheel_t::id_t timer_id;
+  };
+
+  using id_shard_t = shard_t<boost::uuids::uuid, room_entry_t, id_hash_t>;
+  using name_shard_t = shard_t<uint32_t, std::shared_ptr<room_t>, std::hash<uint32_t>>;
+
+  const cluster_t &cluster;
+  timer_queue_t &timer_queue;
+  timer_wheel_t &timer_wheel;
+  event_budget_t &event_budget;
+  std::atomic<size_t> limit;
+  std::atomic<size_t> room_count;
+  std::array<id_shard_t, shard_count> id_shards;
+  std::array<name_shard_t, shard_count> name_shards;
+  // unused names in random order; removed names go to the back so that they are reused last
+  std::mutex names_mutex;
+  std::deque<uint32_t> free_names;
+
+  // Registers a room by its ID and name and arms its deadline. The name must have been taken from free_names.
+  void add(const std::shared_ptr<room_t> &room, uint32_t name_number);
+
+  // Kicks expired users and removes the room if it is no longer available, or re-arms its deadline.
+  void on_deadline(boost::uuids::uuid id);
+
+  [[nodiscard]] static size_t shard_index(const boost::uuids::uuid &id);
+
+  [[nodiscard]] static size_t shard_index(uint32_t name);
 };
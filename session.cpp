@@ -1,71 +1,294 @@
 #include "session.hpp"
 
 #include "errors.hpp"
+#include <algorithm>
+#include <bit>
+#include <charconv>
 #include <format>
+#include <random>
+#include <ranges>
 #include <utility>
 
 using namespace std;
 using namespace boost::uuids;
 
-uuid session_t::gen_id() {
-  thread_local time_generator_v7 gen;
-  return gen();
+constexpr char base64url_chars[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789-_";
+constexpr auto base64url_values = [] {
+  array<int8_t, 256> values{};
+  values.fill(-1);
+  for (int8_t i = 0; i < 64; i++) values[static_cast<uint8_t>(base64url_chars[i])] = i;
+  return values;
+}();
+
+/**
+ * Compute SipHash-2-4 of data.
+ * @param key The 128-bit key.
+ * @param data The data.
+ * @return The 64-bit MAC.
+ */
+uint64_t siphash(const array<uint8_t, 16> &key, const string_view data) {
+  const auto load_le = [](const uint8_t *p, const size_t size) {
+    uint64_t value = 0;
+    for (size_t i = 0; i < size; i++) value |= static_cast<uint64_t>(p[i]) << (i * 8);
+    return value;
+  };
+  const uint64_t k0 = load_le(key.data(), 8), k1 = load_le(key.data() + 8, 8);
+  uint64_t v0 = k0 ^ 0x736f6d6570736575, v1 = k1 ^ 0x646f72616e646f6d;
+  uint64_t v2 = k0 ^ 0x6c7967656e657261, v3 = k1 ^ 0x7465646279746573;
+  const auto round = [&] {
+    v0 += v1, v1 = rotl(v1, 13), v1 ^= v0, v0 = rotl(v0, 32);
+    v2 += v3, v3 = rotl(v3, 16), v3 ^= v2;
+    v0 += v3, v3 = rotl(v3, 21), v3 ^= v0;
+    v2 += v1, v1 = rotl(v1, 17), v1 ^= v2, v2 = rotl(v2, 32);
+  };
+  const auto *bytes = reinterpret_cast<const uint8_t *>(data.data());
+  const size_t tail_size = data.size() % 8;
+  for (size_t i = 0; i < data.size() - tail_size; i += 8) {
+    const uint64_t m = load_le(bytes + i, 8);
+    v3 ^= m;
+    round(), round();
+    v0 ^= m;
+  }
+  const uint64_t last = static_cast<uint64_t>(data.size()) << 56 | load_le(bytes + data.size() - tail_size, tail_size);
+  v3 ^= last;
+  round(), round();
+  v0 ^= last;
+  v2 ^= 0xff;
+  round(), round(), round(), round();
+  return v0 ^ v1 ^ v2 ^ v3;
 }
 
 // session
 
-session_t::session_t(const uuid room_id, const uuid user_id) : id(gen_id()), room_id(room_id), user_id(user_id) {}
+session_t::session_t(string id, const uuid room_id, const uuid user_id)
+  : id(move(id)), room_id(room_id), user_id(user_id) {}
 
 // session list
 
-session_list_t::session_list_t(logger log_error, logger log_info)
-  : log_error(move(log_error)), log_info(move(log_info)) {}
+session_list_t::session_list_t(
+  const mode_t mode, const size_t node_id, const size_t node_count, logger log_error, logger log_info
+)
+  : log_error(move(log_error)), log_info(move(log_info)), mode(mode), node_id(node_id), node_count(node_count),
+    secret(gen_secret()), has_revoked(false) {}
 
 session_t session_list_t::create(const uuid &room_id, const uuid &user_id) {
-  lock_guard lock(sessions_mutex);
-  const session_t session(room_id, user_id);
-  sessions.emplace(session.id, session);
-  log_info(
-    format(
-      "Session created: {} (room_id={}, user_id={})",
-      to_string(session.id),
-      to_string(room_id),
-      to_string(user_id)
-    )
-  );
+  const auto log_created = [&](const session_t &session) {
+    log_info(
+      format(
+        "Session created: {} (room_id={}, user_id={})", session.id, to_string(room_id), to_string(user_id)
+      )
+    );
+  };
+  if (mode == mode_t::TOKEN) {
+    const session_t session(sign(room_id, user_id), room_id, user_id);
+    log_created(session);
+    return session;
+  }
+  const session_t session(format("{}.{}", node_id, to_string(gen_id())), room_id, user_id);
+  {
+    lock_guard lock(sessions_mutex);
+    if (const auto it = session_ids.find({ room_id, user_id }); it != session_ids.end()) erase(it);
+    insert(session);
+  }
+  log_created(session);
   return session;
 }
 
-session_t session_list_t::get(const uuid id) const {
+session_t session_list_t::get(const string_view id) const {
+  if (mode == mode_t::TOKEN) {
+    session_t session = verify(id);
+    if (has_revoked.load(memory_order_acquire)) {
+      shared_lock lock(sessions_mutex);
+      if (sessions.contains(id)) throw unauthorized_error("Session not found.");
+    }
+    return session;
+  }
+  (void) strip_node(id);
   shared_lock lock(sessions_mutex);
+  const auto it = sessions.find(id);
+  if (it == sessions.end()) throw unauthorized_error("Session not found.");
+  return it->second;
+}
+
+bool session_list_t::exists(const string_view id) const {
   try {
-    return sessions.at(id);
-  } catch (const out_of_range &) {
-    throw unauthorized_error("Session not found.");
+    (void) get(id);
+    return true;
+  } catch (const unauthorized_error &) {
+    return false;
   }
 }
 
-bool session_list_t::exists(const uuid id) const {
+bool session_list_t::remove(const string_view id) {
+  if (mode == mode_t::TOKEN) {
+    try {
+      return revoke(verify(id));
+    } catch (const unauthorized_error &) {
+      return false;
+    }
+  }
+  {
+    lock_guard lock(sessions_mutex);
+    const auto it = sessions.find(id);
+    if (it == sessions.end()) return false;
+    erase(session_ids.find({ it->second.room_id, it->second.user_id }));
+  }
+  log_info(format("Session removed: {}", id));
+  return true;
+}
+
+size_t session_list_t::count() const {
   shared_lock lock(sessions_mutex);
-  return sessions.contains(id);
+  return sessions.size();
 }
 
-bool session_list_t::remove(const uuid id) {
-  lock_guard lock(sessions_mutex);
-  if (sessions.erase(id) > 0) {
-    log_info(format("Session removed: {}", to_string(id)));
-    return true;
+size_t session_list_t::remove_room(const uuid &room_id) {
+  size_t count = 0;
+  {
+    lock_guard lock(sessions_mutex);
+    auto it = session_ids.lower_bound({ room_id, nil_uuid() });
+    while (it != session_ids.end() && it->first.first == room_id) {
+      erase(it++);
+      count++;
+    }
   }
-  return false;
+  if (count > 0) log_info(format("Sessions removed: {} (room_id={})", count, to_string(room_id)));
+  return count;
 }
 
-size_t session_list_t::clean(const function<bool(const session_t &)> &is_expired) {
-  lock_guard lock(sessions_mutex);
-  return erase_if(sessions, [&](const pair<uuid, session_t> &session) {
-    if (is_expired(session.second)) {
-      log_info(format("Session expired: {}", to_string(session.first)));
-      return true;
+bool session_list_t::remove_user(const uuid &room_id, const uuid &user_id) {
+  // the token of a user is the same each time it is signed, and user IDs are never reused
+  if (mode == mode_t::TOKEN) return revoke(session_t(sign(room_id, user_id), room_id, user_id));
+  string id;
+  {
+    lock_guard lock(sessions_mutex);
+    const auto it = session_ids.find({ room_id, user_id });
+    if (it == session_ids.end()) return false;
+    id = it->second;
+    erase(it);
+  }
+  log_info(format("Session removed: {}", id));
+  return true;
+}
+
+session_list_t::snapshot_t session_list_t::save() const {
+  shared_lock lock(sessions_mutex);
+  snapshot_t snapshot{ mode, secret, {} };
+  snapshot.sessions.reserve(sessions.size());
+  for (const session_t &session: sessions | views::values) snapshot.sessions.emplace_back(session);
+  return snapshot;
+}
+
+void session_list_t::restore(const snapshot_t &snapshot) {
+  const string prefix = format("{}.", node_id);
+  size_t count = 0;
+  {
+    lock_guard lock(sessions_mutex);
+    secret = snapshot.secret;
+    for (const session_t &session: snapshot.sessions) {
+      // the sessions of the other mode mean nothing in this one
+      if (snapshot.mode != mode || !session.id.starts_with(prefix) || sessions.contains(session.id)) continue;
+      if (session_ids.contains({ session.room_id, session.user_id })) continue;
+      insert(session);
+      count++;
     }
-    return false;
-  });
+  }
+  log_info(format("Sessions restored: {}", count));
+}
+
+bool session_list_t::revoke(const session_t &session) {
+  {
+    lock_guard lock(sessions_mutex);
+    if (sessions.contains(session.id)) return false;
+    insert(session);
+  }
+  log_info(format("Session revoked: {}", session.id));
+  return true;
+}
+
+void session_list_t::insert(const session_t &session) {
+  sessions.emplace(session.id, session);
+  session_ids.emplace(pair{ session.room_id, session.user_id }, session.id);
+  if (mode == mode_t::TOKEN) has_revoked.store(true, memory_order_release);
+}
+
+void session_list_t::erase(const map<pair<uuid, uuid>, string>::iterator it) {
+  sessions.erase(it->second);
+  session_ids.erase(it);
+  // once the rooms of every revoked token are gone, tokens are verified without locking again
+  if (mode == mode_t::TOKEN && sessions.empty()) has_revoked.store(false, memory_order_release);
+}
+
+uuid session_list_t::gen_id() {
+  thread_local time_generator_v7 gen;
+  return gen();
+}
+
+string_view session_list_t::strip_node(const string_view id) const {
+  const size_t dot = id.find('.');
+  if (dot == string_view::npos) throw unauthorized_error("Session not found.");
+  size_t node;
+  const auto result = from_chars(id.data(), id.data() + dot, node);
+  if (result.ec != errc() || result.ptr != id.data() + dot) throw unauthorized_error("Session not found.");
+  // no node can own a session of a node outside the cluster
+  if (node >= node_count) throw unauthorized_error("Session not found.");
+  if (node != node_id) throw redirect_error(node);
+  return id.substr(dot + 1);
+}
+
+array<uint8_t, 16> session_list_t::gen_secret() {
+  random_device rd;
+  array<uint8_t, 16> secret{};
+  for (uint8_t &byte: secret) byte = static_cast<uint8_t>(rd());
+  return secret;
+}
+
+string session_list_t::sign(const uuid &room_id, const uuid &user_id) const {
+  string payload(token_size, '\0');
+  ranges::copy(room_id, payload.begin());
+  ranges::copy(user_id, payload.begin() + 16);
+  const uint64_t mac = siphash(secret, string_view(payload).substr(0, 32));
+  for (size_t i = 0; i < 8; i++) payload[32 + i] = static_cast<char>(mac >> (i * 8));
+
+  // base64url without padding
+  string token = format("{}.", node_id);
+  token.reserve(token.size() + (token_size * 4 + 2) / 3);
+  for (size_t i = 0; i < token_size; i += 3) {
+    uint32_t bits = static_cast<uint8_t>(payload[i]) << 16;
+    if (i + 1 < token_size) bits |= static_cast<uint8_t>(payload[i + 1]) << 8;
+    if (i + 2 < token_size) bits |= static_cast<uint8_t>(payload[i + 2]);
+    const size_t chars = min<size_t>(token_size - i, 3) + 1;
+    for (size_t j = 0; j < chars; j++) token.push_back(base64url_chars[bits >> (18 - j * 6) & 0x3f]);
+  }
+  return token;
+}
+
+session_t session_list_t::verify(const string_view id) const {
+  const string_view token = strip_node(id);
+  if (token.size() != (token_size * 4 + 2) / 3) throw unauthorized_error("Session not found.");
+  array<char, token_size> payload{};
+  size_t payload_size = 0;
+  uint32_t bits = 0;
+  size_t bit_count = 0;
+  for (const char c: token) {
+    const int8_t value = base64url_values[static_cast<uint8_t>(c)];
+    if (value < 0) throw unauthorized_error("Session not found.");
+    bits = bits << 6 | static_cast<uint32_t>(value);
+    bit_count += 6;
+    if (bit_count >= 8) {
+      bit_count -= 8;
+      payload[payload_size++] = static_cast<char>(bits >> bit_count);
+    }
+  }
+  // reject non-canonical encodings so that each session has exactly one token to revoke
+  if ((bits & ((1u << bit_count) - 1)) != 0) throw unauthorized_error("Session not found.");
+  const uint64_t mac = siphash(secret, string_view(payload.data(), 32));
+  uint8_t diff = 0;
+  for (size_t i = 0; i < 8; i++) diff |= static_cast<uint8_t>(payload[32 + i]) ^ static_cast<uint8_t>(mac >> (i * 8));
+  if (diff != 0) throw unauthorized_error("Session not found.");
+
+  uuid room_id, user_id;
+  ranges::copy(payload | views::take(16), room_id.begin());
+  ranges::copy(payload | views::drop(16) | views::take(16), user_id.begin());
+  return session_t(string(id), room_id, user_id);
 }
@@ -1,44 +1,108 @@
 #pragma once
 
 #include <boost/uuid.hpp>
+#include <atomic>
 #include <shared_mutex>
+#include <array>
 #include <map>
+#include <utility>
 #include <string>
+#include <string_view>
+#include <vector>
 #include <functional>
 
 class session_t {
 public:
-  const boost::uuids::uuid id;
+  const std::string id;
   const boost::uuids::uuid room_id;
   const boost::uuids::uuid user_id;
 
-  [[nodiscard]] explicit session_t(boost::uuids::uuid room_id, boost::uuids::uuid user_id);
-
-protected:
-  static boost::uuids::uuid gen_id();
+  [[nodiscard]] explicit session_t(std::string id, boost::uuids::uuid room_id, boost::uuids::uuid user_id);
 };
 
 class session_list_t {
 public:
   using logger = std::function<void(const std::string &)>;
 
+  // MAP keeps every session. TOKEN signs room_id and user_id into the session ID and keeps only revoked sessions.
+  enum class mode_t { MAP = 0, TOKEN = 1 };
+
+  // The state of the list that outlives the process, including the secret which signs tokens.
+  struct snapshot_t {
+    mode_t mode;
+    std::array<uint8_t, 16> secret;
+    std::vector<session_t> sessions;
+  };
+
   const logger log_error, log_info;
+  const mode_t mode;
+  // Session IDs start with the ID of the node which created them, so that any node can redirect them.
+  const size_t node_id;
+  const size_t node_count;
 
   [[nodiscard]] explicit session_list_t(
+    mode_t mode = mode_t::MAP, size_t node_id = 0, size_t node_count = 1,
     logger log_error = [](const std::string &) {}, logger log_info = [](const std::string &) {}
   );
 
+  // A user has one session, so creating another one replaces it.
   [[nodiscard]] session_t create(const boost::uuids::uuid &room_id, const boost::uuids::uuid &user_id);
 
-  [[nodiscard]] session_t get(boost::uuids::uuid id) const;
+  // Tokens are verified without locking unless some session has been revoked.
+  // Throws redirect_error if another node created the session.
+  [[nodiscard]] session_t get(std::string_view id) const;
 
-  [[nodiscard]] bool exists(boost::uuids::uuid id) const;
+  [[nodiscard]] bool exists(std::string_view id) const;
 
-  bool remove(boost::uuids::uuid id);
+  bool remove(std::string_view id);
 
-  size_t clean(const std::function<bool(const session_t &)> &is_expired);
+  // Returns the number of sessions, or of revoked sessions in TOKEN mode.
+  [[nodiscard]] size_t count() const;
+
+  // Drops the sessions of a removed room. In TOKEN mode its tokens cannot be revoked without knowing its users,
+  // so they stay valid, and the revocations of the room are dropped instead. Room IDs are never reused,
+  // so requests with these tokens fail because the room is not found.
+  size_t remove_room(const boost::uuids::uuid &room_id);
+
+  // Drops the session of a user kicked from a room. In TOKEN mode the token is revoked until the room is removed.
+  bool remove_user(const boost::uuids::uuid &room_id, const boost::uuids::uuid &user_id);
+
+  [[nodiscard]] snapshot_t save() const;
+
+  // Takes over the secret and adds the sessions created by this node, unless the snapshot was saved in another mode.
+  // Call this before serving requests, as tokens are verified without locking.
+  void restore(const snapshot_t &snapshot);
 
 protected:
+  static constexpr size_t token_size = 40; // room_id, user_id and 8-byte MAC
+
+  std::array<uint8_t, 16> secret;
+
   mutable std::shared_mutex sessions_mutex;
-  std::map<boost::uuids::uuid, session_t> sessions;
+  // sessions in MAP mode, revoked sessions in TOKEN mode
+  std::map<std::string, session_t, std::less<>> sessions;
+  // session IDs by room ID and user ID
+  std::map<std::pair<boost::uuids::uuid, boost::uuids::uuid>, std::string> session_ids;
+  // whether sessions is not empty in TOKEN mode, so that get locks only while some token is revoked
+  std::atomic<bool> has_revoked;
+
+  // Adds a TOKEN mode session to the revoked sessions. Returns false if it was already revoked.
+  bool revoke(const session_t &session);
+
+  // These require sessions_mutex to be locked exclusively. They keep has_revoked up to date.
+  void insert(const session_t &session);
+  void erase(std::map<std::pair<boost::uuids::uuid, boost::uuids::uuid>, std::string>::iterator it);
+
+  static boost::uuids::uuid gen_id();
+
+  // Returns the ID without its node prefix.
+  // Throws redirect_error if another node created it, or unauthorized_error if it has no prefix of a node.
+  [[nodiscard]] std::string_view strip_node(std::string_view id) const;
+
+  static std::array<uint8_t, 16> gen_secret();
+
+  [[nodiscard]] std::string sign(const boost::uuids::uuid &room_id, const boost::uuids::uuid &user_id) const;
+
+  // Throws unauthorized_error if the token is malformed or its MAC does not match.
+  [[nodiscard]] session_t verify(std::string_view id) const;
 };
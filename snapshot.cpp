@@ -0,0 +1,218 @@
+#include "snapshot.hpp"
+
+#include "errors.hpp"
+#include "msgpack.hpp"
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <filesystem>
+#include <format>
+#include <functional>
+#include <memory>
+#include <utility>
+
+using namespace std;
+using namespace boost::uuids;
+
+constexpr string_view snapshot_magic = "ShoutWars snapshot";
+constexpr uint64_t snapshot_format = 1;
+// the buffer is written to the file each time it grows beyond this
+constexpr size_t snapshot_flush_size = 1 << 20;
+
+/**
+ * Convert a duration to the milliseconds saved in a snapshot, which are never negative.
+ * @param duration The duration.
+ * @return The milliseconds, or 0 if the duration is negative.
+ */
+uint64_t to_snapshot_ms(const chrono::steady_clock::duration duration) {
+  return static_cast<uint64_t>(max<int64_t>(chrono::duration_cast<chrono::milliseconds>(duration).count(), 0));
+}
+
+/**
+ * Write a room to a snapshot.
+ * @param writer The writer.
+ * @param room The snapshot of the room.
+ * @param now The time of the save, from which times are saved.
+ */
+void write_room(msgpack_writer_t &writer, const room_t::snapshot_t &room, const chrono::steady_clock::time_point now) {
+  writer.array(12).uuid(room.id).str(room.version).str(room.name).uint(room.size);
+  writer.uint(to_snapshot_ms(room.expire_time - now)).boolean(room.in_lobby);
+  writer.raw(room.info->data).uint(room.info->version).uint(room.users_version);
+  writer.array(room.users.size());
+  for (const auto &[slot, user]: room.users) {
+    writer.array(5).uint(slot).uuid(user.id).str(user.get_name()).uint(user.get_sync_cursor());
+    writer.uint(to_snapshot_ms(now - user.get_last_time()));
+  }
+  writer.uint(room.history_begin).array(room.records.size());
+  for (const shared_ptr<sync_record_t> &record: room.records) {
+    writer.array(4).uuid(record->id).uint(record->get_packed_phases());
+    writer.str(record->get_encoded_reports()).str(record->get_encoded_actions());
+  }
+}
+
+/**
+ * Read a room written by write_room.
+ * @param reader The reader.
+ * @param now The time of the load, to which times are rebased.
+ * @return The snapshot of the room.
+ */
+room_t::snapshot_t read_room(msgpack_reader_t &reader, const chrono::steady_clock::time_point now) {
+  if (reader.array() != 12) throw bad_request_error("Invalid room.");
+  room_t::snapshot_t room{};
+  room.id = reader.uuid();
+  room.version = reader.str();
+  room.name = reader.str();
+  room.size = reader.uint();
+  room.expire_time = now + chrono::milliseconds(reader.uint());
+  room.in_lobby = reader.boolean();
+  const string_view info_data = reader.skip();
+  room.info = make_shared<const room_t::info_t>(string(info_data), reader.uint());
+  room.users_version = reader.uint();
+  const size_t user_count = reader.array();
+  for (size_t i = 0; i < user_count; i++) {
+    if (reader.array() != 5) throw bad_request_error("Invalid user.");
+    const size_t slot = reader.uint();
+    const uuid id = reader.uuid();
+    const string name(reader.str());
+    const uint64_t sync_cursor = reader.uint();
+    const auto last_time = now - chrono::milliseconds(reader.uint());
+    room.users.emplace_back(slot, room_t::user_t(id, name, sync_cursor, last_time));
+  }
+  room.history_begin = reader.uint();
+  const size_t record_count = reader.array();
+  for (size_t i = 0; i < record_count; i++) {
+    if (reader.array() != 4) throw bad_request_error("Invalid round.");
+    const uuid id = reader.uuid();
+    const uint64_t phases = reader.uint();
+    const string_view reports = reader.str();
+    const string_view actions = reader.str();
+    room.records.emplace_back(make_shared<sync_record_t>(id, phases, string(reports), string(actions)));
+  }
+  return room;
+}
+
+/**
+ * Write all of the data to a file, retrying short writes.
+ * @param fd The file.
+ * @param data The data.
+ * @param path The path of the file for errors.
+ */
+void write_all(const int fd, const string_view data, const string &path) {
+  size_t offset = 0;
+  while (offset < data.size()) {
+    const ssize_t written = write(fd, data.data() + offset, data.size() - offset);
+    if (written < 0) {
+      if (errno == EINTR) continue;
+      throw runtime_error(format("Failed to write {}: {}", path, strerror(errno)));
+    }
+    offset += static_cast<size_t>(written);
+  }
+}
+
+/**
+ * Flush a directory so that a rename inside it survives a power loss.
+ * @param dir The directory, or empty for the current directory.
+ */
+void sync_directory(const filesystem::path &dir) {
+  const string dir_path = dir.empty() ? "." : dir.string();
+  const int fd = open(dir_path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (fd < 0) throw runtime_error(format("Failed to open {}: {}", dir_path, strerror(errno)));
+  const int result = fsync(fd);
+  const int error = errno;
+  close(fd);
+  if (result != 0) throw runtime_error(format("Failed to sync {}: {}", dir_path, strerror(error)));
+}
+
+size_t save_snapshot(const string &path, const room_list_t &room_list, const session_list_t &session_list) {
+  const session_list_t::snapshot_t sessions = session_list.save();
+  const auto rooms = room_list.get_all();
+  const auto now = chrono::steady_clock::now();
+
+  const string temp_path = path + ".tmp";
+  const int fd = open(temp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd < 0) throw runtime_error(format("Failed to open {}: {}", temp_path, strerror(errno)));
+  const unique_ptr<const int, function<void(const int *)>> file(&fd, [](const int *p) { close(*p); });
+  string buffer;
+  msgpack_writer_t writer(buffer);
+  writer.array(4).str(snapshot_magic).uint(snapshot_format);
+  const string_view secret(reinterpret_cast<const char *>(sessions.secret.data()), sessions.secret.size());
+  writer.array(3).uint(static_cast<uint64_t>(sessions.mode)).str(secret).array(sessions.sessions.size());
+  for (const session_t &session: sessions.sessions) {
+    writer.array(3).str(session.id).uuid(session.room_id).uuid(session.user_id);
+  }
+  writer.array(rooms.size());
+  for (const shared_ptr<room_t> &room: rooms) {
+    write_room(writer, room->save(), now);
+    if (buffer.size() >= snapshot_flush_size) {
+      write_all(fd, buffer, temp_path);
+      buffer.clear();
+    }
+  }
+  write_all(fd, buffer, temp_path);
+  // without these, a power loss after the rename may leave an empty or partial file in place of both snapshots
+  if (fsync(fd) != 0) throw runtime_error(format("Failed to sync {}: {}", temp_path, strerror(errno)));
+  // a crash while writing leaves the previous snapshot intact
+  filesystem::rename(temp_path, path);
+  sync_directory(filesystem::path(path).parent_path());
+  return rooms.size();
+}
+
+size_t load_snapshot(const string &path, room_list_t &room_list, session_list_t &session_list) {
+  const int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    if (errno == ENOENT) return 0;
+    throw runtime_error(format("Failed to open {}: {}", path, strerror(errno)));
+  }
+  struct stat file_stat{};
+  const bool has_size = fstat(fd, &file_stat) == 0 && file_stat.st_size > 0;
+  const auto size = has_size ? static_cast<size_t>(file_stat.st_size) : 0;
+  void *data = has_size ? mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+  // the mapping keeps the file open
+  close(fd);
+  if (data == MAP_FAILED) throw runtime_error(format("Failed to map {}.", path));
+  const unique_ptr<void, function<void(void *)>> mapping(data, [size](void *p) { munmap(p, size); });
+  madvise(data, size, MADV_SEQUENTIAL);
+
+  const auto now = chrono::steady_clock::now();
+  session_list_t::snapshot_t sessions{};
+  vector<room_t::snapshot_t> rooms;
+  try {
+    msgpack_reader_t reader(string_view(static_cast<const char *>(data), size));
+    if (reader.array() != 4 || reader.str() != snapshot_magic) throw bad_request_error("Not a snapshot.");
+    if (const uint64_t version = reader.uint(); version != snapshot_format) {
+      throw bad_request_error(format("Unknown snapshot format: {}.", version));
+    }
+    if (reader.array() != 3) throw bad_request_error("Invalid sessions.");
+    sessions.mode = static_cast<session_list_t::mode_t>(reader.uint());
+    const string_view secret = reader.str();
+    if (secret.size() != sessions.secret.size()) throw bad_request_error("Invalid secret.");
+    ranges::copy(secret, reinterpret_cast<char *>(sessions.secret.data()));
+    const size_t session_count = reader.array();
+    for (size_t i = 0; i < session_count; i++) {
+      if (reader.array() != 3) throw bad_request_error("Invalid session.");
+      const string id(reader.str());
+      const uuid room_id = reader.uuid();
+      const uuid user_id = reader.uuid();
+      sessions.sessions.emplace_back(id, room_id, user_id);
+    }
+    const size_t room_count = reader.array();
+    // a room takes far more than a byte, so a broken count cannot reserve much
+    rooms.reserve(min(room_count, size));
+    for (size_t i = 0; i < room_count; i++) rooms.emplace_back(read_room(reader, now));
+  } catch (const bad_request_error &err) {
+    throw runtime_error(format("Invalid snapshot {}: {}", path, err.what()));
+  }
+
+  const size_t count = room_list.restore(rooms);
+  // sessions of rooms which were not restored would never be removed
+  session_list_t::snapshot_t restored_sessions{ sessions.mode, sessions.secret, {} };
+  for (const session_t &session: sessions.sessions) {
+    if (room_list.exists(session.room_id)) restored_sessions.sessions.emplace_back(session);
+  }
+  session_list.restore(restored_sessions);
+  return count;
+}
@@ -0,0 +1,18 @@
+#pragma once
+
+#include "room_list.hpp"
+#include "session.hpp"
+
+#include <string>
+
+// Rooms and sessions are saved to a msgpack file so that games in progress survive a restart.
+// steady_clock does not outlive the process, so times are saved relative to the save and rebased on load.
+
+// Writes the rooms and sessions to a temporary file which then replaces the file at path.
+// Returns the number of rooms saved. Throws runtime_error if the file cannot be written.
+size_t save_snapshot(const std::string &path, const room_list_t &room_list, const session_list_t &session_list);
+
+// Maps the file at path into memory and restores its rooms, and the sessions of the restored rooms.
+// Returns the number of rooms restored, which is 0 if there is no file.
+// Throws runtime_error if the file cannot be read or is not a snapshot.
+size_t load_snapshot(const std::string &path, room_list_t &room_list, session_list_t &session_list);
@@ -0,0 +1,64 @@
+#include "stream.hpp"
+
+#include <mutex>
+
+using namespace std;
+using namespace boost::uuids;
+
+stream_list_t::stream_list_t() = default;
+
+optional<uint64_t> stream_list_t::open(const uuid &room_id, const uuid &user_id, const uint64_t connection_id) {
+  lock_guard lock(streams_mutex);
+  optional<uint64_t> old_connection_id;
+  if (const auto it = streams.find(user_id); it != streams.end()) {
+    old_connection_id = it->second.connection_id;
+    stream_users.erase(it->second.connection_id);
+  }
+  streams.insert_or_assign(user_id, stream_t{ room_id, user_id, connection_id });
+  stream_users.insert_or_assign(connection_id, user_id);
+  return old_connection_id;
+}
+
+optional<stream_t> stream_list_t::get(const uint64_t connection_id) const {
+  shared_lock lock(streams_mutex);
+  const auto it = stream_users.find(connection_id);
+  if (it == stream_users.end()) return nullopt;
+  return streams.at(it->second);
+}
+
+bool stream_list_t::close(const uint64_t connection_id) {
+  lock_guard lock(streams_mutex);
+  const auto it = stream_users.find(connection_id);
+  if (it == stream_users.end()) return false;
+  streams.erase(it->second);
+  stream_users.erase(it);
+  return true;
+}
+
+vector<uint64_t> stream_list_t::remove_room(const uuid &room_id) {
+  lock_guard lock(streams_mutex);
+  vector<uint64_t> connection_ids;
+  // rooms are removed rarely, and far less often than streams are looked up
+  erase_if(streams, [&](const auto &entry) {
+    if (entry.second.room_id != room_id) return false;
+    connection_ids.emplace_back(entry.second.connection_id);
+    stream_users.erase(entry.second.connection_id);
+    return true;
+  });
+  return connection_ids;
+}
+
+optional<uint64_t> stream_list_t::remove_user(const uuid &room_id, const uuid &user_id) {
+  lock_guard lock(streams_mutex);
+  const auto it = streams.find(user_id);
+  if (it == streams.end() || it->second.room_id != room_id) return nullopt;
+  const uint64_t connection_id = it->second.connection_id;
+  stream_users.erase(connection_id);
+  streams.erase(it);
+  return connection_id;
+}
+
+size_t stream_list_t::count() const {
+  shared_lock lock(streams_mutex);
+  return streams.size();
+}
@@ -0,0 +1,45 @@
+#pragma once
+
+#include <boost/uuid.hpp>
+#include <map>
+#include <optional>
+#include <shared_mutex>
+#include <vector>
+
+// WebSocket connection on which a user gets each round of its room.
+struct stream_t {
+  boost::uuids::uuid room_id, user_id;
+  uint64_t connection_id;
+};
+
+// Registry of the streams of users, so that kicks and room removal can close them.
+class stream_list_t {
+public:
+  [[nodiscard]] explicit stream_list_t();
+
+  // Binds a connection to a user. Returns the connection of the previous stream of the user, which the caller closes.
+  [[nodiscard]] std::optional<uint64_t> open(
+    const boost::uuids::uuid &room_id, const boost::uuids::uuid &user_id, uint64_t connection_id
+  );
+
+  // Returns nullopt if no user is bound to the connection yet.
+  [[nodiscard]] std::optional<stream_t> get(uint64_t connection_id) const;
+
+  // Forgets a closed connection. Returns false if it was not bound.
+  bool close(uint64_t connection_id);
+
+  // Forgets the streams of a room and returns their connections, which the caller closes.
+  [[nodiscard]] std::vector<uint64_t> remove_room(const boost::uuids::uuid &room_id);
+
+  // Forgets the stream of a user and returns its connection, which the caller closes.
+  [[nodiscard]] std::optional<uint64_t> remove_user(
+    const boost::uuids::uuid &room_id, const boost::uuids::uuid &user_id
+  );
+
+  [[nodiscard]] size_t count() const;
+
+protected:
+  mutable std::shared_mutex streams_mutex;
+  std::map<boost::uuids::uuid, stream_t> streams; // by user ID
+  std::map<uint64_t, boost::uuids::uuid> stream_users; // by connection ID
+};
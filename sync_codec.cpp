@@ -0,0 +1,160 @@
+#include "sync_codec.hpp"
+
+#include "errors.hpp"
+#include "gzip.hpp"
+#include <nlohmann/json.hpp>
+#include <utility>
+
+using namespace std;
+using namespace boost::uuids;
+
+using json = nlohmann::json;
+
+constexpr size_t sync_response_reserve = 1024;
+
+// sync request
+
+// the smallest event: a fixmap with id as 32 hex digits, an empty type and a 1-byte event
+constexpr size_t min_event_size = 1 + 3 + 33 + 5 + 1 + 6 + 1;
+
+/**
+ * Decode the events of a sync request.
+ * @param reader The reader positioned at the array of events.
+ * @return The events. Their payloads are kept as raw msgpack.
+ */
+vector<sync_request_t::event_t> parse_sync_events(msgpack_reader_t &reader) {
+  const size_t count = reader.array();
+  // the count is untrusted, so it must fit the body before anything is allocated for it
+  if (count > reader.remaining() / min_event_size) throw bad_request_error("Invalid events: too many for the body.");
+  vector<sync_request_t::event_t> events(count);
+  for (auto &event: events) {
+    optional<uuid> id;
+    optional<string_view> type, data;
+    for (size_t i = reader.map(); i > 0; i--) {
+      const string_view key = reader.str();
+      if (key == "id") id = reader.uuid();
+      else if (key == "type") type = reader.str();
+      else if (key == "event") data = reader.skip();
+      else reader.skip();
+    }
+    if (!id || !type || !data) throw bad_request_error("Invalid event: id, type and event are required.");
+    event = { *id, *type, *data };
+  }
+  return events;
+}
+
+/**
+ * Decode a sync request.
+ * @param body The msgpack request body.
+ * @return The sync request.
+ */
+sync_request_t parse_sync_request(const string_view body) {
+  msgpack_reader_t reader(body);
+  optional<string_view> session_id;
+  optional<vector<sync_request_t::event_t>> reports, actions;
+  optional<string_view> room_info;
+  uint64_t users_version = 0, info_version = 0;
+  for (size_t i = reader.map(); i > 0; i--) {
+    const string_view key = reader.str();
+    if (key == "session_id") session_id = reader.str();
+    else if (key == "room_info") room_info = reader.skip();
+    else if (key == "users_version") users_version = reader.uint();
+    else if (key == "info_version") info_version = reader.uint();
+    else if (key == "reports") reports = parse_sync_events(reader);
+    else if (key == "actions") actions = parse_sync_events(reader);
+    else reader.skip();
+  }
+  if (!session_id) throw bad_request_error("session_id is required.");
+  if (!reports || !actions) throw bad_request_error("reports and actions are required.");
+  return { *session_id, room_info, move(*reports), move(*actions), users_version, info_version };
+}
+
+/**
+ * Update the room info if the user is the owner of the room.
+ * @param room The room.
+ * @param user_id The ID of the user who sent the sync request.
+ * @param room_info The raw msgpack room info in the request, or nullopt to keep the current one.
+ */
+void update_room_info(room_t &room, const uuid &user_id, const optional<string_view> &room_info) {
+  if (!room_info || user_id != room.get_owner().id) return;
+  // parse_sync_request has already checked that it is well-formed
+  room.update_info(string(*room_info));
+}
+
+// sync response
+
+/**
+ * Generate the msgpack response of a sync for a user.
+ * @param room The room.
+ * @param user_id The ID of the user who receives the response.
+ * @param result The records delivered to the user, of which the last one is the current record.
+ * @param users_version The version of the room users the user has.
+ * @param info_version The version of the room info the user has.
+ * @return The msgpack response.
+ */
+string gen_sync_response(
+  const room_t &room, const uuid &user_id, const room_t::sync_result_t &result, const uint64_t users_version,
+  const uint64_t info_version
+) {
+  const auto &records = result.records;
+  // the users are read after their version, so they are never older than the version sent with them
+  const uint64_t current_users_version = room.get_users_version();
+  const auto info = room.get_info();
+  const bool users_changed = current_users_version != users_version;
+  const bool info_changed = info->version != info_version;
+  string buffer;
+  size_t encoded_size = 0;
+  for (const auto &record: records) encoded_size += record->get_encoded_size();
+  buffer.reserve(sync_response_reserve + encoded_size + (info_changed ? info->data.size() : 0));
+  msgpack_writer_t writer(buffer);
+  const uuid sync_id = records.back()->id;
+  writer.map(6 + users_changed + info_changed).str("id").uuid(sync_id).str("resync").boolean(result.resync);
+
+  writer.str("reports");
+  const size_t reports_pos = writer.open_array();
+  size_t report_count = 0;
+  for (const auto &record: records) {
+    report_count += record->write_reports(writer, user_id, record->id != sync_id ? record->id : nil_uuid());
+  }
+  writer.close_array(reports_pos, report_count);
+
+  writer.str("users_version").uint(current_users_version);
+  if (users_changed) {
+    writer.str("room_users");
+    const size_t users_pos = writer.open_array();
+    size_t user_count = 0;
+    room.for_each_user(
+      [&](const room_t::user_t &user) {
+        to_msgpack(writer, user);
+        user_count++;
+      }
+    );
+    writer.close_array(users_pos, user_count);
+  }
+  writer.str("info_version").uint(info->version);
+  if (info_changed) writer.str("room_info").raw(info->data);
+
+  // written last so that gzip_sync_response can splice the actions of the current round
+  writer.str("actions");
+  const size_t actions_pos = writer.open_array();
+  size_t action_count = 0;
+  for (const auto &record: records) {
+    action_count += record->write_actions(writer, record->id != sync_id ? record->id : nil_uuid());
+  }
+  writer.close_array(actions_pos, action_count);
+  return buffer;
+}
+
+/**
+ * Compress a sync response with gzip.
+ * @param response The msgpack response generated by gen_sync_response.
+ * @param result The result the response was generated from.
+ * @return The gzip response.
+ */
+string gzip_sync_response(const string_view response, const room_t::sync_result_t &result) {
+  const gzip_block_t &actions = result.records.back()->get_compressed_actions();
+  gzip_writer_t writer;
+  writer.write(response.substr(0, response.size() - actions.size));
+  writer.splice(actions);
+  return writer.finish();
+}
@@ -0,0 +1,39 @@
+#pragma once
+
+#include "room.hpp"
+#include "sync_record.hpp"
+#include "msgpack.hpp"
+
+#include <boost/uuid.hpp>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <memory>
+
+// A sync request decoded without building a DOM. String views point into the request body.
+struct sync_request_t {
+  using event_t = sync_record_t::new_event_t;
+
+  std::string_view session_id;
+  std::optional<std::string_view> room_info;
+  std::vector<event_t> reports, actions;
+  // the versions of the room state the client already has, 0 if none
+  uint64_t users_version, info_version;
+};
+
+[[nodiscard]] sync_request_t parse_sync_request(std::string_view body);
+
+void update_room_info(
+  room_t &room, const boost::uuids::uuid &user_id, const std::optional<std::string_view> &room_info
+);
+
+// room_users and room_info are written only if they are newer than the versions the client has.
+[[nodiscard]] std::string gen_sync_response(
+  const room_t &room, const boost::uuids::uuid &user_id, const room_t::sync_result_t &result,
+  uint64_t users_version = 0, uint64_t info_version = 0
+);
+
+// Compresses a response generated by gen_sync_response from the result.
+// The actions of the current round end the response and are spliced in as compressed once for every recipient.
+[[nodiscard]] std::string gzip_sync_response(std::string_view response, const room_t::sync_result_t &result);
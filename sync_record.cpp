@@ -1,6 +1,9 @@
 #include "sync_record.hpp"
 
 #include "errors.hpp"
+#include <algorithm>
+#include <bit>
+#include <format>
 #include <ranges>
 #include <utility>
 
@@ -16,67 +19,283 @@ uuid sync_record_t::gen_id() {
 
 // room sync
 
-sync_record_t::sync_record_t() : id(gen_id()) {}
+sync_record_t::sync_record_t() : id(gen_id()), phases(0), sealed(false) {}
+
+sync_record_t::sync_record_t(
+  const uuid id, const uint64_t packed_phases, string encoded_reports, string encoded_actions
+) : id(id), phases(packed_phases), sealed(false) {
+  reports.load(move(encoded_reports));
+  actions.load(move(encoded_actions));
+  sealed.store(true, memory_order_release);
+}
+
+size_t sync_record_t::measure_events(const span<const new_event_t> new_events) {
+  size_t size = 0;
+  for (const new_event_t &event: new_events) {
+    size += event_buffer_t::encoded_size_fixed + msgpack_writer_t::str_size(event.type.size()) + event.data.size();
+  }
+  return size;
+}
 
 void sync_record_t::add_events(
-  const uuid from, const vector<shared_ptr<event_t>> &new_reports, const vector<shared_ptr<event_t>> &new_actions
+  const uuid from, const size_t slot, const span<const new_event_t> new_reports,
+  const span<const new_event_t> new_actions
 ) {
   lock_guard lock(record_mutex);
-  if (users_phase[from] > phase_t::CREATED) throw bad_request_error("Record already synced.");
-  for (const shared_ptr<event_t> &report: new_reports) {
-    if (report->from != from) throw bad_request_error("Invalid report from.");
-    reports[report->id] = report;
-  }
-  for (const shared_ptr<event_t> &action: new_actions) {
-    if (action->from != from) throw bad_request_error("Invalid action from.");
-    actions[action->id] = action;
-  }
-  users_phase[from] = phase_t::WAITING;
+  if (sealed.load(memory_order_relaxed)) throw bad_request_error("Record already sealed.");
+  if (!advance_phase(slot, phase_t::WAITING)) throw bad_request_error("Record already synced.");
+  reports.append(from, new_reports);
+  actions.append(from, new_actions);
 }
 
-vector<shared_ptr<sync_record_t::event_t>> sync_record_t::get_reports() const {
-  shared_lock lock(record_mutex);
-  const auto view = reports | views::transform(
-                      [](const pair<uuid, shared_ptr<event_t>> &report) { return report.second; }
-                    );
-  return move(vector(view.begin(), view.end()));
+span<const sync_record_t::event_t> sync_record_t::get_reports() const {
+  if (!sealed.load(memory_order_acquire)) return {};
+  return reports.events;
 }
 
-vector<shared_ptr<sync_record_t::event_t>> sync_record_t::get_actions() const {
-  shared_lock lock(record_mutex);
-  const auto view = actions | views::transform(
-                      [](const pair<uuid, shared_ptr<event_t>> &action) { return action.second; }
-                    );
-  return move(vector(view.begin(), view.end()));
+span<const sync_record_t::event_t> sync_record_t::get_actions() const {
+  if (!sealed.load(memory_order_acquire)) return {};
+  return actions.events;
 }
 
-sync_record_t::phase_t sync_record_t::get_phase(const uuid user_id) {
+void sync_record_t::seal() {
   lock_guard lock(record_mutex);
-  return users_phase[user_id];
+  if (sealed.load(memory_order_relaxed)) return;
+  reports.seal();
+  actions.seal();
+  sealed.store(true, memory_order_release);
+}
+
+size_t sync_record_t::write_reports(msgpack_writer_t &writer, const uuid except_from, const uuid sync_id) const {
+  if (!sealed.load(memory_order_acquire)) return 0;
+  return reports.write(writer, except_from, sync_id);
+}
+
+size_t sync_record_t::write_actions(msgpack_writer_t &writer, const uuid sync_id) const {
+  if (!sealed.load(memory_order_acquire)) return 0;
+  return actions.write(writer, nil_uuid(), sync_id);
+}
+
+const gzip_block_t &sync_record_t::get_compressed_actions() const {
+  call_once(compress_flag, [this] { compressed_actions = gzip_block_t::compress(actions.buffer); });
+  return compressed_actions;
+}
+
+size_t sync_record_t::get_encoded_size() const {
+  if (!sealed.load(memory_order_acquire)) return 0;
+  return reports.buffer.size() + actions.buffer.size();
 }
 
-bool sync_record_t::advance_phase(const uuid user_id, const phase_t new_phase) {
+string_view sync_record_t::get_encoded_reports() const {
+  if (!sealed.load(memory_order_acquire)) return {};
+  return reports.buffer;
+}
+
+string_view sync_record_t::get_encoded_actions() const {
+  if (!sealed.load(memory_order_acquire)) return {};
+  return actions.buffer;
+}
+
+size_t sync_record_t::get_buffered_size() const {
   lock_guard lock(record_mutex);
-  if (new_phase <= users_phase[user_id]) return false;
-  users_phase[user_id] = new_phase;
+  return reports.arena.size() + reports.buffer.size() + actions.arena.size() + actions.buffer.size();
+}
+
+size_t sync_record_t::count_events() const {
+  if (!sealed.load(memory_order_acquire)) return 0;
+  return reports.events.size() + actions.events.size();
+}
+
+sync_record_t::phase_t sync_record_t::get_phase(const size_t slot) const {
+  return unpack_phase(phases.load(memory_order_acquire), slot);
+}
+
+bool sync_record_t::advance_phase(const size_t slot, const phase_t new_phase) {
+  uint64_t current = phases.load(memory_order_relaxed);
+  do {
+    if (new_phase <= unpack_phase(current, slot)) return false;
+  } while (!phases.compare_exchange_weak(
+    current, (current & ~(uint64_t{ 3 } << (slot * 2))) | static_cast<uint64_t>(new_phase) << (slot * 2),
+    memory_order_acq_rel
+  ));
+  return true;
+}
+
+void sync_record_t::reset_phase(const size_t slot) {
+  phases.fetch_and(~(uint64_t{ 3 } << (slot * 2)), memory_order_acq_rel);
+}
+
+bool sync_record_t::all_reached(const uint32_t slot_mask, const phase_t phase) const {
+  const uint64_t current = phases.load(memory_order_acquire);
+  for (uint32_t mask = slot_mask; mask != 0; mask &= mask - 1) {
+    if (unpack_phase(current, countr_zero(mask)) < phase) return false;
+  }
   return true;
 }
 
 sync_record_t::phase_t sync_record_t::get_max_phase() const {
-  shared_lock lock(record_mutex);
-  return ranges::max(users_phase | views::values);
+  const uint64_t current = phases.load(memory_order_acquire);
+  // the high bit of any slot means SYNCING or later
+  constexpr uint64_t low_bits = 0x5555'5555'5555'5555;
+  if (const uint64_t high = current >> 1 & low_bits; high != 0) {
+    return (current & high) != 0 ? phase_t::SYNCED : phase_t::SYNCING;
+  }
+  return (current & low_bits) != 0 ? phase_t::WAITING : phase_t::CREATED;
 }
 
-// room sync event
+uint64_t sync_record_t::get_packed_phases() const {
+  return phases.load(memory_order_acquire);
+}
 
-sync_record_t::event_t::event_t(const uuid id, const uuid from, string type, json data)
-  : id(id), from(from), type(move(type)), data(move(data)) {}
+sync_record_t::phase_t sync_record_t::unpack_phase(const uint64_t packed, const size_t slot) {
+  return static_cast<phase_t>(packed >> (slot * 2) & 3);
+}
+
+// room sync event
 
 void to_json(json &j, const sync_record_t::event_t &event) {
   j = {
     { "id", to_string(event.id) },
     { "from", to_string(event.from) },
     { "type", event.type },
-    { "event", event.data }
+    { "event", json::from_msgpack(event.data) }
+  };
+}
+
+void to_msgpack(msgpack_writer_t &writer, const sync_record_t::event_t &event, const uuid &sync_id) {
+  writer.map(sync_id.is_nil() ? 4 : 5);
+  if (!sync_id.is_nil()) writer.str("sync_id").uuid(sync_id);
+  writer.raw(event.encoded);
+}
+
+// event buffer
+
+void sync_record_t::event_buffer_t::append(const uuid &from, const span<const new_event_t> new_events) {
+  // reserve for the whole batch, as each user appends once
+  const size_t batch_size = measure_events(new_events);
+  if (arena.size() + batch_size > arena.capacity()) arena.reserve(max(arena.size() + batch_size, arena.capacity() * 2));
+  entries.reserve(entries.size() + new_events.size());
+
+  msgpack_writer_t writer(arena);
+  for (const new_event_t &event: new_events) {
+    entry_t &entry = entries.emplace_back(event.id, from);
+    entry.begin = arena.size();
+    writer.map(4).str("id").uuid(event.id).str("from").uuid(from).str("type").str(event.type);
+    entry.type_pos = arena.size() - event.type.size();
+    entry.type_size = event.type.size();
+    writer.str("event");
+    entry.data_pos = arena.size();
+    writer.raw(event.data);
+    entry.end = arena.size();
+  }
+  run_ends.emplace_back(entries.size());
+}
+
+void sync_record_t::event_buffer_t::seal() {
+  // IDs are UUIDv7, so each run is usually sorted already
+  size_t run_begin = 0;
+  for (const size_t run_end: run_ends) {
+    const auto run = ranges::subrange(entries.begin() + run_begin, entries.begin() + run_end);
+    if (!ranges::is_sorted(run, {}, &entry_t::id)) ranges::stable_sort(run, {}, &entry_t::id);
+    run_begin = run_end;
+  }
+
+  // k-way merge of the runs; among entries with the same ID the last added one wins
+  vector<pair<size_t, size_t>> cursors; // position and end of each run
+  run_begin = 0;
+  for (const size_t run_end: run_ends) {
+    if (run_begin < run_end) cursors.emplace_back(run_begin, run_end);
+    run_begin = run_end;
+  }
+  const auto is_after = [&](const pair<size_t, size_t> &a, const pair<size_t, size_t> &b) {
+    const uuid &a_id = entries[a.first].id, &b_id = entries[b.first].id;
+    return a_id != b_id ? b_id < a_id : a.first < b.first;
   };
+  ranges::make_heap(cursors, is_after);
+  buffer.reserve(arena.size());
+  events.reserve(entries.size());
+  size_t kept_pos = 0; // the entry of the last event
+  while (!cursors.empty()) {
+    ranges::pop_heap(cursors, is_after);
+    auto &[pos, run_end] = cursors.back();
+    const entry_t &entry = entries[pos];
+    // a run yields its own duplicates in the order they were added, so a later one replaces the event kept
+    if (!events.empty() && events.back().id == entry.id && kept_pos < pos) {
+      buffer.resize(events.back().encoded.data() - buffer.data() - 1);
+      events.pop_back();
+    }
+    if (events.empty() || events.back().id != entry.id) {
+      // the buffer never grows beyond the arena, so views into it stay valid
+      kept_pos = pos;
+      const size_t begin = buffer.size();
+      buffer.append(arena, entry.begin, entry.end - entry.begin);
+      const string_view encoded = string_view(buffer).substr(begin + 1);
+      events.emplace_back(
+        entry.id,
+        entry.from,
+        encoded.substr(entry.type_pos - entry.begin - 1, entry.type_size),
+        encoded.substr(entry.data_pos - entry.begin - 1),
+        encoded
+      );
+    }
+    if (++pos < run_end) ranges::push_heap(cursors, is_after);
+    else cursors.pop_back();
+  }
+
+  arena = string();
+  entries = vector<entry_t>();
+  run_ends = vector<size_t>();
+}
+
+void sync_record_t::event_buffer_t::load(string encoded) {
+  buffer = move(encoded);
+  msgpack_reader_t reader(buffer);
+  const auto expect_key = [&](const string_view key) {
+    if (reader.str() != key) throw bad_request_error(format("Invalid event key. Expected {}.", key));
+  };
+  // the reader views the buffer, so the views of events point into it
+  const char *begin = buffer.data();
+  while (!reader.empty()) {
+    // events start with a fixmap header, which encoded leaves out
+    if (reader.map() != 4 || static_cast<uint8_t>(*begin) != 0x84) throw bad_request_error("Invalid event header.");
+    expect_key("id");
+    const uuid event_id = reader.uuid();
+    expect_key("from");
+    const uuid from = reader.uuid();
+    expect_key("type");
+    const string_view type = reader.str();
+    expect_key("event");
+    const string_view data = reader.skip();
+    const char *end = data.data() + data.size();
+    events.emplace_back(event_id, from, type, data, string_view(begin + 1, end));
+    begin = end;
+  }
+}
+
+size_t sync_record_t::event_buffer_t::write(
+  msgpack_writer_t &writer, const uuid &except_from, const uuid &sync_id
+) const {
+  if (!sync_id.is_nil()) {
+    size_t count = 0;
+    for (const event_t &event: events) {
+      if (event.from == except_from) continue;
+      to_msgpack(writer, event, sync_id);
+      count++;
+    }
+    return count;
+  }
+  // splice runs of events not sent by except_from
+  size_t count = 0, run_begin = 0, begin = 0;
+  for (const event_t &event: events) {
+    const size_t end = begin + 1 + event.encoded.size();
+    if (event.from == except_from) {
+      writer.raw(string_view(buffer).substr(run_begin, begin - run_begin));
+      run_begin = end;
+    } else {
+      count++;
+    }
+    begin = end;
+  }
+  writer.raw(string_view(buffer).substr(run_begin, begin - run_begin));
+  return count;
 }
@@ -1,55 +1,159 @@
 #pragma once
 
+#include "msgpack.hpp"
+#include "gzip.hpp"
 #include <nlohmann/json.hpp>
 #include <boost/uuid.hpp>
-#include <shared_mutex>
-#include <map>
+#include <atomic>
+#include <mutex>
 #include <string>
 #include <vector>
-#include <memory>
+#include <span>
+#include <string_view>
 
 class sync_record_t {
 public:
-  class event_t {
-  public:
-    const boost::uuids::uuid id;
-    const boost::uuids::uuid from;
-    const std::string type;
-    const nlohmann::json data;
+  // An event as sent in a sync request. The views only need to live until add_events returns.
+  struct new_event_t {
+    boost::uuids::uuid id;
+    std::string_view type;
+    std::string_view data;
+  };
 
-    [[nodiscard]] explicit event_t(
-      boost::uuids::uuid id, boost::uuids::uuid from, std::string type, nlohmann::json data
-    );
+  // A sealed event. The views point into the record, which never changes once it is sealed.
+  struct event_t {
+    boost::uuids::uuid id;
+    boost::uuids::uuid from;
+    std::string_view type;
+    // raw msgpack payload, which is never decoded by the server
+    std::string_view data;
+    // id, from, type and event entries of the response map
+    std::string_view encoded;
 
     friend void to_json(nlohmann::json &j, const event_t &event);
+
+    // sync_id is written only if it is not nil.
+    friend void to_msgpack(msgpack_writer_t &writer, const event_t &event, const boost::uuids::uuid &sync_id);
   };
 
   enum class phase_t { CREATED = 0, WAITING = 1, SYNCING = 2, SYNCED = 3 };
 
+  // Users are identified by their slot in the room. The phases of all slots are packed in one atomic word.
+  static constexpr size_t slot_count = 32;
+
   const boost::uuids::uuid id;
 
   [[nodiscard]] explicit sync_record_t();
 
+  // Restores a sealed record from its phases and the buffers of get_encoded_reports and get_encoded_actions.
+  // Throws bad_request_error if a buffer is not a run of encoded events.
+  [[nodiscard]] explicit sync_record_t(
+    boost::uuids::uuid id, uint64_t packed_phases, std::string encoded_reports, std::string encoded_actions
+  );
+
+  // Returns the exact bytes that add_events buffers for the events.
+  [[nodiscard]] static size_t measure_events(std::span<const new_event_t> new_events);
+
+  // Encodes the events of a user into the record and moves its slot to WAITING. Each user can add events once.
   void add_events(
-    boost::uuids::uuid from, const std::vector<std::shared_ptr<event_t>> &new_reports,
-    const std::vector<std::shared_ptr<event_t>> &new_actions
+    boost::uuids::uuid from, size_t slot, std::span<const new_event_t> new_reports,
+    std::span<const new_event_t> new_actions
   );
 
-  [[nodiscard]] std::vector<std::shared_ptr<event_t>> get_reports() const;
+  // Returns the events ordered by ID once the record is sealed, or nothing before.
+  [[nodiscard]] std::span<const event_t> get_reports() const;
+
+  [[nodiscard]] std::span<const event_t> get_actions() const;
+
+  // Merges the events of all users by ID, dropping duplicate IDs. Call this once no more events can be added.
+  void seal();
+
+  // Writes the sealed events except those from the user and returns the number of events written.
+  // Events are spliced from the shared buffers unless sync_id is not nil.
+  size_t write_reports(msgpack_writer_t &writer, boost::uuids::uuid except_from, boost::uuids::uuid sync_id) const;
+
+  size_t write_actions(msgpack_writer_t &writer, boost::uuids::uuid sync_id) const;
+
+  // Returns the actions as written by write_actions without sync_id, compressed once for all recipients.
+  // The record must be sealed.
+  [[nodiscard]] const gzip_block_t &get_compressed_actions() const;
+
+  [[nodiscard]] size_t get_encoded_size() const;
+
+  // Returns the sealed events encoded back to back, or nothing before the record is sealed.
+  [[nodiscard]] std::string_view get_encoded_reports() const;
+
+  [[nodiscard]] std::string_view get_encoded_actions() const;
 
-  [[nodiscard]] std::vector<std::shared_ptr<event_t>> get_actions() const;
+  // Returns the bytes of events held by the record, which shrink once duplicates are dropped by seal.
+  [[nodiscard]] size_t get_buffered_size() const;
 
-  [[nodiscard]] phase_t get_phase(boost::uuids::uuid user_id);
+  [[nodiscard]] size_t count_events() const;
 
-  bool advance_phase(boost::uuids::uuid user_id, phase_t new_phase);
+  [[nodiscard]] phase_t get_phase(size_t slot) const;
+
+  // Returns false if the slot has already reached the phase.
+  bool advance_phase(size_t slot, phase_t new_phase);
+
+  // Moves a slot back to CREATED when a new user takes it over.
+  void reset_phase(size_t slot);
+
+  // Returns whether every slot in the mask has reached the phase.
+  [[nodiscard]] bool all_reached(uint32_t slot_mask, phase_t phase) const;
 
   [[nodiscard]] phase_t get_max_phase() const;
 
+  // Returns the phases of all slots, 2 bits per slot.
+  [[nodiscard]] uint64_t get_packed_phases() const;
+
 protected:
+  // Events of one kind. Each user appends a run of events to a shared arena before the record is sealed,
+  // and sealing merges the runs into a buffer of encoded events in ID order.
+  struct event_buffer_t {
+    // an event in the arena by offsets, as the arena may move while it grows
+    struct entry_t {
+      boost::uuids::uuid id;
+      boost::uuids::uuid from;
+      size_t begin, type_pos, type_size, data_pos, end;
+    };
+
+    // fixmap header, keys and UUIDs of an event
+    static constexpr size_t encoded_size_fixed = 1 + 3 + 5 + 5 + 6 + msgpack_writer_t::uuid_size * 2;
+
+    // encoded events with map headers, in the order they were added
+    std::string arena;
+    std::vector<entry_t> entries;
+    // end of each run in entries
+    std::vector<size_t> run_ends;
+
+    // arena with the entries of events in the order of events
+    std::string buffer;
+    std::vector<event_t> events;
+
+    void append(const boost::uuids::uuid &from, std::span<const new_event_t> new_events);
+
+    void seal();
+
+    // Takes sealed events encoded back to back and rebuilds their views.
+    void load(std::string encoded);
+
+    // Writes the events except those from the user and returns the number of events written.
+    size_t write(
+      msgpack_writer_t &writer, const boost::uuids::uuid &except_from, const boost::uuids::uuid &sync_id
+    ) const;
+  };
+
   static boost::uuids::uuid gen_id();
 
-  mutable std::shared_mutex record_mutex;
-  std::map<boost::uuids::uuid, std::shared_ptr<event_t>> reports;
-  std::map<boost::uuids::uuid, std::shared_ptr<event_t>> actions;
-  std::map<boost::uuids::uuid, phase_t> users_phase;
+  [[nodiscard]] static phase_t unpack_phase(uint64_t packed, size_t slot);
+
+  mutable std::mutex record_mutex;
+  // 2 bits per slot
+  std::atomic<uint64_t> phases;
+  // set once the buffers are sealed, after which they are read without locking
+  std::atomic<bool> sealed;
+  event_buffer_t reports;
+  event_buffer_t actions;
+  mutable std::once_flag compress_flag;
+  mutable gzip_block_t compressed_actions;
 };
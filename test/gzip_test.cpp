@@ -0,0 +1,160 @@
+// Tests of the gzip streams into which blocks compressed once are spliced, and of the sync responses built on them.
+
+#include "test.hpp"
+#include "../gzip.hpp"
+#include "../room.hpp"
+#include "../sync_codec.hpp"
+#include "../sync_record.hpp"
+#include "../event_budget.hpp"
+#include "../timer_queue.hpp"
+
+#include <nlohmann/json.hpp>
+#include <boost/uuid.hpp>
+#include <zlib.h>
+#include <chrono>
+#include <exception>
+#include <format>
+#include <future>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+using namespace std;
+using namespace boost::uuids;
+
+using json = nlohmann::json;
+using new_event_t = sync_record_t::new_event_t;
+
+/**
+ * Decompress a gzip stream as a client would.
+ * @param gzip The gzip stream.
+ * @return The decompressed data.
+ */
+string gunzip(const string_view gzip) {
+  z_stream stream{};
+  expect(inflateInit2(&stream, 16 + MAX_WBITS) == Z_OK, "inflate initialized");
+  stream.next_in = reinterpret_cast<Bytef *>(const_cast<char *>(gzip.data()));
+  stream.avail_in = static_cast<uInt>(gzip.size());
+  string data;
+  int status = Z_OK;
+  while (status == Z_OK) {
+    char chunk[4096];
+    stream.next_out = reinterpret_cast<Bytef *>(chunk);
+    stream.avail_out = sizeof chunk;
+    status = inflate(&stream, Z_NO_FLUSH);
+    data.append(chunk, sizeof chunk - stream.avail_out);
+  }
+  const size_t left = stream.avail_in;
+  inflateEnd(&stream);
+  // inflate checks the CRC-32 and the size of the trailer before it reports the end of the stream
+  expect(status == Z_STREAM_END && left == 0, "a whole gzip stream with a valid trailer");
+  return data;
+}
+
+/**
+ * Encode an event payload as a client would send it.
+ * @param value The payload.
+ * @return The raw msgpack payload, kept alive for the views of the events.
+ */
+string_view payload(const json &value) {
+  static vector<unique_ptr<string>> payloads;
+  string &msgpack = *payloads.emplace_back(make_unique<string>());
+  json::to_msgpack(value, msgpack);
+  return msgpack;
+}
+
+/**
+ * Make events with payloads that compress well, as the same kind of events repeat in a game.
+ * @param count The number of events.
+ * @param type The type of the events, which the events view.
+ * @return The events.
+ */
+vector<new_event_t> gen_events(const size_t count, const string_view type) {
+  thread_local time_generator_v7 gen;
+  vector<new_event_t> events;
+  for (size_t i = 0; i < count; i++) {
+    events.emplace_back(gen(), type, payload({ { "x", i % 7 }, { "y", i % 5 }, { "type", string(type) } }));
+  }
+  return events;
+}
+
+/**
+ * Start a sync and wait for the round to close.
+ * @param room The room.
+ * @param user_id The ID of the user.
+ * @param actions The actions of the user.
+ * @return The result.
+ */
+room_t::sync_result_t sync(room_t &room, const uuid &user_id, const vector<new_event_t> &actions) {
+  auto promise = make_shared<std::promise<room_t::sync_result_t>>();
+  auto synced = promise->get_future();
+  room.sync(
+    user_id, {}, actions,
+    [promise](const exception_ptr error, room_t::sync_result_t result) {
+      if (error) {
+        promise->set_exception(error);
+      } else {
+        promise->set_value(move(result));
+      }
+    },
+    chrono::milliseconds{ 10 }, chrono::milliseconds{ 10 }, chrono::milliseconds{ 10 }
+  );
+  return synced.get();
+}
+
+// cases
+
+void test_splice_block() {
+  const string head = "head " + string(100000, 'a'), body(200000, 'a');
+  gzip_writer_t writer;
+  writer.write(head);
+  // the block repeats the data before it, which it must not refer back to
+  writer.splice(gzip_block_t::compress(body));
+  expect(gunzip(writer.finish()) == head + body, "the written data followed by the block");
+
+  gzip_writer_t empty_writer;
+  empty_writer.write("data");
+  empty_writer.splice(gzip_block_t::compress(""));
+  expect(gunzip(empty_writer.finish()) == "data", "an empty block");
+
+  gzip_writer_t block_writer;
+  block_writer.splice(gzip_block_t::compress("block", Z_BEST_SPEED));
+  expect(gunzip(block_writer.finish()) == "block", "a block alone, compressed at another level");
+}
+
+void test_gzip_sync_response() {
+  event_budget_t event_budget(SIZE_MAX, SIZE_MAX);
+  timer_queue_t timer_queue;
+  const room_t::user_t owner("owner"), player("player");
+  const auto room = make_shared<room_t>(
+    "1", owner, "room", 2, chrono::minutes{ 1 }, chrono::minutes{ 1 }, 8, timer_queue, event_budget
+  );
+  room->join(room->version, player);
+
+  // the player syncs alone, so that the owner receives two rounds on the next sync
+  (void) sync(*room, player.id, gen_events(50, "move"));
+  for (const size_t action_count: { 0, 1, 500 }) {
+    const vector<new_event_t> player_actions = gen_events(action_count, "shot");
+    thread player_sync([&] { (void) sync(*room, player.id, player_actions); });
+    const room_t::sync_result_t result = sync(*room, owner.id, gen_events(action_count, "move"));
+    player_sync.join();
+
+    const string response = gen_sync_response(*room, owner.id, result);
+    const string gzip = gzip_sync_response(response, result);
+    expect(gunzip(gzip) == response, format("decompressed response with {} actions per user", action_count));
+    if (action_count == 500) expect(gzip.size() < response.size() / 2, "repeated events compress");
+  }
+}
+
+// entry point
+
+int main() {
+  return run_tests(
+    {
+      { "splice_block", test_splice_block },
+      { "gzip_sync_response", test_gzip_sync_response },
+    }
+  );
+}
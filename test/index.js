@@ -2,29 +2,66 @@ const { uuidv7 } = require("uuidv7");
 const { encode, decode } = require("@msgpack/msgpack");
 
 const api = process.env.API;
+// another node of the cluster, optional, through which Carol joins and opens her WebSocket to be redirected
+const peerApi = process.env.PEER_API ?? api;
 const password = process.env.PASSWORD;
 const lag = 75;
 
 const responses = [];
+// PORT redirects POST /room/sync to ASYNC_PORT, and other nodes redirect to the owner of the room,
+// so the URL a request is redirected to is used from then on
+const redirects = new Map();
 
-async function send(method, path, data) {
-  const request = {
+async function send(method, path, data, base = api) {
+  // fetch cannot send the body again to follow a redirect, so it is encoded for each request
+  const request = () => ({
     method,
     headers: { "Content-Type": "application/msgpack", Authorization: password ? "Bearer " + password : undefined },
     body: data === undefined ? undefined : encode(data),
-  };
+    redirect: "manual",
+  });
   const startTime = performance.now();
-  const response = await fetch(api + path, request);
+  let response = await fetch(redirects.get(base + path) ?? base + path, request());
+  if (response.status === 307) {
+    redirects.set(base + path, response.headers.get("Location"));
+    console.log(`${method} ${path}`, "307", redirects.get(base + path));
+    response = await fetch(redirects.get(base + path), request());
+  }
   const ping = performance.now() - startTime;
+  // fetch decompresses gzip responses, which only the header tells apart
+  const encoding = response.headers.get("Content-Encoding");
   responses.push(decode(await response.arrayBuffer()));
-  console.log(`[${ping.toFixed(2).padStart(6, "0")} ms]`, `${method} ${path}`, data, responses.at(-1));
+  console.log(
+    `[${ping.toFixed(2).padStart(6, "0")} ms]`,
+    `${method} ${path}${encoding ? ` (${encoding})` : ""}`,
+    data,
+    responses.at(-1),
+  );
 }
 
 const wait = (ms) => new Promise((resolve) => setTimeout(resolve, ms));
 
+// Opens a WebSocket and returns a function which sends a message and waits for the reply.
+async function connect(url) {
+  const ws = new WebSocket(url);
+  ws.binaryType = "arraybuffer";
+  await new Promise((resolve, reject) => {
+    ws.onopen = resolve;
+    ws.onerror = () => reject(new Error(`Failed to connect to ${url}`));
+  });
+  const request = (data) =>
+    new Promise((resolve, reject) => {
+      ws.onmessage = (event) => resolve(decode(event.data));
+      ws.onclose = (event) => reject(new Error(`Closed with ${event.code}: ${event.reason}`));
+      ws.send(encode(data));
+    });
+  return { request, close: () => ws.close() };
+}
+
 let roomName = "";
 let alice = "";
 let bob = "";
+let carol = "";
 
 (async () => {
   for (let i = 0; i < 40; i++) {
@@ -42,9 +79,11 @@ let bob = "";
   for (let i = 0; i < 20; i++) {
     const reports = [];
     const actions = [];
+    // every 5th round is larger than GZIP_THRESHOLD, so that its responses are compressed
+    const event = i % 5 === 4 ? `${i}.`.padEnd(2000, "x") : `${i}.`;
     for (let j = 0; j < 2; j++) {
-      reports.push({ id: uuidv7(), type: "hoge", event: `${i}.${j}` });
-      actions.push({ id: uuidv7(), type: "hoge", event: `${i}.${j}` });
+      reports.push({ id: uuidv7(), type: "hoge", event: `${event}${j}` });
+      actions.push({ id: uuidv7(), type: "hoge", event: `${event}${j}` });
       await wait(50 + Math.random() * lag);
     }
     await send("POST", "/room/sync", { session_id: session, room_info: i, reports, actions });
@@ -69,3 +108,31 @@ let bob = "";
     await send("POST", "/room/sync", { session_id: session, room_info: i, reports, actions });
   }
 })().catch(console.error);
+
+(async () => {
+  while (!roomName) await wait(50);
+  await wait(2000);
+  await send("POST", "/room/join", { version: "0.1", name: roomName, user: { name: "Carol" } }, peerApi);
+  const session = responses.at(-1).session_id;
+  carol = responses.at(-1).user_id;
+  // GET /room/ws is served on ASYNC_PORT, whose URL PORT tells by redirecting POST /room/sync
+  const probe = await fetch(peerApi + "/room/sync", { method: "POST", redirect: "manual" });
+  let ws = await connect(probe.headers.get("Location").replace(/^http/, "ws").replace(/\/sync$/, "/ws"));
+  for (let i = 0; i < 20; i++) {
+    const reports = [{ id: uuidv7(), type: "piyo", event: `${i}` }];
+    const actions = [{ id: uuidv7(), type: "piyo", event: `${i}` }];
+    await wait(50 + Math.random() * lag);
+    const data = { session_id: session, reports, actions };
+    const startTime = performance.now();
+    let response = await ws.request(data);
+    // a node which does not own the session sends the URL of the owner and closes with 4307
+    if (response.location) {
+      console.log("WS /room/ws", "4307", response.location);
+      ws = await connect(response.location);
+      response = await ws.request(data);
+    }
+    const ping = performance.now() - startTime;
+    console.log(`[${ping.toFixed(2).padStart(6, "0")} ms]`, "WS /room/ws", data, response);
+  }
+  ws.close();
+})().catch(console.error);
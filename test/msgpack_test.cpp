@@ -0,0 +1,178 @@
+// Tests of the msgpack reader and writer, and of the decoding of sync requests, which take untrusted bodies.
+
+#include "test.hpp"
+#include "../msgpack.hpp"
+#include "../sync_codec.hpp"
+#include "../errors.hpp"
+
+#include <nlohmann/json.hpp>
+#include <boost/uuid.hpp>
+#include <initializer_list>
+#include <string>
+
+using namespace std;
+using namespace boost::uuids;
+
+using json = nlohmann::json;
+
+/**
+ * Make a buffer of raw bytes.
+ * @param values The bytes.
+ * @return The buffer.
+ */
+string bytes(const initializer_list<uint8_t> values) {
+  return { values.begin(), values.end() };
+}
+
+/**
+ * Encode a JSON value as msgpack.
+ * @param value The value.
+ * @return The msgpack bytes.
+ */
+string to_msgpack(const json &value) {
+  string msgpack;
+  json::to_msgpack(value, msgpack);
+  return msgpack;
+}
+
+// cases
+
+void test_round_trip() {
+  const uuid id = time_generator_v7()();
+  string buffer;
+  msgpack_writer_t writer(buffer);
+  writer.map(4).str("n").uint(70000).str("b").boolean(true).str("id").uuid(id).str("list");
+  const size_t list = writer.open_array();
+  writer.nil().str(string(300, 'x'));
+  writer.close_array(list, 2);
+
+  msgpack_reader_t reader(buffer);
+  expect(reader.map() == 4, "map size");
+  expect(reader.str() == "n" && reader.uint() == 70000, "uint");
+  expect(reader.str() == "b" && reader.boolean(), "boolean");
+  expect(reader.str() == "id" && reader.uuid() == id, "uuid");
+  expect(reader.str() == "list" && reader.array() == 2, "patched array size");
+  expect(reader.nil(), "nil");
+  expect(reader.str() == string(300, 'x'), "str16");
+  expect(reader.empty(), "whole buffer read");
+}
+
+void test_reject_wrong_type() {
+  expect_throw<bad_request_error>([] { msgpack_reader_t(to_msgpack("a")).map(); }, "str read as map");
+  expect_throw<bad_request_error>([] { msgpack_reader_t(to_msgpack(1)).str(); }, "int read as str");
+  expect_throw<bad_request_error>([] { msgpack_reader_t(to_msgpack(-1)).uint(); }, "negative int read as uint");
+  expect_throw<bad_request_error>([] { msgpack_reader_t(to_msgpack(1)).boolean(); }, "int read as boolean");
+  const string buffer = to_msgpack(1);
+  msgpack_reader_t reader(buffer);
+  expect(!reader.nil() && reader.uint() == 1, "nil does not consume other values");
+}
+
+void test_reject_truncated() {
+  expect_throw<bad_request_error>([] { msgpack_reader_t("").map(); }, "empty buffer");
+  expect_throw<bad_request_error>([] { msgpack_reader_t(bytes({ 0xa5, 'a', 'b' })).str(); }, "short fixstr");
+  expect_throw<bad_request_error>([] { msgpack_reader_t(bytes({ 0xcd, 0x01 })).uint(); }, "short uint16");
+  expect_throw<bad_request_error>(
+    [] { msgpack_reader_t(bytes({ 0xdb, 0xff, 0xff, 0xff, 0xff, 'a' })).str(); }, "str32 longer than the buffer"
+  );
+  expect_throw<bad_request_error>([] { msgpack_reader_t(bytes({ 0x92, 0x01 })).skip(); }, "short array skipped");
+}
+
+void test_reject_oversized_counts() {
+  // counts are checked against the remaining bytes, so that callers can size containers by them
+  expect_throw<bad_request_error>(
+    [] { msgpack_reader_t(bytes({ 0xdf, 0xff, 0xff, 0xff, 0xff, 0xc0, 0xc0 })).map(); }, "map32 of 4G pairs"
+  );
+  expect_throw<bad_request_error>(
+    [] { msgpack_reader_t(bytes({ 0xdd, 0x00, 0x01, 0x00, 0x00, 0xc0 })).array(); }, "array32 of 64K elements"
+  );
+  expect_throw<bad_request_error>(
+    [] { msgpack_reader_t(bytes({ 0x83, 0xc0, 0xc0, 0xc0, 0xc0, 0xc0 })).map(); }, "fixmap with a missing value"
+  );
+}
+
+void test_reject_invalid_uuid() {
+  expect_throw<bad_request_error>(
+    [] { msgpack_reader_t(to_msgpack("not-a-uuid")).uuid(); }, "string which is not a UUID"
+  );
+  expect_throw<bad_request_error>(
+    [] { msgpack_reader_t(to_msgpack("0192f0a3-8c5e-7zzz-8000-000000000000")).uuid(); }, "canonical form with non-hex"
+  );
+  const uuid id = time_generator_v7()();
+  expect(msgpack_reader_t(to_msgpack(to_string(id))).uuid() == id, "canonical form");
+  expect(msgpack_reader_t(to_msgpack("{" + to_string(id) + "}")).uuid() == id, "braced form");
+}
+
+void test_skip() {
+  const string value = to_msgpack({ { "a", { 1, -2, 3.5, nullptr, true, "x" } }, { "b", json::binary({ 1, 2 }) } });
+  const string buffer = value + to_msgpack(7);
+  msgpack_reader_t reader(buffer);
+  expect(reader.skip() == value, "skip returns the raw bytes of the value");
+  expect(reader.uint() == 7, "skip stops after the value");
+  expect_throw<bad_request_error>([] { msgpack_reader_t(bytes({ 0xc1 })).skip(); }, "reserved type 0xc1");
+
+  // nesting is counted rather than recursed into
+  string deep(100000, static_cast<char>(0x91));
+  deep.push_back(static_cast<char>(0xc0));
+  expect(msgpack_reader_t(deep).skip().size() == deep.size(), "deeply nested arrays");
+}
+
+void test_parse_sync_request() {
+  const uuid id = time_generator_v7()();
+  const json event = { { "id", to_string(id) }, { "type", "hit" }, { "event", { { "damage", 3 } } } };
+  const string body = to_msgpack(
+    { { "session_id", "0.abc" }, { "users_version", 2 }, { "reports", { event } }, { "actions", json::array() },
+      { "room_info", { 1, 2 } }, { "unknown", { { "x", 1 } } } }
+  );
+  const sync_request_t req = parse_sync_request(body);
+  expect(req.session_id == "0.abc" && req.users_version == 2 && req.info_version == 0, "fields");
+  expect(req.room_info && *req.room_info == to_msgpack({ 1, 2 }), "room_info kept raw");
+  expect(req.reports.size() == 1 && req.actions.empty(), "events");
+  expect(req.reports[0].id == id && req.reports[0].type == "hit", "event id and type");
+  expect(req.reports[0].data == to_msgpack({ { "damage", 3 } }), "event payload kept raw");
+}
+
+void test_reject_sync_request() {
+  expect_throw<bad_request_error>(
+    [] { (void) parse_sync_request(to_msgpack({ { "reports", json::array() }, { "actions", json::array() } })); },
+    "missing session_id"
+  );
+  expect_throw<bad_request_error>(
+    [] { (void) parse_sync_request(to_msgpack({ { "session_id", "0.abc" }, { "reports", json::array() } })); },
+    "missing actions"
+  );
+  expect_throw<bad_request_error>(
+    [] {
+      const json event = { { "id", to_string(time_generator_v7()()) }, { "type", "t" } };
+      (void) parse_sync_request(
+        to_msgpack({ { "session_id", "0.abc" }, { "reports", json::array({ event }) }, { "actions", json::array() } })
+      );
+    },
+    "event without a payload"
+  );
+  expect_throw<bad_request_error>(
+    [] {
+      string body = to_msgpack({ { "session_id", "0.abc" } });
+      body[0] = static_cast<char>(0x82);
+      body += to_msgpack("reports") + bytes({ 0xdc, 0x00, 0x20 }) + string(32, static_cast<char>(0x80));
+      (void) parse_sync_request(body);
+    },
+    "more events than the body can hold"
+  );
+}
+
+// entry point
+
+int main() {
+  return run_tests(
+    {
+      { "round_trip", test_round_trip },
+      { "reject_wrong_type", test_reject_wrong_type },
+      { "reject_truncated", test_reject_truncated },
+      { "reject_oversized_counts", test_reject_oversized_counts },
+      { "reject_invalid_uuid", test_reject_invalid_uuid },
+      { "skip", test_skip },
+      { "parse_sync_request", test_parse_sync_request },
+      { "reject_sync_request", test_reject_sync_request },
+    }
+  );
+}
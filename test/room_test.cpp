@@ -0,0 +1,192 @@
+// Tests of the rounds of a room, which close when all users have arrived or on the timer queue.
+
+#include "test.hpp"
+#include "../room.hpp"
+#include "../sync_record.hpp"
+#include "../event_budget.hpp"
+#include "../timer_queue.hpp"
+
+#include <boost/uuid.hpp>
+#include <chrono>
+#include <cstdint>
+#include <exception>
+#include <future>
+#include <memory>
+#include <string>
+#include <vector>
+
+using namespace std;
+using namespace boost::uuids;
+
+using user_t = room_t::user_t;
+using phase_t = sync_record_t::phase_t;
+
+// Rounds close by timeout after this long, so that a user can sync alone.
+constexpr chrono::milliseconds sync_timeout{ 10 };
+
+// The room is declared after the budget and the timer queue, whose tasks keep the room alive.
+struct fixture_t {
+  event_budget_t event_budget{ SIZE_MAX, SIZE_MAX };
+  timer_queue_t timer_queue;
+  user_t owner{ "owner" };
+  shared_ptr<room_t> room;
+
+  [[nodiscard]] explicit fixture_t(const size_t history_limit, room_t::round_observer on_round_closed = {}) {
+    if (!on_round_closed) on_round_closed = [](const room_t::round_stats_t &) {};
+    room = make_shared<room_t>(
+      "1", owner, "room", room_t::size_max, chrono::minutes{ 1 }, chrono::minutes{ 1 }, history_limit, timer_queue,
+      event_budget, [](const string &) {}, [](const string &) {}, move(on_round_closed)
+    );
+  }
+};
+
+/**
+ * Join a new user to a room.
+ * @param room The room.
+ * @param name The name of the user.
+ * @return The ID of the user.
+ */
+uuid join(room_t &room, const string &name) {
+  const user_t user(name);
+  room.join(room.version, user);
+  return user.id;
+}
+
+/**
+ * Start a sync without events.
+ * @param room The room.
+ * @param user_id The ID of the user.
+ * @param sync_timeout_min The shortest the round may wait for the other users.
+ * @param sync_timeout_max The longest the round may wait for the other users.
+ * @return The result, which a round closed by timeout sets on the thread of the timer queue.
+ */
+future<room_t::sync_result_t> sync(
+  room_t &room, const uuid &user_id, const chrono::milliseconds sync_timeout_min = sync_timeout,
+  const chrono::milliseconds sync_timeout_max = sync_timeout
+) {
+  auto promise = make_shared<std::promise<room_t::sync_result_t>>();
+  auto synced = promise->get_future();
+  room.sync(
+    user_id, {}, {},
+    [promise](const exception_ptr error, room_t::sync_result_t result) {
+      if (error) {
+        promise->set_exception(error);
+      } else {
+        promise->set_value(move(result));
+      }
+    },
+    sync_timeout_min, sync_timeout_max, sync_timeout
+  );
+  return synced;
+}
+
+/**
+ * Get the slot of a user from a snapshot.
+ * @param snapshot The snapshot.
+ * @param user_id The ID of the user.
+ * @return The slot.
+ */
+size_t slot_of(const room_t::snapshot_t &snapshot, const uuid &user_id) {
+  for (const auto &[slot, user]: snapshot.users) {
+    if (user.id == user_id) return slot;
+  }
+  throw test_failure_t{ "user not in the snapshot" };
+}
+
+// cases
+
+void test_reused_slot_starts_created() {
+  fixture_t fixture(8);
+  room_t &room = *fixture.room;
+  const uuid left_id = join(room, "left");
+  const size_t left_slot = slot_of(room.save(), left_id);
+  // the owner never syncs, so every round is kept for the owner
+  for (int i = 0; i < 3; i++) expect(sync(room, left_id).get().records.size() == 1, "a round closed by timeout");
+  const room_t::snapshot_t before = room.save();
+  expect(before.records.size() == 3, "rounds kept for the owner");
+  for (const auto &record: before.records) expect(record->get_phase(left_slot) == phase_t::SYNCED, "synced rounds");
+
+  room.kick(left_id);
+  const uuid joined_id = join(room, "joined");
+  const room_t::snapshot_t after = room.save();
+  expect(slot_of(after, joined_id) == left_slot, "the slot of the kicked user is reused");
+  expect(after.records.size() == 3, "rounds still kept for the owner");
+  for (const auto &record: after.records) {
+    expect(record->get_phase(left_slot) == phase_t::CREATED, "the new user starts every kept round at CREATED");
+  }
+}
+
+void test_lagging_user_resyncs() {
+  fixture_t fixture(2);
+  room_t &room = *fixture.room;
+  const uuid owner_id = fixture.owner.id, player_id = join(room, "player");
+  // the ring holds history_limit sealed rounds and the open one, so older rounds are dropped while the owner lags
+  for (int i = 0; i < 5; i++) expect(sync(room, player_id).get().records.size() == 1, "a round closed by timeout");
+  const room_t::snapshot_t kept = room.save();
+  expect(kept.history_begin == 3 && kept.records.size() == 2, "only history_limit rounds kept");
+
+  const room_t::sync_result_t lagged = sync(room, owner_id).get();
+  expect(lagged.resync, "a user behind history_begin resyncs");
+  expect(lagged.records.size() == 3, "the kept rounds and the synced one");
+  expect(lagged.records[0] == kept.records[0] && lagged.records[1] == kept.records[1], "the kept rounds in order");
+  expect(room.get_user(owner_id).get_sync_cursor() == 6, "the cursor moves past the synced round");
+
+  const room_t::sync_result_t caught_up = sync(room, owner_id).get();
+  expect(!caught_up.resync && caught_up.records.size() == 1, "a user who caught up gets one round");
+  const room_t::sync_result_t player = sync(room, player_id).get();
+  expect(!player.resync && player.records.size() == 3, "the rounds the player missed and the synced one");
+  expect(player.records[0] == lagged.records[2] && player.records[1] == caught_up.records[0], "the missed rounds");
+}
+
+void test_predict_arrival() {
+  using namespace chrono_literals;
+  user_t user("user");
+  expect(!user.predict_arrival(), "no prediction before the first arrival");
+  // the first offset is assumed to deviate by half of itself, and the margin is 3 deviations
+  user.observe_arrival(40ms);
+  expect(user.predict_arrival() == 100ms, "40 ms with a deviation of 20 ms");
+  for (int i = 0; i < 100; i++) user.observe_arrival(40ms);
+  expect(*user.predict_arrival() > 40ms && *user.predict_arrival() < 41ms, "steady arrivals shrink the margin");
+  user.observe_arrival(200ms);
+  expect(*user.predict_arrival() > 200ms, "a late arrival widens the margin beyond itself");
+}
+
+void test_sync_window_clamped() {
+  using namespace chrono_literals;
+  // Returns the window of a round which the owner syncs alone after rounds both users synced.
+  // The window is measured alone, as each arrival shortens the deadline to the users still expected.
+  const auto alone_window = [](
+    const size_t shared_rounds, const chrono::milliseconds min, const chrono::milliseconds max
+  ) {
+    chrono::steady_clock::duration window{};
+    fixture_t fixture(8, [&window](const room_t::round_stats_t &stats) { window = stats.window; });
+    room_t &room = *fixture.room;
+    const uuid player_id = join(room, "player");
+    for (size_t i = 0; i < shared_rounds; i++) {
+      auto owner_synced = sync(room, fixture.owner.id, min, max);
+      auto player_synced = sync(room, player_id, min, max);
+      (void) owner_synced.get(), (void) player_synced.get();
+    }
+    (void) sync(room, fixture.owner.id, min, max).get();
+    return window;
+  };
+
+  // a user who has not arrived yet is expected by initial_sync_window, which is 50 ms
+  expect(alone_window(0, 10ms, 100ms) == 50ms, "the initial window between the limits");
+  expect(alone_window(1, 10ms, 100ms) == 10ms, "a player who arrives right away is waited for sync_timeout_min");
+  expect(alone_window(0, 10ms, 30ms) == 30ms, "clamped to sync_timeout_max");
+  expect(alone_window(0, 80ms, 100ms) == 80ms, "clamped to sync_timeout_min");
+}
+
+// entry point
+
+int main() {
+  return run_tests(
+    {
+      { "reused_slot_starts_created", test_reused_slot_starts_created },
+      { "lagging_user_resyncs", test_lagging_user_resyncs },
+      { "predict_arrival", test_predict_arrival },
+      { "sync_window_clamped", test_sync_window_clamped },
+    }
+  );
+}
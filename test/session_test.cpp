@@ -0,0 +1,104 @@
+// Tests of the signed session tokens of TOKEN mode and of their revocation.
+
+#include "test.hpp"
+#include "../session.hpp"
+#include "../errors.hpp"
+
+#include <boost/uuid.hpp>
+#include <string>
+
+using namespace std;
+using namespace boost::uuids;
+
+using session_mode_t = session_list_t::mode_t;
+
+/**
+ * Generate a room or user ID.
+ * @return The ID.
+ */
+uuid gen_id() {
+  thread_local time_generator_v7 gen;
+  return gen();
+}
+
+// cases
+
+void test_verify() {
+  session_list_t session_list(session_mode_t::TOKEN);
+  const uuid room_id = gen_id(), user_id = gen_id();
+  const session_t session = session_list.create(room_id, user_id);
+  expect(session.id.starts_with("0."), "token starts with the node ID");
+  const session_t verified = session_list.get(session.id);
+  expect(verified.room_id == room_id && verified.user_id == user_id, "token carries the room and the user");
+  expect(session_list.create(room_id, user_id).id == session.id, "a user has one token");
+  expect(session_list.count() == 0, "tokens are not stored");
+}
+
+void test_reject_forged() {
+  session_list_t session_list(session_mode_t::TOKEN, 0, 2);
+  const string token = session_list.create(gen_id(), gen_id()).id;
+  for (size_t i = 2; i < token.size(); i++) {
+    string forged = token;
+    forged[i] = forged[i] == 'A' ? 'B' : 'A';
+    expect_throw<unauthorized_error>([&] { (void) session_list.get(forged); }, "token with a changed character");
+  }
+  expect_throw<unauthorized_error>([&] { (void) session_list.get(token + "A"); }, "token too long");
+  expect_throw<unauthorized_error>([&] { (void) session_list.get(token.substr(0, token.size() - 1)); }, "too short");
+  expect_throw<unauthorized_error>([&] { (void) session_list.get("0." + string(54, '*')); }, "not base64url");
+  expect_throw<unauthorized_error>([&] { (void) session_list.get("2" + token.substr(1)); }, "node outside cluster");
+  expect_throw<redirect_error>([&] { (void) session_list.get("1" + token.substr(1)); }, "token of another node");
+
+  session_list_t other_list(session_mode_t::TOKEN, 0, 2);
+  expect_throw<unauthorized_error>([&] { (void) other_list.get(token); }, "token signed with another secret");
+}
+
+void test_revoke() {
+  session_list_t session_list(session_mode_t::TOKEN);
+  const uuid room_id = gen_id(), kicked_id = gen_id(), other_id = gen_id();
+  const string kicked = session_list.create(room_id, kicked_id).id;
+  const string other = session_list.create(room_id, other_id).id;
+
+  expect(session_list.remove_user(room_id, kicked_id), "kick revokes the token");
+  expect(!session_list.remove_user(room_id, kicked_id), "a token is revoked once");
+  expect(session_list.count() == 1, "the revocation is kept");
+  expect(!session_list.exists(kicked), "revoked token rejected");
+  expect(session_list.exists(other), "other tokens still valid");
+
+  expect(session_list.remove(other), "remove revokes the token");
+  expect(!session_list.exists(other), "removed token rejected");
+
+  // room IDs are never reused, so tokens of a removed room fail on the room rather than here
+  expect(session_list.remove_room(room_id) == 2, "revocations of the room dropped");
+  expect(session_list.count() == 0, "no revocation left");
+  expect(session_list.exists(kicked), "revocation dropped with its room");
+}
+
+void test_restore() {
+  session_list_t session_list(session_mode_t::TOKEN);
+  const uuid room_id = gen_id(), kicked_id = gen_id(), user_id = gen_id();
+  const string kicked = session_list.create(room_id, kicked_id).id;
+  const string token = session_list.create(room_id, user_id).id;
+  session_list.remove_user(room_id, kicked_id);
+
+  session_list_t restored(session_mode_t::TOKEN);
+  restored.restore(session_list.save());
+  expect(restored.exists(token), "tokens signed before the restart still valid");
+  expect(!restored.exists(kicked), "revocations survive the restart");
+
+  session_list_t map_list(session_mode_t::MAP);
+  map_list.restore(session_list.save());
+  expect(map_list.count() == 0, "revocations mean nothing in MAP mode");
+}
+
+// entry point
+
+int main() {
+  return run_tests(
+    {
+      { "verify", test_verify },
+      { "reject_forged", test_reject_forged },
+      { "revoke", test_revoke },
+      { "restore", test_restore },
+    }
+  );
+}
@@ -0,0 +1,183 @@
+// Tests of the snapshots which carry rooms and sessions over a restart.
+
+#include "test.hpp"
+#include "../snapshot.hpp"
+#include "../room_list.hpp"
+#include "../session.hpp"
+#include "../cluster.hpp"
+#include "../sync_record.hpp"
+#include "../event_budget.hpp"
+#include "../timer_queue.hpp"
+#include "../timer_wheel.hpp"
+
+#include <nlohmann/json.hpp>
+#include <boost/uuid.hpp>
+#include <chrono>
+#include <exception>
+#include <filesystem>
+#include <fstream>
+#include <future>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <vector>
+
+using namespace std;
+using namespace boost::uuids;
+
+using json = nlohmann::json;
+using new_event_t = sync_record_t::new_event_t;
+
+constexpr size_t history_limit = 8;
+
+// The state of a server process, which the snapshot is carried between as on a restart.
+struct server_t {
+  const cluster_t cluster;
+  event_budget_t event_budget{ SIZE_MAX, SIZE_MAX };
+  timer_queue_t timer_queue;
+  timer_wheel_t timer_wheel;
+  room_list_t room_list{
+    cluster, 16, chrono::minutes{ 10 }, chrono::minutes{ 10 }, chrono::minutes{ 10 }, history_limit, timer_queue,
+    timer_wheel, event_budget
+  };
+  session_list_t session_list;
+};
+
+/**
+ * Get a path for a snapshot in the temporary directory.
+ * @param name The name of the file.
+ * @return The path, at which no file is left.
+ */
+string temp_path(const string &name) {
+  const auto path = filesystem::temp_directory_path() / ("shoutwars_test_" + name + ".snapshot");
+  filesystem::remove(path);
+  return path.string();
+}
+
+/**
+ * Encode an event payload as a client would send it.
+ * @param value The payload.
+ * @return The raw msgpack payload, kept alive for the views of the events.
+ */
+string_view payload(const json &value) {
+  static vector<unique_ptr<string>> payloads;
+  string &msgpack = *payloads.emplace_back(make_unique<string>());
+  json::to_msgpack(value, msgpack);
+  return msgpack;
+}
+
+/**
+ * Sync a user alone, so that the round closes by timeout.
+ * @param room The room.
+ * @param user_id The ID of the user.
+ * @param events The reports and actions of the user.
+ * @return The result.
+ */
+room_t::sync_result_t sync_alone(room_t &room, const uuid &user_id, const vector<new_event_t> &events) {
+  auto promise = make_shared<std::promise<room_t::sync_result_t>>();
+  auto synced = promise->get_future();
+  room.sync(
+    user_id, events, events,
+    [promise](const exception_ptr error, room_t::sync_result_t result) {
+      if (error) {
+        promise->set_exception(error);
+      } else {
+        promise->set_value(move(result));
+      }
+    },
+    chrono::milliseconds{ 10 }, chrono::milliseconds{ 10 }, chrono::milliseconds{ 10 }
+  );
+  return synced.get();
+}
+
+// cases
+
+void test_round_trip() {
+  const string path = temp_path("round_trip");
+  server_t saved;
+  const room_t::user_t owner("owner"), player("player");
+  const shared_ptr<room_t> room = saved.room_list.create("1", owner, 4);
+  room->join(room->version, player);
+  room->update_info(string(payload({ { "stage", 3 } })));
+  const string owner_session = saved.session_list.create(room->id, owner.id).id;
+  const string player_session = saved.session_list.create(room->id, player.id).id;
+  // the owner never syncs, so the rounds of the player are kept for the owner
+  time_generator_v7 gen;
+  for (int i = 0; i < 3; i++) {
+    const vector<new_event_t> events = {
+      { gen(), "move", payload({ { "round", i } }) }, { gen(), "shot", payload(i) }
+    };
+    (void) sync_alone(*room, player.id, events);
+  }
+  expect(save_snapshot(path, saved.room_list, saved.session_list) == 1, "rooms saved");
+  expect(!filesystem::exists(path + ".tmp"), "the temporary file replaces the snapshot");
+
+  server_t loaded;
+  expect(load_snapshot(path, loaded.room_list, loaded.session_list) == 1, "rooms loaded");
+  const room_t::snapshot_t before = room->save(), after = loaded.room_list.get(room->id)->save();
+  expect(loaded.room_list.get(room->name)->id == room->id, "room found by name");
+  expect(after.version == before.version && after.size == before.size && after.in_lobby, "room fields");
+  expect(after.info->data == before.info->data && after.info->version == 1, "room info");
+  expect(after.users_version == before.users_version, "users version");
+  expect(after.users.size() == 2, "users");
+  for (size_t i = 0; i < after.users.size(); i++) {
+    const auto &[slot, user] = after.users[i];
+    expect(slot == before.users[i].first && user.id == before.users[i].second.id, "user slot");
+    expect(user.get_name() == before.users[i].second.get_name(), "user name");
+    expect(user.get_sync_cursor() == before.users[i].second.get_sync_cursor(), "user sync cursor");
+  }
+  expect(after.history_begin == before.history_begin && after.records.size() == 3, "kept rounds");
+  for (size_t i = 0; i < after.records.size(); i++) {
+    const sync_record_t &record = *after.records[i], &original = *before.records[i];
+    expect(record.id == original.id && record.get_packed_phases() == original.get_packed_phases(), "round phases");
+    expect(record.get_encoded_reports() == original.get_encoded_reports(), "round reports");
+    expect(record.get_encoded_actions() == original.get_encoded_actions(), "round actions");
+  }
+  expect(loaded.event_budget.get_used() == saved.event_budget.get_used(), "events charged to the budget");
+
+  expect(loaded.session_list.get(owner_session).user_id == owner.id, "sessions restored");
+  expect(loaded.session_list.get(player_session).room_id == room->id, "sessions of every user restored");
+  // the owner, who never synced, is sent the kept rounds
+  const room_t::sync_result_t result = sync_alone(*loaded.room_list.get(room->id), owner.id, {});
+  expect(!result.resync && result.records.size() == 4, "the kept rounds and the synced one");
+  expect(result.records[0]->get_reports().size() == 2, "the events of a kept round");
+  filesystem::remove(path);
+}
+
+void test_load_missing_or_broken() {
+  const string path = temp_path("broken");
+  server_t server;
+  expect(load_snapshot(path, server.room_list, server.session_list) == 0, "no snapshot on the first start");
+
+  const room_t::user_t owner("owner");
+  (void) server.room_list.create("1", owner, 2);
+  expect(save_snapshot(path, server.room_list, server.session_list) == 1, "rooms saved");
+  const auto size = filesystem::file_size(path);
+  for (const auto cut: { size - 1, size / 2, uintmax_t{ 1 } }) {
+    filesystem::resize_file(path, cut);
+    server_t loaded;
+    expect_throw<runtime_error>(
+      [&] { (void) load_snapshot(path, loaded.room_list, loaded.session_list); }, "snapshot cut short"
+    );
+    expect(loaded.room_list.count() == 0, "no rooms from a broken snapshot");
+  }
+
+  ofstream(path, ios::binary | ios::trunc) << string_view("\x94\xa3not", 5);
+  server_t other;
+  expect_throw<runtime_error>(
+    [&] { (void) load_snapshot(path, other.room_list, other.session_list); }, "not a snapshot"
+  );
+  filesystem::remove(path);
+}
+
+// entry point
+
+int main() {
+  return run_tests(
+    {
+      { "round_trip", test_round_trip },
+      { "load_missing_or_broken", test_load_missing_or_broken },
+    }
+  );
+}
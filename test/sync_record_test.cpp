@@ -0,0 +1,185 @@
+// Tests of the events of a round, which users append to flat buffers and a k-way merge orders on seal.
+
+#include "test.hpp"
+#include "../sync_record.hpp"
+#include "../msgpack.hpp"
+#include "../errors.hpp"
+
+#include <nlohmann/json.hpp>
+#include <boost/uuid.hpp>
+#include <format>
+#include <memory>
+#include <span>
+#include <string>
+#include <vector>
+
+using namespace std;
+using namespace boost::uuids;
+
+using json = nlohmann::json;
+using new_event_t = sync_record_t::new_event_t;
+
+/**
+ * Make an event ID which sorts by a number.
+ * @param n The number.
+ * @return The ID.
+ */
+uuid event_id(const int n) {
+  return string_generator()(format("0192f0a3-8c5e-7000-8000-{:012x}", n));
+}
+
+/**
+ * Make a user ID.
+ * @param n The number of the user.
+ * @return The ID.
+ */
+uuid user_id(const int n) {
+  return string_generator()(format("0192f0a3-0000-7000-8000-{:012x}", n));
+}
+
+/**
+ * Encode an event payload as a client would send it.
+ * @param value The payload.
+ * @return The raw msgpack payload, kept alive for the views of the events.
+ */
+string_view payload(const json &value) {
+  static vector<unique_ptr<string>> payloads;
+  string &msgpack = *payloads.emplace_back(make_unique<string>());
+  json::to_msgpack(value, msgpack);
+  return msgpack;
+}
+
+/**
+ * Get the IDs of events.
+ * @param events The events.
+ * @return The IDs in order.
+ */
+vector<uuid> ids_of(const span<const sync_record_t::event_t> events) {
+  vector<uuid> ids;
+  for (const auto &event: events) ids.emplace_back(event.id);
+  return ids;
+}
+
+// cases
+
+void test_merge_orders_by_id() {
+  sync_record_t record;
+  // each run is sorted on seal, then the runs are merged
+  const vector<new_event_t> first = { { event_id(5), "t", payload(5) }, { event_id(1), "t", payload(1) } };
+  const vector<new_event_t> second = { { event_id(2), "t", payload(2) }, { event_id(6), "t", payload(6) } };
+  const vector<new_event_t> third = { { event_id(4), "t", payload(4) }, { event_id(3), "t", payload(3) } };
+  record.add_events(user_id(0), 0, first, first);
+  record.add_events(user_id(1), 1, second, {});
+  record.add_events(user_id(2), 2, third, {});
+  expect(record.get_reports().empty(), "no events before seal");
+  record.seal();
+
+  const auto reports = record.get_reports();
+  const vector expected = { event_id(1), event_id(2), event_id(3), event_id(4), event_id(5), event_id(6) };
+  expect(ids_of(reports) == expected, "ID order");
+  for (const auto &event: reports) {
+    const int n = static_cast<int>(event.id.data[15]);
+    expect(event.data == payload(n), "payload follows its event");
+    expect(event.from == user_id(n <= 1 || n == 5 ? 0 : n <= 2 || n == 6 ? 1 : 2), "sender follows its event");
+  }
+  expect(ids_of(record.get_actions()) == vector{ event_id(1), event_id(5) }, "actions merged apart from reports");
+  expect(record.count_events() == 8, "event count");
+}
+
+void test_last_writer_wins() {
+  sync_record_t record;
+  const vector<new_event_t> first = {
+    { event_id(1), "old", payload("first") },
+    { event_id(2), "t", payload("kept") },
+    { event_id(1), "t", payload("again") }
+  };
+  const vector<new_event_t> second = { { event_id(1), "new", payload("second") } };
+  record.add_events(user_id(0), 0, first, {});
+  const size_t buffered = record.get_buffered_size();
+  record.add_events(user_id(1), 1, second, {});
+  record.seal();
+
+  const auto reports = record.get_reports();
+  expect(ids_of(reports) == vector{ event_id(1), event_id(2) }, "duplicate IDs dropped");
+  expect(reports[0].from == user_id(1) && reports[0].type == "new", "the last user to add an ID wins");
+  expect(reports[0].data == payload("second"), "the payload of the winner is kept");
+  expect(reports[1].data == payload("kept"), "other events untouched");
+  expect(record.get_buffered_size() < buffered, "dropped duplicates no longer buffered");
+
+  sync_record_t single;
+  single.add_events(user_id(0), 0, first, {});
+  single.seal();
+  expect(single.get_reports()[0].data == payload("again"), "within a user the later event wins");
+}
+
+void test_write_and_restore() {
+  sync_record_t record;
+  const vector<new_event_t> first = { { event_id(1), "t", payload(1) }, { event_id(3), "t", payload(3) } };
+  const vector<new_event_t> second = { { event_id(2), "t", payload(2) } };
+  record.add_events(user_id(0), 0, first, second);
+  record.add_events(user_id(1), 1, second, {});
+  expect_throw<bad_request_error>([&] { record.add_events(user_id(1), 1, second, {}); }, "a user adds events once");
+  record.seal();
+  expect_throw<bad_request_error>([&] { record.add_events(user_id(2), 2, second, {}); }, "no events after seal");
+
+  string buffer;
+  msgpack_writer_t writer(buffer);
+  const size_t array_pos = writer.open_array();
+  const size_t written_count = record.write_reports(writer, user_id(1), nil_uuid());
+  writer.close_array(array_pos, written_count);
+  expect(written_count == 2, "the own reports of a user are left out");
+  const json written = json::from_msgpack(buffer);
+  expect(written.size() == 2 && written[0]["id"] == to_string(event_id(1)), "written events");
+  expect(written[0]["from"] == to_string(user_id(0)) && written[0]["event"] == 1, "written fields");
+
+  const sync_record_t restored(
+    record.id, record.get_packed_phases(), string(record.get_encoded_reports()), string(record.get_encoded_actions())
+  );
+  expect(ids_of(restored.get_reports()) == ids_of(record.get_reports()), "restored reports");
+  expect(restored.get_reports()[1].from == user_id(1), "restored sender");
+  expect(ids_of(restored.get_actions()) == vector{ event_id(2) }, "restored actions");
+  expect_throw<bad_request_error>(
+    [] { (void) sync_record_t(nil_uuid(), 0, "\x81", ""); }, "encoded events cut short"
+  );
+}
+
+void test_phase_transitions() {
+  using enum sync_record_t::phase_t;
+  sync_record_t record;
+  expect(record.get_max_phase() == CREATED && record.get_packed_phases() == 0, "rounds start at CREATED");
+  expect(record.advance_phase(1, SYNCING), "a slot may skip phases");
+  expect(!record.advance_phase(1, WAITING) && !record.advance_phase(1, SYNCING), "phases only advance");
+  expect(record.get_phase(1) == SYNCING && record.get_phase(0) == CREATED, "slots are independent");
+  expect(record.get_max_phase() == SYNCING, "max phase of SYNCING");
+
+  expect(record.advance_phase(31, SYNCED), "the last slot");
+  expect(record.get_phase(31) == SYNCED && record.get_phase(30) == CREATED, "the last slot does not overflow");
+  expect(record.get_max_phase() == SYNCED, "max phase of SYNCED");
+  expect(record.all_reached(1u << 1 | 1u << 31, SYNCING), "all masked slots reached");
+  expect(!record.all_reached(1u << 0 | 1u << 1, WAITING), "a masked slot behind");
+  expect(record.all_reached(0, SYNCED), "an empty mask");
+
+  const sync_record_t restored(record.id, record.get_packed_phases(), "", "");
+  for (size_t slot = 0; slot < sync_record_t::slot_count; slot++) {
+    expect(restored.get_phase(slot) == record.get_phase(slot), format("restored phase of slot {}", slot));
+  }
+
+  record.reset_phase(31);
+  expect(record.get_phase(31) == CREATED && record.get_phase(1) == SYNCING, "reset only the slot");
+  expect(record.advance_phase(31, WAITING) && record.get_max_phase() == SYNCING, "a reset slot advances again");
+  record.reset_phase(1);
+  expect(record.get_max_phase() == WAITING, "max phase of WAITING");
+}
+
+// entry point
+
+int main() {
+  return run_tests(
+    {
+      { "merge_orders_by_id", test_merge_orders_by_id },
+      { "last_writer_wins", test_last_writer_wins },
+      { "write_and_restore", test_write_and_restore },
+      { "phase_transitions", test_phase_transitions },
+    }
+  );
+}
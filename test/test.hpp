@@ -0,0 +1,55 @@
+#pragma once
+
+#include <exception>
+#include <format>
+#include <initializer_list>
+#include <iostream>
+#include <source_location>
+#include <string>
+#include <string_view>
+#include <utility>
+
+// A minimal runner for the tests, each of which is a plain executable run by CTest.
+// A case is a function which checks its expectations and stops at the first one that fails.
+
+// Thrown when an expectation fails, ending the case.
+struct test_failure_t {
+  std::string message;
+};
+
+inline void expect(
+  const bool condition, const std::string_view what, const std::source_location where = std::source_location::current()
+) {
+  if (!condition) throw test_failure_t{ std::format("{}:{}: {}", where.file_name(), where.line(), what) };
+}
+
+// Expects op to throw error_t.
+template<class error_t, class op_t>
+void expect_throw(
+  op_t &&op, const std::string_view what, const std::source_location where = std::source_location::current()
+) {
+  try {
+    std::forward<op_t>(op)();
+  } catch (const error_t &) {
+    return;
+  }
+  throw test_failure_t{ std::format("{}:{}: {} did not throw", where.file_name(), where.line(), what) };
+}
+
+// Runs every case, printing the failures, and returns the exit status for CTest.
+inline int run_tests(const std::initializer_list<std::pair<std::string_view, void (*)()>> cases) {
+  int failed = 0;
+  for (const auto &[name, run]: cases) {
+    try {
+      run();
+      std::cout << "ok " << name << std::endl;
+      continue;
+    } catch (const test_failure_t &failure) {
+      std::cerr << "FAILED " << name << ": " << failure.message << std::endl;
+    } catch (const std::exception &err) {
+      std::cerr << "FAILED " << name << ": unexpected exception: " << err.what() << std::endl;
+    }
+    failed++;
+  }
+  return failed == 0 ? 0 : 1;
+}
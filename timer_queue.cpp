@@ -0,0 +1,70 @@
+#include "timer_queue.hpp"
+
+#include <utility>
+
+using namespace std;
+
+// timer queue
+
+timer_queue_t::timer_queue_t() : next_seq(0), running(true), worker([this] { run(); }) {}
+
+timer_queue_t::~timer_queue_t() {
+  stop();
+}
+
+void timer_queue_t::schedule(const chrono::steady_clock::time_point time, task_t task) {
+  {
+    lock_guard lock(queue_mutex);
+    queue.emplace(time, next_seq++, move(task));
+  }
+  queue_cv.notify_one();
+}
+
+size_t timer_queue_t::count() const {
+  lock_guard lock(queue_mutex);
+  return queue.size();
+}
+
+void timer_queue_t::stop() {
+  {
+    lock_guard lock(queue_mutex);
+    if (!running) return;
+    running = false;
+  }
+  queue_cv.notify_all();
+  worker.join();
+  // dropped here rather than with the queue, while whatever the tasks hold still exists
+  decltype(queue) dropped;
+  {
+    lock_guard lock(queue_mutex);
+    swap(queue, dropped);
+  }
+}
+
+void timer_queue_t::run() {
+  unique_lock lock(queue_mutex);
+  while (running) {
+    if (queue.empty()) {
+      queue_cv.wait(lock);
+      continue;
+    }
+    if (const auto time = queue.top().time; chrono::steady_clock::now() < time) {
+      queue_cv.wait_until(lock, time);
+      continue;
+    }
+    task_t task = move(const_cast<entry_t &>(queue.top()).task);
+    queue.pop();
+    lock.unlock();
+    try {
+      task();
+    } catch (...) {}
+    lock.lock();
+  }
+}
+
+// timer queue entry
+
+bool timer_queue_t::entry_t::operator>(const entry_t &other) const {
+  if (time != other.time) return time > other.time;
+  return seq > other.seq;
+}
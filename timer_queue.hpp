@@ -0,0 +1,49 @@
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <queue>
+#include <thread>
+#include <vector>
+#include <functional>
+
+// Runs tasks at their deadlines on a single background thread.
+// Tasks must be short because they delay every later task.
+class timer_queue_t {
+public:
+  using task_t = std::function<void()>;
+
+  [[nodiscard]] explicit timer_queue_t();
+
+  timer_queue_t(const timer_queue_t &) = delete;
+
+  timer_queue_t &operator=(const timer_queue_t &) = delete;
+
+  ~timer_queue_t();
+
+  void schedule(std::chrono::steady_clock::time_point time, task_t task);
+
+  [[nodiscard]] size_t count() const;
+
+  // Stops the background thread once the running task returns. Pending tasks are dropped.
+  void stop();
+
+protected:
+  struct entry_t {
+    std::chrono::steady_clock::time_point time;
+    size_t seq;
+    task_t task;
+
+    bool operator>(const entry_t &other) const;
+  };
+
+  mutable std::mutex queue_mutex;
+  std::condition_variable queue_cv;
+  std::priority_queue<entry_t, std::vector<entry_t>, std::greater<>> queue;
+  size_t next_seq;
+  bool running;
+  std::thread worker;
+
+  void run();
+};
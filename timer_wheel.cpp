@@ -0,0 +1,126 @@
+#include "timer_wheel.hpp"
+
+#include <algorithm>
+#include <utility>
+
+using namespace std;
+
+// timer wheel
+
+timer_wheel_t::timer_wheel_t(const chrono::milliseconds tick)
+  : tick(tick), origin(chrono::steady_clock::now()), current(0), next_id(0), running(true),
+    worker([this] { run(); }) {}
+
+timer_wheel_t::~timer_wheel_t() {
+  stop();
+}
+
+timer_wheel_t::id_t timer_wheel_t::schedule(const chrono::steady_clock::time_point deadline, task_t task) {
+  lock_guard lock(wheel_mutex);
+  const id_t id = next_id++;
+  const auto [it, _] = entries.emplace(id, entry_t{ max(to_tick(deadline), current + 1), 0, move(task) });
+  place(id, it->second);
+  return id;
+}
+
+bool timer_wheel_t::reschedule(const id_t id, const chrono::steady_clock::time_point deadline) {
+  lock_guard lock(wheel_mutex);
+  const auto it = entries.find(id);
+  if (it == entries.end()) return false;
+  it->second.expires = max(to_tick(deadline), current + 1);
+  it->second.generation++;
+  place(id, it->second);
+  return true;
+}
+
+bool timer_wheel_t::cancel(const id_t id) {
+  lock_guard lock(wheel_mutex);
+  // the slot keeps a stale reference which is skipped when the slot is reached
+  return entries.erase(id) > 0;
+}
+
+size_t timer_wheel_t::count() const {
+  lock_guard lock(wheel_mutex);
+  return entries.size();
+}
+
+void timer_wheel_t::stop() {
+  {
+    lock_guard lock(wheel_mutex);
+    if (!running) return;
+    running = false;
+  }
+  wheel_cv.notify_all();
+  worker.join();
+}
+
+uint64_t timer_wheel_t::to_tick(const chrono::steady_clock::time_point time) const {
+  if (time <= origin) return 0;
+  // round up so that a task never runs before its deadline
+  return static_cast<uint64_t>((time - origin + tick - chrono::nanoseconds(1)) / tick);
+}
+
+void timer_wheel_t::place(const id_t id, const entry_t &entry) {
+  const uint64_t delta = entry.expires - current;
+  for (size_t level = 0; level < level_count; level++) {
+    if (delta < uint64_t{ 1 } << (slot_bits * (level + 1)) || level == level_count - 1) {
+      // deadlines beyond the last level wait in its furthest slot and are placed again when it is reached
+      const uint64_t expires = min(entry.expires, current + (uint64_t{ 1 } << (slot_bits * level_count)) - 1);
+      levels[level][expires >> (slot_bits * level) & (slot_count - 1)].emplace_back(id, entry.generation);
+      return;
+    }
+  }
+}
+
+void timer_wheel_t::advance(vector<due_t> &tasks) {
+  current++;
+  // move entries of upper levels down when the lower level wraps around
+  for (size_t level = 1; level < level_count; level++) {
+    if ((current & ((uint64_t{ 1 } << (slot_bits * level)) - 1)) != 0) break;
+    const slot_t slot = exchange(levels[level][current >> (slot_bits * level) & (slot_count - 1)], {});
+    for (const auto &[id, generation]: slot) {
+      const auto it = entries.find(id);
+      if (it != entries.end() && it->second.generation == generation) place(id, it->second);
+    }
+  }
+  slot_t &slot = levels[0][current & (slot_count - 1)];
+  slot_t pending;
+  for (const auto &[id, generation]: slot) {
+    const auto it = entries.find(id);
+    if (it == entries.end() || it->second.generation != generation) continue;
+    if (it->second.expires > current) {
+      pending.emplace_back(id, generation);
+      continue;
+    }
+    // the entry stays until the task has run so that the task can reschedule itself
+    tasks.emplace_back(due_t{ id, generation, it->second.task });
+  }
+  slot.clear();
+  for (const auto &[id, generation]: pending) place(id, entries.at(id));
+}
+
+void timer_wheel_t::run() {
+  unique_lock lock(wheel_mutex);
+  while (running) {
+    vector<due_t> tasks;
+    // a tick is processed once it has fully passed
+    const auto elapsed = chrono::steady_clock::now() - origin;
+    while (current < static_cast<uint64_t>(elapsed / tick)) advance(tasks);
+    if (tasks.empty()) {
+      wheel_cv.wait_until(lock, origin + tick * static_cast<int64_t>(current + 1));
+      continue;
+    }
+    lock.unlock();
+    for (due_t &due: tasks) {
+      try {
+        due.task();
+      } catch (...) {}
+    }
+    lock.lock();
+    for (const due_t &due: tasks) {
+      // rescheduled entries have a new generation
+      const auto it = entries.find(due.id);
+      if (it != entries.end() && it->second.generation == due.generation) entries.erase(it);
+    }
+  }
+}
@@ -0,0 +1,78 @@
+#pragma once
+
+#include <array>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#include <functional>
+
+// Hierarchical timer wheel for long deadlines such as room lifetimes and user inactivity.
+// Scheduling, rescheduling and cancelling are O(1), and deadlines are rounded up to the next tick.
+// Tasks run on a single background thread, so they must be short.
+class timer_wheel_t {
+public:
+  using task_t = std::function<void()>;
+  using id_t = uint64_t;
+
+  static constexpr size_t level_count = 4;
+  static constexpr size_t slot_bits = 6;
+  static constexpr size_t slot_count = 1 << slot_bits;
+
+  const std::chrono::milliseconds tick;
+
+  [[nodiscard]] explicit timer_wheel_t(std::chrono::milliseconds tick = std::chrono::milliseconds{ 100 });
+
+  timer_wheel_t(const timer_wheel_t &) = delete;
+
+  timer_wheel_t &operator=(const timer_wheel_t &) = delete;
+
+  ~timer_wheel_t();
+
+  id_t schedule(std::chrono::steady_clock::time_point deadline, task_t task);
+
+  // Returns false if the task has already run or been cancelled. A running task may reschedule itself to run again.
+  bool reschedule(id_t id, std::chrono::steady_clock::time_point deadline);
+
+  bool cancel(id_t id);
+
+  [[nodiscard]] size_t count() const;
+
+  // Stops the background thread. Pending tasks are dropped.
+  void stop();
+
+protected:
+  struct entry_t {
+    uint64_t expires; // in ticks
+    uint64_t generation; // bumped on reschedule so that stale slot references are skipped
+    task_t task;
+  };
+
+  using slot_t = std::vector<std::pair<id_t, uint64_t>>;
+
+  struct due_t {
+    id_t id;
+    uint64_t generation;
+    task_t task;
+  };
+
+  const std::chrono::steady_clock::time_point origin;
+
+  mutable std::mutex wheel_mutex;
+  std::condition_variable wheel_cv;
+  std::array<std::array<slot_t, slot_count>, level_count> levels;
+  std::unordered_map<id_t, entry_t> entries;
+  uint64_t current; // the last processed tick
+  id_t next_id;
+  bool running;
+  std::thread worker;
+
+  // These require wheel_mutex to be locked.
+  [[nodiscard]] uint64_t to_tick(std::chrono::steady_clock::time_point time) const;
+  void place(id_t id, const entry_t &entry);
+  void advance(std::vector<due_t> &tasks);
+
+  void run();
+};
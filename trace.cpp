@@ -0,0 +1,175 @@
+#include "trace.hpp"
+
+#include "errors.hpp"
+#include "msgpack.hpp"
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <format>
+#include <utility>
+
+using namespace std;
+using namespace boost::uuids;
+
+constexpr string_view trace_magic = "ShoutWars trace";
+constexpr uint64_t trace_format = 1;
+// the buffer is written to the file each time it grows beyond this, and at the end of each batch
+constexpr size_t trace_flush_size = 1 << 20;
+
+/**
+ * Read a request written by trace_writer_t::write.
+ * @param value The msgpack array of the request.
+ * @return The request.
+ */
+trace_entry_t read_trace_entry(const string_view value) {
+  msgpack_reader_t reader(value);
+  if (reader.array() != 11) throw bad_request_error("Invalid request.");
+  trace_entry_t entry{};
+  entry.time = chrono::system_clock::time_point(chrono::microseconds(reader.uint()));
+  entry.method = reader.str();
+  entry.path = reader.str();
+  entry.status = static_cast<int>(reader.uint());
+  entry.latency = chrono::microseconds(reader.uint());
+  if (!reader.nil()) entry.session_id = reader.str();
+  entry.room_id = reader.nil() ? nil_uuid() : reader.uuid();
+  entry.report_count = reader.uint();
+  entry.action_count = reader.uint();
+  entry.body = reader.str();
+  if (!reader.nil()) entry.response = string(reader.str());
+  return entry;
+}
+
+vector<trace_entry_t> read_trace(const string_view data) {
+  vector<trace_entry_t> entries;
+  try {
+    msgpack_reader_t reader(data);
+    bool has_header = false;
+    while (!reader.empty()) {
+      string_view value;
+      try {
+        value = reader.skip();
+      } catch (const bad_request_error &) {
+        // the server stopped in the middle of a write
+        if (!has_header) throw;
+        break;
+      }
+      msgpack_reader_t value_reader(value);
+      if (value_reader.array() == 2) {
+        if (value_reader.str() != trace_magic) throw bad_request_error("Not a trace.");
+        if (const uint64_t version = value_reader.uint(); version != trace_format) {
+          throw bad_request_error(format("Unknown trace format: {}.", version));
+        }
+        has_header = true;
+        continue;
+      }
+      if (!has_header) throw bad_request_error("Not a trace.");
+      entries.emplace_back(read_trace_entry(value));
+    }
+  } catch (const bad_request_error &err) {
+    throw runtime_error(format("Invalid trace: {}", err.what()));
+  }
+  return entries;
+}
+
+// trace writer
+
+trace_writer_t::trace_writer_t(const string &path, const size_t capacity, room_resolver resolve_room)
+  : path(path), resolve_room(move(resolve_room)), entries(capacity), file(path, ios::binary | ios::app),
+    signaled(false), running(true), written(0) {
+  if (!file) throw runtime_error(format("Failed to open {}: {}", path, strerror(errno)));
+  // a header each time the file is opened lets a trace span restarts
+  msgpack_writer_t(buffer).array(2).str(trace_magic).uint(trace_format);
+  worker = thread([this] { run(); });
+}
+
+trace_writer_t::~trace_writer_t() {
+  running.store(false, memory_order_release);
+  signaled.store(true, memory_order_release);
+  signaled.notify_one();
+  worker.join();
+}
+
+bool trace_writer_t::push(trace_entry_t entry) {
+  if (!entries.push(move(entry))) return false;
+  if (!signaled.exchange(true, memory_order_acq_rel)) signaled.notify_one();
+  return true;
+}
+
+size_t trace_writer_t::get_dropped() const {
+  return entries.get_dropped();
+}
+
+size_t trace_writer_t::get_written() const {
+  return written.load(memory_order_relaxed);
+}
+
+void trace_writer_t::derive(trace_entry_t &entry) const {
+  entry.session_id.clear();
+  entry.room_id = nil_uuid();
+  entry.report_count = entry.action_count = 0;
+  // bodies which are not msgpack maps, such as those of rejected requests, have nothing to derive
+  try {
+    msgpack_reader_t reader(entry.body);
+    const size_t size = reader.map();
+    for (size_t i = 0; i < size; i++) {
+      const string_view key = reader.str();
+      if (key == "session_id") entry.session_id = reader.str();
+      else if (key == "reports") entry.report_count = msgpack_reader_t(reader.skip()).array();
+      else if (key == "actions") entry.action_count = msgpack_reader_t(reader.skip()).array();
+      else reader.skip();
+    }
+  } catch (const bad_request_error &) {}
+  if (entry.response) {
+    try {
+      msgpack_reader_t reader(*entry.response);
+      const size_t size = reader.map();
+      for (size_t i = 0; i < size; i++) {
+        const string_view key = reader.str();
+        if (key == "session_id") entry.session_id = reader.str();
+        else if (key == "id") entry.room_id = reader.uuid();
+        else reader.skip();
+      }
+    } catch (const bad_request_error &) {}
+  }
+  // the session may have ended since the request, leaving the room unknown
+  if (entry.room_id.is_nil() && !entry.session_id.empty()) entry.room_id = resolve_room(entry.session_id);
+}
+
+void trace_writer_t::write(const trace_entry_t &entry) {
+  msgpack_writer_t writer(buffer);
+  const auto time = chrono::duration_cast<chrono::microseconds>(entry.time.time_since_epoch()).count();
+  writer.array(11).uint(static_cast<uint64_t>(max<int64_t>(time, 0))).str(entry.method).str(entry.path);
+  writer.uint(static_cast<uint64_t>(entry.status)).uint(static_cast<uint64_t>(max<int64_t>(entry.latency.count(), 0)));
+  if (entry.session_id.empty()) writer.nil();
+  else writer.str(entry.session_id);
+  if (entry.room_id.is_nil()) writer.nil();
+  else writer.uuid(entry.room_id);
+  writer.uint(entry.report_count).uint(entry.action_count).str(entry.body);
+  if (entry.response) writer.str(*entry.response);
+  else writer.nil();
+  if (buffer.size() >= trace_flush_size) {
+    file.write(buffer.data(), static_cast<streamsize>(buffer.size()));
+    buffer.clear();
+  }
+}
+
+void trace_writer_t::run() {
+  trace_entry_t entry;
+  while (true) {
+    signaled.wait(false, memory_order_acquire);
+    signaled.exchange(false, memory_order_acq_rel);
+    const bool stopping = !running.load(memory_order_acquire);
+    size_t count = 0;
+    while (entries.pop(entry)) {
+      derive(entry);
+      write(entry);
+      count++;
+    }
+    // flush once per batch instead of once per request
+    file.write(buffer.data(), static_cast<streamsize>(buffer.size()));
+    file.flush();
+    buffer.clear();
+    written.fetch_add(count, memory_order_relaxed);
+    if (stopping) return;
+  }
+}
@@ -0,0 +1,82 @@
+#pragma once
+
+#include "ring_buffer.hpp"
+
+#include <boost/uuid.hpp>
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <functional>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+// A trace is a file of msgpack values appended one after another: a header each time the file is opened,
+// then one array per API request. It records real traffic for bench/replay.cpp to re-issue.
+
+// An API request in a trace.
+struct trace_entry_t {
+  std::chrono::system_clock::time_point time; // when the request headers arrived
+  std::chrono::microseconds latency;
+  std::string method, path;
+  int status;
+  // derived from the bodies by the writer thread
+  std::string session_id; // empty if the request has none
+  boost::uuids::uuid room_id; // nil if unknown
+  size_t report_count, action_count;
+  std::string body; // decoded
+  // kept only for successful create and join requests, whose responses map old sessions to new ones in a replay
+  std::optional<std::string> response;
+};
+
+// Reads every request in a trace. Throws runtime_error if the data is not a trace.
+[[nodiscard]] std::vector<trace_entry_t> read_trace(std::string_view data);
+
+// Appends requests to a trace on a background thread so that API requests never wait for the disk.
+// Requests are passed through a lock-free ring buffer and dropped when it is full.
+class trace_writer_t {
+public:
+  // Returns the room of a session, or nil if the session does not exist.
+  using room_resolver = std::function<boost::uuids::uuid(std::string_view session_id)>;
+
+  const std::string path;
+
+  // capacity is rounded up to a power of two. Throws runtime_error if the file cannot be opened.
+  [[nodiscard]] explicit trace_writer_t(
+    const std::string &path, size_t capacity,
+    room_resolver resolve_room = [](std::string_view) { return boost::uuids::nil_uuid(); }
+  );
+
+  trace_writer_t(const trace_writer_t &) = delete;
+
+  trace_writer_t &operator=(const trace_writer_t &) = delete;
+
+  // Writes every request pushed so far before returning.
+  ~trace_writer_t();
+
+  // Only the fields up to body and response need to be set.
+  bool push(trace_entry_t entry);
+
+  [[nodiscard]] size_t get_dropped() const;
+
+  [[nodiscard]] size_t get_written() const;
+
+protected:
+  const room_resolver resolve_room;
+  ring_buffer_t<trace_entry_t> entries;
+  std::ofstream file;
+  std::string buffer;
+  std::atomic<bool> signaled;
+  std::atomic<bool> running;
+  std::atomic<size_t> written;
+  std::thread worker;
+
+  // Fills the fields derived from the bodies.
+  void derive(trace_entry_t &entry) const;
+
+  void write(const trace_entry_t &entry);
+
+  void run();
+};